@@ -0,0 +1,75 @@
+#ifndef TREEKV_BLOCK_CACHE_H
+#define TREEKV_BLOCK_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include "configManager.h"
+
+using namespace std;
+
+// 解压后的压缩块的缓存，key 为 (groupId, generation, 块在文件里的 offset)
+// 块写下去之后不会再改，同一代文件里的 offset 也不会被复用（initial group 不压缩），所以不需要失效，旧的代删掉后自然被挤出去
+// 按 key 的 hash 分 shard，每个 shard 是一个按字节计预算的 LRU；value 是 shared_ptr，读者拿到之后不怕被淘汰
+class BlockCache {
+
+private:
+
+    struct CacheKey {
+        int groupId;
+        uint32_t generation;
+        size_t offset;
+
+        bool operator==(const CacheKey &rhs) const {
+            return groupId == rhs.groupId && generation == rhs.generation && offset == rhs.offset;
+        }
+    };
+
+    struct CacheKeyHash {
+        size_t operator()(const CacheKey &key) const {
+            return hash<size_t>()(key.offset * 31 + ((size_t) key.generation << 20) + (size_t) (key.groupId + 1));
+        }
+    };
+
+    struct Entry {
+        CacheKey key;
+        shared_ptr<const string> block;
+    };
+
+    struct Shard {
+        mutex m;
+        list<Entry> lru;
+        unordered_map<CacheKey, list<Entry>::iterator, CacheKeyHash> index;
+        size_t bytes = 0;
+        size_t budget = 0;
+    };
+
+    bool enabled;
+
+    vector<Shard *> shards;
+
+    explicit BlockCache(size_t capacityBytes);
+
+    Shard *getShard(const CacheKey &key);
+
+public:
+
+    static BlockCache *getInstance() {
+        static BlockCache instance((size_t) ConfigManager::getInstance().getBlockCacheSize() * 1024 * 1024);
+        return &instance;
+    }
+
+    virtual ~BlockCache();
+
+    // 未命中返回 nullptr
+    shared_ptr<const string> get(int groupId, uint32_t generation, size_t offset);
+
+    void put(int groupId, uint32_t generation, size_t offset, const shared_ptr<const string> &block);
+
+};
+
+#endif //TREEKV_BLOCK_CACHE_H
@@ -7,35 +7,148 @@
 
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <set>
 #include <string>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <random>
 #include "value_layout.h"
+#include "constant.h"
 #include "threadpool/pool.hpp"
 
 using namespace std;
 
+// 一个 group 的写缓冲，各个 group 各自加锁，写入不同 key range 的线程之间互不竞争
+struct GroupBuffer {
+
+    mutex m;
+
+    // active buffer，put 都写到这里
+    unordered_map<string, string> buffer;
+    size_t bufferSize = 0;
+
+    // immutable buffer，active buffer 满了之后和它交换，然后交给 _flushThreadPool 在后台落盘
+    unordered_map<string, string> immutableBuffer;
+    size_t immutableBufferSize = 0;
+
+    // 两个 buffer 里最早的一条记录的 wal lsn，没有记录时为 NO_LSN，wal 里比它老的段才能删
+    uint64_t firstLsn = NO_LSN;
+    uint64_t immutableFirstLsn = NO_LSN;
+
+    // 正在执行的 del 的 wal lsn，del 等 flush 时会放开锁，lsm 里删完之前它的 wal 记录不能删
+    multiset<uint64_t> deletingLsns;
+
+    // 上面三者中最小的，持有 m 时更新，truncateWal 不拿锁直接读
+    atomic<uint64_t> pinnedLsn{NO_LSN};
+
+    // 落过盘但还没有 fdatasync，truncateWal 删 wal 之前要先同步
+    atomic<bool> unsynced{false};
+
+    // immutableBuffer 是否正在后台落盘
+    bool flushing = false;
+
+    condition_variable flushCond;
+
+};
+
 class BufferManager {
 
 private:
 
+    // 保护 initialBuffer 以及 pivots 的生成
+    mutex initialMutex;
+
     unordered_map<string, string> initialBuffer;
     size_t initialBufferSize;
 
-    vector<string> pivots;
+    // initialBuffer 里最早的一条记录的 wal lsn
+    uint64_t initialFirstLsn;
+
+    // 和 GroupBuffer 的 pinnedLsn、unsynced 一样，持有 initialMutex 时更新
+    atomic<uint64_t> initialPinnedLsn;
+    atomic<bool> initialUnsynced;
+
+    // 同一时间只有一个线程在删 wal
+    mutex truncateMutex;
+
+    // initialBuffer 超过 MAX_INITIAL_BUFFER_SIZE 时落到 initial group 的文件里，position 照常写进 lsm
+    // 落过盘之后 get 能在 lsm 里找到这些 key，range 查询和生成 pivots 时要把 lsm 里的也算上
+    bool spilled;
+
+    // pivots 生成之前对写入的 key 做蓄水池抽样，(key, 记录的字节数)，最多 PIVOT_SAMPLES_PER_GROUP * groupNum 个
+    vector<pair<string, size_t>> samples;
+
+    // 抽样时见过的 key 的个数（重复的 put 也算），到 nextPivotsAttempt 时尝试生成 pivots
+    uint64_t sampledCount;
+    uint64_t nextPivotsAttempt;
+
+    mt19937_64 sampleRandom;
+
+    // pivots 生成之后只会被 rebalance 整体替换，读者用 atomic_load 拿一份不变的快照，不需要加锁
+    shared_ptr<const vector<string>> pivots;
+
+    // 每替换一次 pivots 加一，range 查询用它判断查询期间分组有没有变
+    atomic<uint64_t> pivotsVersion;
+
+    // pivots 生成之后置为 true，之后的读写都只需要拿对应 group 的锁
+    atomic<bool> pivotsReady;
+
+    vector<GroupBuffer *> groupBuffers;
 
-    vector<unordered_map<string, string>> buffers;
-    vector<size_t> bufferSizes;
+    int groupNum;
 
     boost::threadpool::pool _flushThreadPool;
 
     BufferManager();
 
+    bool scheduleFlush(int idx, unique_lock<mutex> &lock);
+
+    void backgroundFlush(int idx);
+
+    void waitForFlush(int idx, unique_lock<mutex> &lock);
+
+    // 落盘之后调用，不持有任何 buffer 的锁：删掉 wal 里所有记录都已经落盘的段
+    void truncateWal();
+
+    // 需持有 group 的锁，写 wal 之前调用：把 pinnedLsn 压到 nextLsn，写完之前 truncateWal 不会删掉这条记录
+    void pinNextLsn(atomic<uint64_t> &pinnedLsn);
+
+    // 需持有 group 的锁，firstLsn、immutableFirstLsn、deletingLsns 变了之后调用
+    void updatePin(GroupBuffer *groupBuffer);
+
+    // 锁住 key 所属的 group 的 buffer；拿锁期间分组可能被 rebalance 改掉，所以拿到锁之后要再确认一次
+    unique_lock<mutex> lockBelongingGroup(const string &key, int &idx);
+
+    shared_ptr<const vector<string>> loadPivots();
+
+    // 以下几个都需持有 initialMutex
+
+    void sampleKey(const string &key, size_t size);
+
+    // 重启时 lsm 里还有前缀阶段落盘的 key，从 lsm 里重新抽样，有的话返回 true
+    bool resampleFromLsm();
+
+    // 重启时先用落盘时记下的抽样，和 initial group 的文件对不上时返回 false，再从 lsm 里重新抽样
+    bool loadSamples();
+
+    // 落盘之后记下抽样和 initial group 文件的状态
+    void checkpointSamples();
+
+    void spillInitialBuffer();
+
+    // 用样本生成 pivots，不同的 key 不够分成 groupNum 个 group 时返回 false
+    bool generatePivots();
+
+    // 把 lsm 里还指向 initial group 的 key 按 newPivots 搬到各自的 group，搬完清空 initial group 的文件
+    void migrateSpilledKeys(const vector<string> &newPivots);
+
 public:
 
     virtual ~BufferManager();
 
-    recursive_mutex mutex;
-
     // static BufferManager instance;
 
     static BufferManager *getInstance() {
@@ -44,25 +157,49 @@ public:
     }
 
     // return -1 if not need flush
-    int put(const string &key, const string &value);
+    // lsn 返回这次写入在 wal 里的记录，调用方在不持有锁时用它等 wal 写下去
+    int put(const string &key, const string &value, uint64_t &lsn);
 
     bool get(const string &key, string &value);
 
-    void del(const string &key);
+    // 同时删掉 lsm 里的 key，返回 lsm 删除的结果
+    bool del(const string &key, uint64_t &lsn);
 
-    bool flush(int idx, bool needLock = true);
+    // 把 active buffer 切换为 immutable buffer 并交给后台落盘，只有上一次 flush 还没结束时才会阻塞
+    bool flush(int idx);
 
+    // pivots 生成之前把 initialBuffer 落到 initial group 的文件里
     void flushAll();
 
+    // 把最早的记录的 wal lsn 小于 bound 的 buffer 落盘，wal 的段太多时调用
+    void flushBefore(uint64_t bound);
+
+    // 把落过盘的 group 文件和 lsm 同步下去，之后才能删 wal
+    void syncFlushed();
+
+    // gc 使用，锁住 group idx 的 buffer 并等待它正在进行的后台 flush 结束，返回的锁释放之前该 group 不会开始新的 flush
+    // range 查询只需要在锁内拷贝 buffer，waitFlush 为 false，不等待 flush
+    unique_lock<mutex> lockGroup(int idx, bool waitFlush = true);
+
+    // range 查询使用，需持有 lockGroup 返回的锁：把 group idx 的 active 和 immutable buffer 中 >= startingKey 的数据按 key 排好序拷出来
+    void copyGroupBuffer(int idx, const string &startingKey, map<string, string> &entries);
+
     bool pivotsGenerated();
 
-    void initialGetRange(std::string &startingKey, int numKeys, std::vector<std::string> &keys,
+    // pivots 生成之前的 range 查询，合并 initialBuffer 和 lsm 里落过盘的 key；pivots 已经生成了则返回 false
+    bool initialGetRange(const std::string &startingKey, int numKeys, std::vector<std::string> &keys,
                          std::vector<std::string> &values);
 
     int getBelongingGroup(const string &key);
 
     vector<string> getGroupBound(int groupId);
 
+    uint64_t getPivotsVersion();
+
+    // 把 group boundary 和 boundary + 1 之间的 pivot 改成 pivot，两边 buffer 里换了 group 的数据跟着挪过去
+    // 调用方用 lockGroup 按顺序锁住了这两个 group（等 flush 结束），返回新的 pivots 的序列化结果
+    string setPivot(int boundary, const string &pivot);
+
 };
 
 
@@ -44,12 +44,18 @@ public:
     segment_len_t getColdStorageBufferSize() const;
     std::string getColdStorageDevice() const;
     bool useSeparateColdStorageDevice() const;
+    uint32_t getHotThreshold() const;
+    double getColdGarbageRatio() const;
 
     // key management
     std::string getLSMTreeDir() const;
     std::string getVALDir() const;
     segment_len_t getKVLocationCacheSize() const;
     bool dbNoCompress() const;
+    bool paddedKeys() const;
+    void setPaddedKeys(bool padded);
+    bool compressValues() const;
+    uint32_t getBlockCacheSize() const;
 
     // log metadata
     bool persistLogMeta() const;
@@ -58,6 +64,13 @@ public:
     uint32_t getGreedyGCSize() const;
     GCMode getGCMode() const;
     uint32_t getNumGCReadThread() const;
+    uint32_t getNumGCThread() const;
+    bool rebalanceGroups() const;
+    bool backgroundGC() const;
+    double getGCSpaceThreshold() const;
+    double getGCGarbageRatio() const;
+    uint32_t getGCIdleSeconds() const;
+    double getGCIdleGarbageRatio() const;
 
     // kv-separation
     uint32_t getMinValueSizeToLog() const;
@@ -69,6 +82,8 @@ public:
 
     // consistency
     bool enableCrashConsistency() const;
+    bool syncWal() const;
+    uint32_t getWalSyncInterval() const;
 
     // misc
     uint32_t getHashTableDefaultSize() const;
@@ -81,7 +96,15 @@ public:
     bool enabledScanReadAhead() const;
     len_t getBatchWriteThreshold() const;
     bool useMmap() const;
+    bool verifyChecksum() const;
     int getMaxOpenFiles() const;
+    uint32_t getLocationCacheSize() const;
+    uint32_t getValueCacheSize() const;
+    uint32_t getGroupNum() const;
+    uint32_t getPivotSampleKeys() const;
+
+    // 打开已有的数据库时，用 lsm 里记录的 group 个数覆盖配置
+    void setGroupNum(uint32_t groupNum);
 
     // debug
     DebugLevel getDebugLevel() const;
@@ -94,12 +117,17 @@ private:
     void operator=(ConfigManager const&); // Don't implement
     
     bool readBool (const char* key);
+    bool readBool (const char* key, bool defaultValue);
     int readInt (const char* key);
     unsigned int readUInt (const char* key);
+    // 配置文件里没有这一项时返回 defaultValue，用于后来新加的可选配置
+    unsigned int readUInt (const char* key, unsigned int defaultValue);
     LL readLL (const char* key);
     ULL readULL (const char* key);
     double readFloat(const char* key);
+    double readFloat(const char* key, double defaultValue);
     std::string readString (const char* key);
+    std::string readString (const char* key, const std::string &defaultValue);
 
     boost::property_tree::ptree _pt;
 
@@ -124,6 +152,8 @@ private:
         bool useSlave;                            // use a slave storage for cold items
         len_t coldStorageSize;                    // size of the cold storage
         std::string coldStorageDevice;            // separate device for cold storage
+        uint32_t hotThreshold;                    // min. estimated update count for a value to stay hot in gc
+        double coldGarbageRatio;                  // start gc on a cold file when its garbage ratio reaches this
     } _hotness;
 
     struct {
@@ -131,10 +161,13 @@ private:
         segment_len_t locationCacheSize;        // max. number of key-value locations to cache
         int dbType;                               // type of db to use
         bool compress;                            // Whether to use snappy compression
+        bool padded;                              // keys are space padded to KEY_LENGTH (dbs created before variable-length keys)
     } _key;
 
     struct {
         std::string Dir;                   // directory for placing VAL-LOG
+        bool compress;                            // write group files as snappy compressed blocks
+        uint32_t blockCacheSize;                  // memory budget of the decompressed block cache (MB), 0 to disable
     } _val;
 
     struct {
@@ -145,6 +178,13 @@ private:
         uint32_t greedyGCSize;                    // max. number of segments selected for GC
         GCMode mode;                              // GC mode
         uint32_t numReadThread;                   // Number of read threads to get segments from disk
+        uint32_t numThread;                       // number of groups collected concurrently
+        bool background;                          // run gc in a background scheduler thread
+        double spaceThreshold;                    // start gc when db size reaches this fraction of DISK_SIZE
+        double garbageRatio;                      // start gc on a group when its garbage ratio reaches this
+        uint32_t idleSeconds;                     // no flush for this long counts as idle
+        double idleGarbageRatio;                  // garbage ratio that is enough to gc a group when idle
+        bool rebalance;                           // move key ranges from overloaded groups to their neighbours
     } _gc;
 
     struct {
@@ -158,7 +198,9 @@ private:
     } _vlog;
 
     struct {
-        bool crash;
+        bool crash;                               // log writes in the WAL and replay it after a crash
+        bool walSync;                             // fsync the WAL before a write returns
+        uint32_t walSyncInterval;                 // interval of the background WAL fsync (ms) when walSync is off
     } _consistency;
 
     struct {
@@ -172,7 +214,12 @@ private:
         bool scanReadAhead;
         len_t batchWriteThreshold;                // max size of batches of writes to a segment for buffer flush
         bool useMmap;
+        bool verifyChecksum;                      // verify record checksums on get / range reads
         int maxOpenFiles;                         // max number of open files
+        uint32_t locationCacheSize;               // memory budget of the key location cache (MB)
+        uint32_t valueCacheSize;                  // memory budget of the value cache (MB), 0 to disable
+        uint32_t groupNum;                        // number of groups, the one stored in the db wins
+        uint32_t pivotSampleKeys;                 // number of writes observed before choosing pivots
     } _misc;
 
     struct {
@@ -10,28 +10,157 @@ static const int POOL_THREADS_NUM = 8;
 // 40GB
 static const size_t DISK_SIZE = 40L * 1024 * 1024 * 1024;
 
-// 每 5s 进行一次 gc check
-static const int GC_CHECK_INTERVAL = 999999999;
-
+// 后台 gc 线程每隔 GC_CHECK_INTERVAL 秒检查一次是否需要 gc，flush 之后也会被唤醒检查
+static const int GC_CHECK_INTERVAL = 1;
+
+// 后台 gc 的默认触发条件，可由 gc.spaceThreshold / gc.garbageRatio / gc.idleSeconds / gc.idleGarbageRatio 配置：
+// 总大小达到 DISK_SIZE 的 80%，或者某个 group 的垃圾比例达到 50%，或者空闲 10s 之后某个 group 的垃圾比例达到 20%
+static const double GC_DEFAULT_SPACE_THRESHOLD = 0.8;
+static const double GC_DEFAULT_GARBAGE_RATIO = 0.5;
+static const uint32_t GC_DEFAULT_IDLE_SECONDS = 10;
+static const double GC_DEFAULT_IDLE_GARBAGE_RATIO = 0.2;
+
+// 并行 gc 的默认线程数（gc.numGCThread）和每一轮最多挑选的 group 数（gc.greedyGCSize，默认和线程数相同）
+static const uint32_t GC_DEFAULT_THREAD_NUM = 4;
+
+// wal：每个段最多 WAL_SEGMENT_SIZE 字节，写满了换新的段；段数超过 WAL_MAX_SEGMENTS 时把还占着最老的段的 group 落盘
+// 没有开 consistency.walSync 时后台每 WAL_DEFAULT_SYNC_INTERVAL 毫秒 fsync 一次（可由 consistency.walSyncIntervalMs 配置）
+static const size_t WAL_SEGMENT_SIZE = 64 * 1024 * 1024;
+static const size_t WAL_MAX_SEGMENTS = 16;
+static const uint32_t WAL_DEFAULT_SYNC_INTERVAL = 100;
+
+// 还没有 wal 记录的 buffer 的 lsn
+static const uint64_t NO_LSN = ~(uint64_t) 0;
+
+// 冷热分离，可由 hotness.levels / hotness.hotThreshold / hotness.coldGarbageRatio 配置：
+// gc 时估计的更新次数不到 2 次的 value 降级到 group 的冷文件里；冷文件垃圾比例达到 80% 才 gc，比热文件晚得多
+static const uint32_t HOTNESS_DEFAULT_LEVELS = 2;
+static const uint32_t HOTNESS_DEFAULT_HOT_THRESHOLD = 2;
+static const double HOTNESS_DEFAULT_COLD_GARBAGE_RATIO = 0.8;
+
+// 估计更新次数的 count-min sketch：HOTNESS_SKETCH_DEPTH 行，每行 HOTNESS_SKETCH_WIDTH 个 8 位计数器，
+// 每记录 HOTNESS_SKETCH_WIDTH * HOTNESS_SKETCH_RESET_FACTOR 次所有计数器减半，旧的更新慢慢失效
+static const int HOTNESS_SKETCH_DEPTH = 4;
+static const size_t HOTNESS_SKETCH_WIDTH = 1 << 20;
+static const size_t HOTNESS_SKETCH_RESET_FACTOR = 8;
+
+// rebalance：live 字节数加上最近写入量（每秒写入字节数 * REBALANCE_HOT_WINDOW 秒）算作一个 group 的负载，
+// 负载超过平均值 REBALANCE_SPLIT_FACTOR 倍并且 live 字节数不少于 REBALANCE_MIN_GROUP_SIZE 的 group 会把一部分 key range 挪给负载较小的相邻 group
+static const double REBALANCE_SPLIT_FACTOR = 2.0;
+static const size_t REBALANCE_MIN_GROUP_SIZE = 64L * 1024 * 1024;
+static const int REBALANCE_HOT_WINDOW = 60;
+
+// gc 每次从 lsm 取的 position 个数，以及每个 chunk（一次读、一次写、一个 WriteBatch）最多的字节数
+static const int GC_SCAN_KEY_NUM = 4096;
+static const size_t GC_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// 读计划里一条记录离某个 extent 的末尾不超过这么多字节时接到这个 extent 上，多读一点中间的死数据换少一次 io
+static const size_t READ_MERGE_GAP = 16 * 1024;
+
+// 旧的数据库里 key 都用空格补齐到 KEY_LENGTH，新建的数据库里 key 按原来的长度存，最长 MAX_KEY_SIZE
 static const int KEY_LENGTH = 32;
-
-// initial buffer 的大小，用键值对的数量即可
-static const int MAX_INITIAL_BUFFER_AMOUNT = 10000;
+static const size_t MAX_KEY_SIZE = 0xffff;
+
+// group 文件里的一条记录：[4B 版本和 valueSize][4B crc32c][2B keySize][key][value]，crc 覆盖除它自己以外的整条记录
+// 第一个 4B 的高 4 位是记录格式的版本，低 28 位是 valueSize；以前的两种格式 key 都是定长的 KEY_LENGTH：
+// 版本 1 是 [4B 版本和 valueSize][4B crc32c][key][value]，版本 0 是没有 crc 的 [4B valueSize][key][value]
+static const uint32_t RECORD_FORMAT_VERSION = 3;
+static const uint32_t FIXED_KEY_RECORD_VERSION = 1;
+static const int RECORD_VERSION_SHIFT = 28;
+static const uint32_t MAX_VALUE_SIZE = (1u << RECORD_VERSION_SHIFT) - 1;
+static const size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t) + sizeof(uint16_t);
+static const size_t FIXED_KEY_RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+static const size_t LEGACY_RECORD_HEADER_SIZE = sizeof(uint32_t);
+
+// 打开 val.compression 时 flush 和 gc 写的是压缩块：[4B 版本和压缩后长度][4B 原始长度][4B crc32c][snappy 压缩的若干条记录]
+// 第一个 4B 的高 4 位是 BLOCK_FORMAT_VERSION，和记录的版本共用，所以同一个文件里可以混着放块和单独的记录
+// crc 覆盖前 8B 和压缩后的数据；一个块里的记录原始大小凑到 COMPRESSION_BLOCK_SIZE 左右，压缩省不到 1/8 时直接写记录
+static const uint32_t BLOCK_FORMAT_VERSION = 2;
+static const size_t BLOCK_HEADER_SIZE = 3 * sizeof(uint32_t);
+static const size_t COMPRESSION_BLOCK_SIZE = 32 * 1024;
+
+// 解压后的块的缓存的 shard 数，以及默认的内存预算（MB，可由 val.blockCacheSize 配置，0 表示关闭）
+static const int BLOCK_CACHE_SHARD_NUM = 16;
+static const uint32_t BLOCK_CACHE_DEFAULT_SIZE = 64;
+
+// 生成 pivots 之前先观察的写入个数（可由 misc.pivotSampleKeys 配置），这段前缀里的 key 用蓄水池抽样，
+// 每个 group 平均抽 PIVOT_SAMPLES_PER_GROUP 个，pivots 取样本按字节数加权的等分点
+static const uint32_t PIVOT_DEFAULT_SAMPLE_KEYS = 10000;
+static const int PIVOT_SAMPLES_PER_GROUP = 64;
+
+// 前缀阶段内存里的 initial buffer 最多这么多字节，超过了就落到 initial group 的文件里，position 照常写进 lsm
+static const size_t MAX_INITIAL_BUFFER_SIZE = 64 * 1024 * 1024;
 
 // 4MB，各个 group 的 buffer 的大小
 static const int MAX_BUFFER_SIZE = 4 * 1024 * 1024;
 
-static const int GROUP_NUM = 256;
+// 新建数据库时默认的 group 个数（可由 misc.groupNum 配置），建好之后以 lsm 里记录的 GROUP_NUM_KEY 为准
+static const uint32_t DEFAULT_GROUP_NUM = 256;
+
+// lsm position 缓存的 shard 数，以及默认的内存预算（MB，可由 misc.locationCacheSize 配置）
+static const int LOCATION_CACHE_SHARD_NUM = 64;
+static const uint32_t LOCATION_CACHE_DEFAULT_SIZE = 64;
+
+// value 缓存的 shard 数，以及默认的内存预算（MB，可由 misc.valueCacheSize 配置，0 表示关闭）
+static const int VALUE_CACHE_SHARD_NUM = 16;
+static const uint32_t VALUE_CACHE_DEFAULT_SIZE = 128;
+
+// io_uring 读引擎：每个线程一个 ring，队列深度以及注册给内核的固定 buffer 的槽位大小
+// 每个线程固定占用 IO_URING_QUEUE_DEPTH * IO_URING_SLOT_SIZE = 4MB，比槽位大的 extent 单独 malloc
+static const int IO_URING_QUEUE_DEPTH = 32;
+static const size_t IO_URING_SLOT_SIZE = 128 * 1024;
 
-// 各个 lru 的容量
-static const int LEVELDB_LRU_CAPACITY = 20000;
-static const int FILE_LRU_CAPACITY = 250;
+// mmap 读模式下每个 group 文件预留的虚拟地址空间，至少 1GB，文件超过预留的一半后翻倍
+// 只占地址空间，不占内存；预留得足够大，追加写时基本不需要重新映射
+static const size_t MMAP_MIN_RESERVE_SIZE = 1L * 1024 * 1024 * 1024;
 
 static const bool LOCK = true;
 static const bool UNLOCK = false;
 
 static const std::string PIVOTS_KEY = "+(!%)$*";
 
+// lsm 中 position 的编码格式，没有这个 key 说明还是旧的 "group,offset,length" 文本格式
+static const std::string POSITION_FORMAT_KEY = "+(!%)$*F";
+
+// lsm 和 group 文件里的 key 的格式，"1" 为变长的 key；没有这个 key 的旧数据库里 key 都补齐到了 KEY_LENGTH
+static const std::string KEY_FORMAT_KEY = "+(!%)$*K";
+static const std::string KEY_FORMAT_VARIABLE = "1";
+static const std::string KEY_FORMAT_PADDED = "0";
+
+// 各个 group 的 dead bytes 和上次 gc 时间，key 为前缀加上 groupId
+static const std::string GROUP_STATS_KEY_PREFIX = "+(!%)$*S";
+
+// 数据库的 group 个数
+static const std::string GROUP_NUM_KEY = "+(!%)$*N";
+
+// 正在进行的 rebalance，"boundary|新的 pivot"，重启时发现它说明上次没做完，要重新做一遍
+static const std::string REBALANCE_KEY = "+(!%)$*R";
+
+// 启动用的 checkpoint：各个文件的当前代、代数、大小，以及 increments 和 flush 写入的字节数，还有数据库的大小
+// flush 和 gc 结束时最多每 CHECKPOINT_INTERVAL 秒写一次，正常退出时再写一次；和文件对不上的部分启动时重新统计
+static const std::string CHECKPOINT_KEY = "+(!%)$*C";
+static const int64_t CHECKPOINT_INTERVAL = 10;
+static const int CHECKPOINT_VERSION = 1;
+
+// pivots 生成之前，initial buffer 每次落盘时记下的抽样，和 initial group 的文件对得上时重启后不用扫 lsm 重新抽样
+static const std::string INITIAL_SAMPLES_KEY = "+(!%)$*I";
+
+// position 的二进制编码：[1B 版本][4B groupId][5B offset][4B length]，小端
+static const char POSITION_FORMAT_VERSION = 0x01;
+static const int POSITION_ENCODED_SIZE = 14;
+
+// gc 搬到第 1 代及以后的文件里的 position 在末尾多存 4B 的 generation
+static const char POSITION_FORMAT_GEN_VERSION = 0x02;
+static const int POSITION_GEN_ENCODED_SIZE = 18;
+
+// 压缩块里的记录的 position 再多存 4B 的块长度和 4B 的块内偏移，offset 是块在文件里的位置
+// length 是这条记录按原始大小分摊到的压缩后字节数，dead bytes 和 gc 的 chunk 按它来算
+static const char POSITION_FORMAT_BLOCK_VERSION = 0x03;
+static const int POSITION_BLOCK_ENCODED_SIZE = 26;
+
+// 旧格式 position 迁移时每个 WriteBatch 的大小
+static const int POSITION_MIGRATE_BATCH_SIZE = 10000;
+
 static const std::string DELETED_VALUE = "+(!@$*";
 
 static const std::string INVALID_KEY = "+(!@$*G!B";
@@ -39,6 +168,9 @@ static const std::string INVALID_KEY = "+(!@$*G!B";
 static const std::string INF_LOWER_BOUND = "+(!B";
 static const std::string INF_UPPER_BOUND = "!@!B";
 
+// lsm 里的元数据和内部用的特殊 key 都以它开头，变长的 key 不再补齐，用户的 key 不能以它开头，也不能是 INF_UPPER_BOUND
+static const std::string RESERVED_KEY_PREFIX = "+(!";
+
 static const int INITIAL_GROUP_ID = -1;
 
 static const int INVALID_GROUP_ID = INT32_MAX;
@@ -0,0 +1,11 @@
+#ifndef TREEKV_CRC32C_H
+#define TREEKV_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// crc32c（Castagnoli），x86 上有 SSE4.2、arm 上有 ARMv8 CRC 扩展时用硬件指令，否则查表
+// crc 传入上一段的结果可以接着算，第一段传 0
+uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0);
+
+#endif //TREEKV_CRC32C_H
@@ -8,18 +8,34 @@
 #include <string>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
 #include <boost/thread.hpp>
-#include "lru_list.h"
+#include <vector>
 #include "configManager.h"
+#include "constant.h"
+#include "define.h"
 
 using namespace std;
 
-// 原本的 FILE* 作为 lru 的 ValueType 的话没法 fclose，因此包一层
+// 一个 group 文件的映射，size 是预留的长度，可以比文件本身大
+// 只有持有文件的独占锁时才会被替换，持有共享锁的读者可以放心使用
+struct FileMapping {
+    uint8_t *addr;
+    size_t size;
+};
+
+// group 某一代的文件。gc 把存活的数据搬到新的一代里，搬完之后旧的一代被删除
+// 第 0 代就是原来的 group@N@，之后的是 group@N@.<generation>
 class FileWrapper {
 public:
-    FILE *fp;
+    int fd;
+
+    uint32_t generation;
+
+    // mmap 读模式下的映射，没开 mmap 时是 nullptr
+    FileMapping *mapping;
 
-    explicit FileWrapper(FILE *fp);
+    FileWrapper(int fd, uint32_t generation);
 
     virtual ~FileWrapper();
 };
@@ -28,20 +44,49 @@ class FileManager {
 
 private:
 
-    LruList<int, FileWrapper *> *openedFiles;
+    // 各个 group 现存的各代文件，按 generation 从小到大，最后一个是正在追加写的当前代
+    // 读写这个表需持有 group 文件的锁（共享或独占），只有持有独占锁时才会修改
+    // 下标是 groupId - INITIAL_GROUP_ID，共 2 * groupNum + 1 个
+    // [0, groupNum) 是各个 group 的热文件，[groupNum, 2 * groupNum) 是对应的冷文件，冷热分离没有开时冷文件的位置是空的
+    vector<vector<FileWrapper *>> groupFiles;
+
+    // 当前代的 generation 和已经分配出去的长度，不持锁也可以读
+    // 追加写先在 activeSizes 上占位再写，所以 flush 和 gc 可以同时往当前代里追加
+    vector<atomic<uint32_t>> activeGenerations;
+    vector<atomic<size_t>> activeSizes;
+
+    int groupNum;
+
+    bool coldEnabled;
 
-    unordered_map<int, recursive_mutex *> fileMutexes;
+    bool useMmap;
+
+    FileMapping *mapFile(int groupId, int fd, size_t fileSize);
+
+    // 调用方持有文件的锁
+    FileWrapper *findFile(int groupId, uint32_t generation);
+
+    // 打开启动时已经存在的各代文件，没有的 group 创建第 0 代
+    void loadFiles();
+
+    // 冷文件所在的目录，配置了 hotness.coldStorageDevice 时放到那里
+    string getColdDir();
+
+    // 文件写到 fileSize 之后，如果超出了映射的范围就重新映射，需持有文件的独占锁
+    void remapFile(int groupId, uint32_t generation, size_t fileSize);
+
+    // 读文件（pread）和追加写持有共享锁，gc 切换、删除文件时持有独占锁
+    // 和 groupFiles 一样按 groupId - INITIAL_GROUP_ID 下标，构造时全部建好，之后不再改动，取锁时不用再加全局锁
+    vector<RWMutex *> fileMutexes;
 
     FileManager(const char *val_dir);
 
-    recursive_mutex *getFileMutex(int groupId);
+    RWMutex *getFileMutex(int groupId);
     // static FileManager* instance;
     // static std::mutex instance_mutex;
 
 public:
 
-    recursive_mutex mutex;
-
     virtual ~FileManager();
 
     // static FileManager *getInstance() {
@@ -61,16 +106,62 @@ public:
         return &instance;
     }
 
-    string getFilename(int groupId);
+    string getFilename(int groupId, uint32_t generation = 0);
 
-    FILE *openFile(int groupId);
+    // 冷文件的 groupId 是 group 的 groupId 加上 groupNum，文件名是 cold@N@，读写、gc、加锁都和热文件一样按 groupId 进行
+    bool isColdGroup(int groupId);
 
-    FILE *resetFile(int groupId);
+    int getColdGroupId(int groupId);
 
+    // 文件属于哪个 group（key range），热文件就是它自己
+    int getOwnerGroupId(int groupId);
+
+    // 各个 group 的冷文件是否已经打开
+    bool coldFilesEnabled();
+
+    // 返回 group 某一代文件的 fd，需持有文件的锁，这一代已经被删除时返回 -1
+    int openFile(int groupId, uint32_t generation);
+
+    // 截断当前代，需持有文件的独占锁
+    int resetFile(int groupId);
+
+    // 按 offset 读，不依赖也不修改文件的当前偏移，因此多个线程可以同时读同一个文件，需持有文件的锁
+    bool readAt(int groupId, uint32_t generation, void *data, size_t length, size_t offset);
+
+    // 追加到当前代的末尾，返回写入的 offset，generation 返回写到了哪一代；自己加锁，调用方不能持有文件的锁
+    size_t appendFile(int groupId, const void *data, size_t length, uint32_t &generation);
+
+    // mmap 读模式下返回 [offset, offset + length) 在映射里的地址，需持有文件的锁
+    // 没开 mmap 或者超出了映射的范围时返回 nullptr，调用方退回 pread
+    const uint8_t *mappedData(int groupId, uint32_t generation, size_t offset, size_t length);
+
+    // gc 使用，需持有文件的独占锁：创建新的一代作为当前代，返回它的 generation
+    uint32_t addGeneration(int groupId);
+
+    // gc 使用，需持有文件的独占锁：删除比 generation 旧的各代文件，返回释放的字节数
+    // 调用方要先用 syncFile 把搬过去的数据落盘、再把 lsm 同步落盘
+    size_t retireGenerations(int groupId, uint32_t generation);
+
+    // 把 group 现存各代文件写入的数据和所在目录落盘，自己加共享锁，调用方不能持有文件的锁
+    void syncFile(int groupId);
+
+    uint32_t getGeneration(int groupId);
+
+    // 现存的代数，自己加共享锁，调用方不能持有文件的锁
+    size_t getGenerationCount(int groupId);
+
+    // 独占锁，不可重入
     void operateFileMutex(int groupId, bool lock);
 
+    // 共享锁，读文件和追加写时使用，不可重入
+    void operateFileSharedMutex(int groupId, bool lock);
+
+    // 当前代的大小，不需要持锁
     size_t getFileSize(int groupId);
 
+    // 现存各代文件的总大小，只在启动时统计数据库大小用
+    size_t getDiskSize(int groupId);
+
 };
 
 #endif //TREEKV_FILE_MANAGER_H
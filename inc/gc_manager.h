@@ -8,8 +8,8 @@
 #include <thread>
 #include <vector>
 #include <mutex>
-#include <boost/asio/io_service.hpp>
-#include <boost/asio/steady_timer.hpp>
+#include <condition_variable>
+#include "constant.h"
 
 using namespace std;
 
@@ -17,28 +17,65 @@ class GcManager {
 
 private:
 
-    // boost::asio::io_service &ctx;
-    // boost::asio::steady_timer timer;
-    // std::thread thread;
+    // 后台 gc 线程，每隔 GC_CHECK_INTERVAL 秒或者被 wakeUp 唤醒时检查一次是否需要 gc
+    std::thread thread;
+
+    mutex m;
+
+    condition_variable cond;
+
+    // 每做完一轮检查就通知一次，等待空间的 flush 在这里等
+    condition_variable roundCond;
+
+    bool running = false;
+
+    bool wakeUpRequested = false;
+
+    // 已经做完的检查轮数
+    uint64_t rounds = 0;
+
+    // 每个 group 一把，同一个 group 上的 gc 串行进行，不同 group 的 gc 互不影响
+    vector<mutex> groupGcMutexes;
 
-    // explicit GcManager(boost::asio::io_service &_ctx);
     explicit GcManager();
 
-    // void startTimer();
+    void backgroundGC();
+
+    // 按 空间 -> 垃圾比例 -> 空闲 的顺序挑选这一轮要 gc 的 group，最多 gc.greedyGCSize 个，不需要 gc 时返回空
+    // requested 表示这一轮是等空间的 flush 唤醒的
+    vector<int> pickGroups(bool requested);
 
 public:
 
     static GcManager *getInstance() {
-        // static boost::asio::io_service _ctx;
-        // static GcManager instance(_ctx);
-        static GcManager instance;        
+        static GcManager instance;
         return &instance;
     }
 
+    // groupId 也可以是冷文件的 groupId，INVALID_GROUP_ID 表示自己挑一个
     void gc(int groupId);
 
     void gcAll();
 
+    // 在 gc 线程池里并发 gc 这些 group，全部做完后返回
+    void gcGroups(const vector<int> &groupIds);
+
+    // 按 cost-benefit 挑最多 gc.greedyGCSize 个 group 并发 gc，不知道垃圾在哪里时 gc 增量最大的 group
+    void gcVictims();
+
+    // rebalance 挪动 group 之间的 key range 时拿着两边的这把锁，期间这两个 group 不会 gc
+    mutex &getGroupGcMutex(int groupId);
+
+    // 启动 / 停止后台 gc 线程
+    void start();
+
+    void stop();
+
+    bool isRunning();
+
+    // 唤醒后台 gc 线程，并等它做完一轮检查（可能 gc 了若干个 group）
+    void waitForRound();
+
     virtual ~GcManager();
 
 };
@@ -18,18 +18,52 @@ class Group {
 public:
     int groupId;
 
-    explicit Group(int groupId);
+    // read 读的是哪一代的文件，追加写总是写到当前代
+    uint32_t generation;
+
+    explicit Group(int groupId, uint32_t generation = 0);
 
     virtual ~Group();
 
-    void batchPut(unordered_map<string, string> &pairs, size_t totalSize, vector<ValueLayout> &valueLayouts);
+    // 返回实际写到文件里的字节数，压缩时比记录的总字节数小
+    size_t batchPut(unordered_map<string, string> &pairs, vector<ValueLayout> &valueLayouts);
 
-    size_t rewrite(vector<string> &keys, vector<string> &values, vector<ValueLayout> &valueLayouts);
+    size_t rewrite(vector<ValueLayout> &valueLayouts);
 
-    void read(vector<size_t> &offsets, vector<size_t> &lengths, vector<ValueLayout *> &valueLayouts);
+    // verify 为 true 时校验每条记录的 crc，校验不过的记录不填 value，valueInfo 保持 invalid
+    // 压缩块里的记录一个块只解压一次，fillCache 为 true 时解压出来的块放进块缓存
+    // 有 extent 读失败（io 错误）时返回 false，落在这些 extent 里的 layout 也保持 invalid，但不是记录坏了
+    bool read(vector<size_t> &offsets, vector<size_t> &lengths, vector<ValueLayout *> &valueLayouts,
+              bool verify = false, bool fillCache = true);
 
     void readAndReset(unordered_map<string, ValueLayout> &layouts);
 
+    // 一条记录在文件里占的字节数
+    static size_t recordSize(size_t keySize, size_t valueSize);
+
+    // 把一条记录编码到 ptr 处，返回记录之后的位置
+    static uint8_t *encodeRecord(uint8_t *ptr, const string &key, const string &value);
+
+    // 解析 data 处的一条记录，最多看 available 个字节，新旧各种格式都认，recordLength 返回记录的长度
+    // 记录不完整、版本不认识，或者 verify 时 crc 对不上返回 false；key 为 nullptr 时不拷贝 key
+    static bool decodeRecord(const uint8_t *data, size_t available, bool verify, string *key, string &value,
+                             size_t &recordLength);
+
+    // 把一段编码好的记录压成一个块，没有 snappy 或者压缩省得太少时返回 false，这时应该直接写记录
+    static bool encodeBlock(const string &raw, string &block);
+
+    // 解压 data 处长度为 length 的块，verify 时先校验块的 crc
+    static bool decodeBlock(const uint8_t *data, size_t length, bool verify, string &raw);
+
+    // 从解压后的块里取出 position 指向的记录
+    static bool decodeBlockRecord(const string &raw, const PositionInfo &position, bool verify, string *key,
+                                  string &value);
+
+private:
+
+    // 把 valueLayouts 中从 first 开始的记录追加到当前代的文件里并填好 position，返回写入的字节数
+    size_t append(vector<ValueLayout> &valueLayouts, size_t first);
+
 };
 
 
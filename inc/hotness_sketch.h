@@ -0,0 +1,46 @@
+#ifndef TREEKV_HOTNESS_SKETCH_H
+#define TREEKV_HOTNESS_SKETCH_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+// 估计每个 key 最近被更新了多少次，gc 用它决定存活的 value 留在热文件里还是降级到冷文件
+// count-min sketch，计数器饱和在 255；定期把所有计数器减半，很久以前的更新逐渐不再算数
+// 计数器的增加不加锁，并发时偶尔少记一次没有关系，只是一个估计
+class HotnessSketch {
+
+private:
+
+    vector<atomic<uint8_t>> counters;
+
+    // 距离上一次减半记录了多少次
+    atomic<size_t> additions;
+
+    // 减半时持有，同一时刻只有一个线程在减半
+    mutex agingMutex;
+
+    HotnessSketch();
+
+    void age();
+
+public:
+
+    static HotnessSketch *getInstance() {
+        static HotnessSketch instance;
+        return &instance;
+    }
+
+    // put 时调用
+    void record(const string &key);
+
+    uint8_t estimate(const string &key);
+
+};
+
+
+#endif //TREEKV_HOTNESS_SKETCH_H
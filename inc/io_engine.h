@@ -0,0 +1,46 @@
+#ifndef TREEKV_IO_ENGINE_H
+#define TREEKV_IO_ENGINE_H
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// 一个 extent 读完之后的回调，参数是 extent 的下标和读出来的数据，数据只在回调期间有效
+typedef function<void(int, const uint8_t *)> ExtentCallback;
+
+// 批量读同一个 group 文件的多个 extent
+// 编译时打开 USE_IO_URING 后用 io_uring 一次性提交所有 extent，边收割完成事件边回调解析，
+// 每个线程一个 ring 以及一块注册给内核的固定 buffer；ring 建不起来（内核不支持、被 seccomp 禁用等）时退回同步 pread
+class IoEngine {
+
+private:
+
+    IoEngine();
+
+    bool syncReadExtents(int groupId, uint32_t generation, const vector<size_t> &offsets,
+                         const vector<size_t> &lengths, const ExtentCallback &onExtent);
+
+#ifdef USE_IO_URING
+
+    bool uringReadExtents(int groupId, uint32_t generation, const vector<size_t> &offsets,
+                          const vector<size_t> &lengths, const ExtentCallback &onExtent);
+
+#endif
+
+public:
+
+    static IoEngine *getInstance() {
+        static IoEngine instance;
+        return &instance;
+    }
+
+    // 回调的顺序不保证和 extent 的顺序一致；调用方需持有该 group 文件的锁
+    bool readExtents(int groupId, uint32_t generation, const vector<size_t> &offsets,
+                     const vector<size_t> &lengths, const ExtentCallback &onExtent);
+
+};
+
+#endif //TREEKV_IO_ENGINE_H
@@ -8,21 +8,25 @@
 
 #include <unordered_map>
 #include <unordered_set>
+#include <set>
 #include <cassert>
 #include <string>
 #include <vector>
 #include <mutex>
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "value_layout.h"
 #include "value_log.h"
 #include <threadpool.hpp>
-#include "lru_list.h"
+#include "location_cache.h"
 #include "configManager.h"
 
 using namespace std;
 
 class ValueLayout;
 
+class ValueLog;
+
 class LevelDBKeyManager {
 
 private:
@@ -33,17 +37,32 @@ private:
 
     boost::threadpool::pool pool;
 
-    LruList<string, string *> *lruList;
+    // key -> position 的缓存，自己分 shard 加锁，访问它不需要持有 mutex
+    LocationCache *locationCache;
 
     // 一些特殊的 key 记录在这里，range 时需要忽略这些 key
     unordered_set<string> specialKeys;
 
+    void migratePositionFormat();
+
+    // 确定 group 的个数并记录在 lsm 里，其他模块都在 lsm 打开之后才构造
+    void initGroupNum();
+
+    // 确定 key 是变长的还是补齐到 KEY_LENGTH 的并记录在 lsm 里，已经有数据的旧数据库继续用补齐的格式
+    void initKeyFormat();
+
+    static string groupStatsKey(int groupId);
+
+    // 把 groups 的统计写进 batch，和 position 的修改一起落到 lsm
+    void putGroupStats(leveldb::WriteBatch &batch, const set<int> &groups);
+
     // static std::mutex instance_mutex;
 
     // static LevelDBKeyManager * instance;
 
 public:
 
+    // 写 lsm 以及 getKeys 时持有；get 不持有，lsm 和 locationCache 本身都是线程安全的
     recursive_mutex mutex;
 
     // static LevelDBKeyManager *getInstance() {
@@ -67,7 +86,14 @@ public:
 
     bool batchPut(vector<ValueLayout> &valueLayouts);
 
-    ValueLayout get(const string &key, bool needLock = true);
+    // gc 使用，只有 position 还没有变的 key 才更新成 valueLayouts 里的新位置
+    // rebalance 搬走的 key 的旧位置不会随着旧文件被删掉，oldBecomesDead 为 true 时记为旧 group 的垃圾
+    bool gcBatchPut(vector<PositionInfo> &oldPositions, vector<ValueLayout> &valueLayouts, bool oldBecomesDead = false);
+
+    // gc 使用，删掉 value 已经损坏、没有被搬走的 key，和 gcBatchPut 一样只删 position 还没有变的
+    bool gcBatchDelete(vector<string> &keys, vector<PositionInfo> &oldPositions);
+
+    ValueLayout get(const string &key);
 
     void getKeys(string &startingKey, int num, vector<string> &keys,
                  vector<ValueLayout> &valueLocations);
@@ -75,12 +101,33 @@ public:
     void getKeys(const string &startingKey, const string &endingKey, vector<string> &keys,
                  vector<ValueLayout> &valueLocations);
 
+    // range 查询使用的快照，快照上的读不需要持有 mutex
+    const leveldb::Snapshot *getSnapshot();
+
+    void releaseSnapshot(const leveldb::Snapshot *snapshot);
+
+    // 在快照上读 [startingKey, endingKey]（includeStart 为 false 时不含 startingKey）内最多 num 个 key
+    void getKeys(const leveldb::Snapshot *snapshot, const string &startingKey, bool includeStart,
+                 const string &endingKey, int num, vector<string> &keys, vector<ValueLayout> &valueLocations);
+
     bool deleteKey(const string &key);
 
-    bool writeMeta(const string &key, const string &value);
+    bool writeMeta(const string &key, const string &value, bool sync = false);
+
+    // 写一个空的 batch 并同步，之前所有不同步的写入都随之落盘，删 wal 之前调用
+    bool sync();
+
+    // rebalance 结束时调用，在一个 WriteBatch 里写入新的 pivots 并删掉 REBALANCE_KEY，同步写
+    bool commitPivots(const string &pivotsInfo);
+
+    // gc 搬运完之后持久化 group 的统计，同步写
+    bool writeGroupStats(int groupId);
 
     bool getMeta(const string &key, string &value);
 
+    // ValueLog 构造时调用，从 lsm 恢复各个 group 的 dead bytes 统计
+    void loadGroupStats(ValueLog *valueLog);
+
 };
 
 #endif //WISCKEY_LEVELDB_KEY_MANAGER_H
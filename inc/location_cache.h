@@ -0,0 +1,64 @@
+#ifndef TREEKV_LOCATION_CACHE_H
+#define TREEKV_LOCATION_CACHE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include "value_layout.h"
+#include "constant.h"
+
+using namespace std;
+
+// lsm 中 key -> position 的缓存，存的是解码之后的 PositionInfo，命中后不用再解析
+// 按 key 的 hash 分成多个 shard，每个 shard 一把锁，shard 内部用 CLOCK 淘汰
+class LocationCache {
+
+private:
+
+    struct Entry {
+        // 变长的 key，短 key 放在 string 自己的缓冲区里，不用额外分配
+        string key;
+        PositionInfo position;
+        // CLOCK 的访问位，命中时置 1，指针扫过时清 0，扫到 0 的就淘汰
+        bool referenced;
+    };
+
+    struct Shard {
+        mutex m;
+        unordered_map<string, size_t> index;
+        vector<Entry> entries;
+        size_t hand = 0;
+        size_t capacity = 0;
+        // shard 内每次 put / erase 都加一，未命中时回填用它判断期间 lsm 是否被改过
+        uint64_t generation = 0;
+    };
+
+    vector<Shard *> shards;
+
+    Shard *getShard(const string &key);
+
+    static void insert(Shard *shard, const string &key, const PositionInfo &position);
+
+public:
+
+    // capacityBytes 是缓存大致能用的内存
+    explicit LocationCache(size_t capacityBytes);
+
+    virtual ~LocationCache();
+
+    // 未命中时 generation 返回当前 shard 的版本，之后从 lsm 读到的 position 用 fill 回填
+    bool get(const string &key, PositionInfo &position, uint64_t &generation);
+
+    // 只有在 get 之后 shard 没有被 put / erase 过时才回填，否则读到的可能已经是旧的 position
+    void fill(const string &key, const PositionInfo &position, uint64_t generation);
+
+    // 写 lsm 之后调用
+    void put(const string &key, const PositionInfo &position);
+
+    void erase(const string &key);
+
+};
+
+#endif //TREEKV_LOCATION_CACHE_H
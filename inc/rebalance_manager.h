@@ -0,0 +1,70 @@
+#ifndef TREEKV_REBALANCE_MANAGER_H
+#define TREEKV_REBALANCE_MANAGER_H
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <set>
+#include "value_layout.h"
+
+using namespace std;
+
+// 在线调整相邻 group 之间的 pivot：负载过高的 group 把靠近邻居的一段 key range 连同数据挪给负载较小的邻居
+// group 的个数不变，一次只改一个 pivot，只重写被挪动的那段 key range 的数据
+class RebalanceManager {
+
+private:
+
+    mutex m;
+
+    // moveBoundary 同一时间只有一个
+    mutex moveMutex;
+
+    // 开始挪、还没有换成新 pivot 的 boundary，由 m 保护
+    // 挪了一半时 to 的文件里有不在它 key range 里的 position，gc 扫不到它们
+    set<int> unfinishedBoundaries;
+
+    int groupNum;
+
+    // 各个 group 每秒 flush 写入的字节数，指数平滑
+    vector<double> writeRates;
+
+    // 上一次采样时各个 group 的累计写入字节数和采样时间（毫秒）
+    vector<size_t> lastWrittenBytes;
+
+    int64_t lastSampleTime = -1;
+
+    RebalanceManager();
+
+    void sample(const vector<size_t> &written);
+
+    // 在 group 的 key 里找新的 pivot，使 upper 一侧（true 为高端，false 为低端）的数据大约占 fraction
+    bool findPivot(int groupId, bool upper, double fraction, string &pivot);
+
+    // 调用方持有两个 group 的 gc 锁：把 keys 里 position 还在 from（热文件或冷文件）里的 value 追加到 to 对应的文件里，
+    // 按 position 是否变过有条件地更新 lsm，挪过去的字节数加到 movedSize 上；有 value 读失败时返回 false
+    bool moveKeys(int from, int to, const vector<string> &keys, const vector<ValueLayout> &layouts, size_t &movedSize);
+
+public:
+
+    static RebalanceManager *getInstance() {
+        static RebalanceManager instance;
+        return &instance;
+    }
+
+    // 启动时调用：上次没做完的 rebalance 重新做一遍，保证每个 key 的 position 都在它所属的 group 里
+    void recover();
+
+    // gc 删旧的各代之前调用：group 两侧有挪了一半的 boundary 时旧的各代里可能还有 gc 没搬的 position，不能删
+    bool isMoving(int groupId);
+
+    // 负载最高的 group 超过阈值时挪一次 pivot，挪了返回 true
+    bool rebalance();
+
+    // 把 group boundary 和 boundary + 1 之间的 pivot 改成 pivot，换了 group 的 key 的 value 追加到新 group 的文件里
+    bool moveBoundary(int boundary, const string &pivot);
+
+};
+
+
+#endif //TREEKV_REBALANCE_MANAGER_H
@@ -12,7 +12,17 @@
 #include "configManager.h"
 
 namespace dfdb{
-// todo 目前没有考虑 crash 的处理
+/*
+    Server 是线程安全的，get / put / del / getRange 可以被多个线程并发调用，调用方不需要再额外加锁：
+    - buffer 按 group 分别加锁，写不同 group 的线程之间互不影响，buffer 满了之后交给后台线程落盘
+    - 读 value log 时持有对应 group 文件的共享锁并用 pread 读，多个读者互不阻塞；gc 重写同一个 group 时持有独占锁
+    - getRange 不会把 buffer 落盘，也不会锁住全部 group：逐个 group 在 buffer 锁内拷贝 buffer、拿 lsm 快照，
+      只对涉及到的 group 持有文件的共享锁直到 value 读完
+    - 各个锁的获取顺序固定为 group 的 buffer -> group 的文件（按 groupId 升序）-> lsm，不会出现环形等待
+    同一个 key 上并发的 put / del 之间的先后顺序由调用方自己保证
+    consistency.crashProtected 打开时 put / del 先记 wal（见 WriteAheadLog），返回时记录已经写进 wal，
+    consistency.walSync 打开时还已经 fsync 过；crash 之后重启时重放 wal 恢复 buffer 里还没落盘的数据
+*/
 class Server {
 
 private:
@@ -10,6 +10,7 @@
 #include <chrono>
 #include <random>
 #include <mutex>
+#include <atomic>
 
 using namespace std;
 
@@ -27,6 +28,14 @@ private:
 
     unordered_map<int, vector<size_t>> statisticsMap;
 
+    // value 缓存的命中 / 未命中次数，每次 get 都会更新，不走 statisticsMap 和 m
+    atomic<size_t> valueCacheHits{0};
+    atomic<size_t> valueCacheMisses{0};
+
+    // 压缩块缓存的命中 / 未命中次数
+    atomic<size_t> blockCacheHits{0};
+    atomic<size_t> blockCacheMisses{0};
+
     StatisticsManager();
 
     void printStatistics();
@@ -46,6 +55,10 @@ public:
 
     void addCount(int type, size_t amount);
 
+    void addValueCacheAccess(bool hit);
+
+    void addBlockCacheAccess(bool hit);
+
 };
 
 
@@ -15,6 +15,12 @@ private:
 public:
     boost::threadpool::pool _flushThreadPool;
 
+    // range 查询时并发读各个 group 的 value，线程数由 misc.numRangeScanThread 配置
+    boost::threadpool::pool _rangeScanThreadPool;
+
+    // 并发 gc 多个 group，线程数由 gc.numGCThread 配置
+    boost::threadpool::pool _gcThreadPool;
+
     static ThreadPoolManager *getInstance() {
         static ThreadPoolManager instance;
         return &instance;
@@ -14,10 +14,17 @@ using namespace std;
 
 vector<string> split(const string &s, const string &delimiter);
 
-string validateKey(const string &key);
+bool validateKey(const string &key);
+
+// 旧的数据库里 key 用空格补齐到 KEY_LENGTH
+string padKey(const string &key);
+
+// lsm 和 group 文件里实际存的 key：旧的数据库里是补齐之后的，放在 padded 里；新的数据库就是 key 本身，不用拷贝
+const string &storedKey(const string &key, string &padded);
 
 string randStr(const int len);
 
+// 去掉 padKey 补上的空格
 string trim(const string &str);
 
 //template<typename KeyType, typename ValueType>
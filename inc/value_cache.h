@@ -0,0 +1,95 @@
+#ifndef TREEKV_VALUE_CACHE_H
+#define TREEKV_VALUE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include "configManager.h"
+
+using namespace std;
+
+// Server::get 路径上的 value 缓存，只缓存已经落盘（lsm 中可见）的 value，buffer 里的数据仍然以 buffer 为准
+// 按 key 的 hash 分 shard，每个 shard 是一个按字节计预算的 W-TinyLFU：
+// 新 value 先进 window（LRU），被挤出 window 时和 main 中最该淘汰的 value 比较访问频率，频率更高才能进入 main，
+// 因此一次大范围扫描不会把热点冲掉；main 分为 probation 和 protected 两段（SLRU）
+class ValueCache {
+
+private:
+
+    enum Segment {
+        WINDOW = 0,
+        PROBATION = 1,
+        PROTECTED = 2
+    };
+
+    struct Entry {
+        string key;
+        string value;
+        Segment segment;
+    };
+
+    struct Shard {
+        mutex m;
+        list<Entry> lists[3];
+        size_t bytes[3] = {0, 0, 0};
+        size_t budgets[3] = {0, 0, 0};
+        unordered_map<string, list<Entry>::iterator> index;
+        // count-min sketch，4 行，每个计数器最大 15，采样数到了 10 倍宽度之后全部减半
+        vector<uint8_t> sketch;
+        size_t sketchMask = 0;
+        size_t samples = 0;
+        // 每次 update / erase 都加一，未命中时回填用它判断期间 value 是否被改过
+        uint64_t generation = 0;
+    };
+
+    bool enabled;
+
+    vector<Shard *> shards;
+
+    explicit ValueCache(size_t capacityBytes);
+
+    Shard *getShard(const string &key);
+
+    static size_t charge(const Entry &entry);
+
+    static void recordAccess(Shard *shard, const string &key);
+
+    static int frequency(Shard *shard, const string &key);
+
+    static void moveTo(Shard *shard, list<Entry>::iterator it, Segment segment);
+
+    static void remove(Shard *shard, list<Entry>::iterator it);
+
+    static void onHit(Shard *shard, list<Entry>::iterator it);
+
+    static void evictWindow(Shard *shard);
+
+    static void evictOverBudget(Shard *shard);
+
+public:
+
+    static ValueCache *getInstance() {
+        static ValueCache instance((size_t) ConfigManager::getInstance().getValueCacheSize() * 1024 * 1024);
+        return &instance;
+    }
+
+    virtual ~ValueCache();
+
+    // 未命中时 generation 返回当前 shard 的版本，之后从磁盘读到的 value 用 fill 回填
+    bool get(const string &key, string &value, uint64_t &generation);
+
+    // 只有在 get 之后 shard 没有被 update / erase 过时才回填，否则读到的可能已经是旧的 value
+    void fill(const string &key, const string &value, uint64_t generation);
+
+    // lsm 中 key 的 position 更新之后调用，已经缓存了的 value 换成新的，没缓存的不主动放进来
+    void update(const string &key, const string &value);
+
+    // lsm 中 key 删除之后调用
+    void erase(const string &key);
+
+};
+
+#endif //TREEKV_VALUE_CACHE_H
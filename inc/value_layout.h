@@ -12,8 +12,14 @@ using namespace std;
 
 typedef struct PositionInfo {
     int groupId;
+    // value 在 group 的哪一代文件里
+    uint32_t generation;
     size_t offset;
     size_t length;
+    // 压缩块的长度，0 表示不在压缩块里，offset 和 length 就是记录本身的位置
+    uint32_t blockLength;
+    // 记录在解压后的块里的偏移
+    uint32_t inBlockOffset;
     bool valid;
 } PositionInfo;
 
@@ -38,7 +44,10 @@ public:
 
     void setValueInfo(uint32_t valueSize, const string &key, const string &value);
 
-    void setPositionInfo(int groupId, size_t offset, size_t length);
+    void setPositionInfo(int groupId, size_t offset, size_t length, uint32_t generation = 0,
+                         uint32_t blockLength = 0, uint32_t inBlockOffset = 0);
+
+    void setPositionInfo(const PositionInfo &position);
 
     const ValueInfo &getValueInfo() const;
 
@@ -46,8 +55,13 @@ public:
 
     std::string serializePosition();
 
+    // 兼容旧的文本格式，二进制格式直接从 data 解码，不做任何内存分配
+    bool deserializePosition(const char *data, size_t size);
+
     bool deserializePosition(const string &str);
 
+    static bool isLegacyPosition(const char *data, size_t size);
+
     bool layoutCompare(const ValueLayout &rhs);
 
 };
@@ -9,6 +9,7 @@
 #include <cstdio>
 #include <string>
 #include <mutex>
+#include <atomic>
 #include "value_layout.h"
 #include "leveldb_key_manager.h"
 #include "group.h"
@@ -23,15 +24,36 @@ private:
     // 比如 group1 在 gc 后 increments[1] 为 0，后续往 group1 里又放了 10 个 kv，那么 increments[1] 为 10
     vector<int> increments;
 
+    // 各个 group 中已经失效的 value 的字节数，被覆盖或删除时累加，gc 重写后清零
+    // 和 position 写在同一个 WriteBatch 里持久化到 lsm，重启后从 lsm 恢复
+    vector<size_t> deadBytes;
+
+    // 各个 group 上一次 gc 的时间（秒，系统时间），用来估计 group 里数据的年龄
+    vector<int64_t> lastGcTimes;
+
+    // 各个 group 由 flush 写入的累计字节数（不含 gc 和 rebalance 的搬运），rebalance 用它估计写入速度
+    vector<size_t> writtenBytes;
+
+    // 最近一次 flush 的时间（秒），后台 gc 用来判断是否空闲
+    atomic<int64_t> lastFlushTime;
+
+    int groupNum;
+
     // 整个数据库的大小，不用很精确，差不多就可以
     size_t totalDbSize;
 
+    // 上一次写 checkpoint 的时间（秒）
+    int64_t lastCheckpointTime;
+
     mutex m;
 
     ValueLog();
 
     Group getGroup(int groupId);
 
+    // 用 checkpoint 恢复各个文件的统计，所有文件都和 checkpoint 对得上时连数据库的大小也一起恢复，返回 true
+    bool loadCheckpoint();
+
 public:
 
     virtual ~ValueLog();
@@ -43,20 +65,47 @@ public:
 
     size_t getTotalDbSize();
 
-    void groupBatchPut(unordered_map<string, string> &buffer, size_t bufferSize, int groupId,
-                       vector<ValueLayout> &valueLayouts);
+    void groupBatchPut(unordered_map<string, string> &buffer, int groupId, vector<ValueLayout> &valueLayouts);
+
+    // gc 的重写分三步：切到 group 的新一代文件，一个 chunk 一个 chunk 地把存活的数据搬过去，最后删掉旧的各代
+    uint32_t startGroupRewrite(int groupId);
+
+    size_t groupRewrite(vector<ValueLayout> &valueLayouts, int groupId);
 
-    size_t groupRewrite(vector<string> &keys, vector<string> &values, int groupId,
-                        vector<ValueLayout> &valueLayouts);
+    void finishGroupRewrite(int groupId, uint32_t generation);
 
     void readGroupAndReset(int groupId, unordered_map<string, ValueLayout> &layouts);
 
     bool assignValueInfo(const string &key, ValueLayout &valueLayout);
 
-    void assignValueInfo(vector<string> &keys, vector<ValueLayout> &valueLayouts, bool isGc = false);
+    // 有文件读失败时返回 false，这时 invalid 的 layout 不一定是记录坏了，gc 和 rebalance 不能当成坏记录丢掉
+    bool assignValueInfo(vector<string> &keys, vector<ValueLayout> &valueLayouts, bool isGc = false);
+
+    // gc、rebalance 搬运前调用，assignValueInfo 成功时才能用：去掉 crc 没校验过的记录，它们不会被搬到新的文件里
+    // 去掉的 key 和旧 position 放进 droppedKeys、droppedPositions，调用方用 gcBatchDelete 从 lsm 里删掉
+    void dropCorrupted(vector<string> &keys, vector<ValueLayout> &valueLayouts, vector<PositionInfo> &oldPositions,
+                       vector<string> &droppedKeys, vector<PositionInfo> &droppedPositions);
 
     int getGroupWithMaxIncr();
 
+    void addDeadBytes(int groupId, uint32_t generation, size_t size);
+
+    // group 的 dead bytes 和上次 gc 时间的序列化，存在 lsm 的 GROUP_STATS_KEY_PREFIX + groupId 下
+    string getGroupStats(int groupId);
+
+    void setGroupStats(int groupId, const string &stats);
+
+    // 在垃圾比例不低于 minRatio 的 group 中按 cost-benefit 从高到低挑出最多 maxCount 个 gc 的对象
+    vector<int> pickVictims(double minRatio, size_t maxCount);
+
+    int64_t getLastFlushTime();
+
+    // flush 和 gc 结束时调用，距离上一次不到 CHECKPOINT_INTERVAL 秒时跳过，调用方不能持有文件的锁
+    void checkpoint(bool force = false);
+
+    // rebalance 使用：各个 group 当前这一代文件里存活的字节数，以及 flush 写入的累计字节数
+    void getGroupUsage(vector<size_t> &liveBytes, vector<size_t> &written);
+
 };
 
 
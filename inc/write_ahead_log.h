@@ -0,0 +1,115 @@
+#ifndef TREEKV_WRITE_AHEAD_LOG_H
+#define TREEKV_WRITE_AHEAD_LOG_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+/*
+    put / del 在写 buffer 之前先记 wal，crash 之后重放 wal 把 buffer 里还没落盘的数据恢复出来：
+    - append 在 group 的 buffer 锁内调用，只是把记录编码进内存里的 pending，拿到 lsn，和写 buffer 的顺序一致
+    - commit 在不持有任何锁时调用，等到自己的记录写进文件；group commit：没有线程在写的话自己当 leader，
+      把所有线程攒下的 pending 一次 write（consistency.walSync 打开时再 fsync 一次），其余线程等 leader 写完
+    - 没有开 walSync 时后台线程定期 fsync
+    - wal 按 WAL_SEGMENT_SIZE 分段，文件名是 wal@<段里第一条记录的 lsn>；buffer 记下自己最早的一条记录的 lsn，
+      group 落盘之后，比所有 buffer 里最早的 lsn 还老的段就可以删掉了
+*/
+class WriteAheadLog {
+
+private:
+
+    // 保护以下除 fd、segmentSize 之外的成员，只在很短的临界区里持有
+    mutex m;
+
+    // 等自己的记录写下去的线程在这里等
+    condition_variable commitCond;
+
+    condition_variable syncCond;
+
+    // recover 之后才接受记录，重放期间的写入不记 wal
+    bool opened;
+
+    string pending;
+
+    // 下一条记录的 lsn；lsn 小于 writtenLsn 的记录都已经写进文件，pending 里是 [writtenLsn, nextLsn)
+    uint64_t nextLsn;
+    uint64_t writtenLsn;
+
+    // 有 leader 正在写
+    bool writing;
+
+    // 写进文件之后还没有 fsync
+    bool dirty;
+
+    // 各个段的起始 lsn，从小到大，最后一个是正在写的段
+    vector<uint64_t> segments;
+
+    // 段数超过了 WAL_MAX_SEGMENTS，需要把占着最老的段的 group 落盘
+    atomic<bool> flushRequested;
+
+    // leader 写文件、换段以及后台线程拿 fd 时持有
+    mutex fileMutex;
+    int fd;
+    size_t segmentSize;
+
+    bool running;
+    std::thread syncer;
+
+    WriteAheadLog();
+
+    string getFilename(uint64_t startLsn);
+
+    // leader 调用，不持有 m
+    void writeBatch(uint64_t startLsn, const string &batch);
+
+    void backgroundSync();
+
+    // 重放一个段，返回段里完整的记录数
+    uint64_t replaySegment(const string &filename);
+
+public:
+
+    enum RecordType : uint8_t {
+        PUT_RECORD = 1,
+        DELETE_RECORD = 2
+    };
+
+    static WriteAheadLog *getInstance() {
+        static WriteAheadLog instance;
+        return &instance;
+    }
+
+    virtual ~WriteAheadLog();
+
+    // 启动时调用：重放已有的段，落盘之后删掉，然后开一个新的段开始接受记录
+    void recover();
+
+    // 没有打开时返回 NO_LSN
+    uint64_t append(RecordType type, const string &key, const string &value);
+
+    // 等 lsn 之前（含）的记录都写进文件，lsn 为 NO_LSN 时直接返回
+    void commit(uint64_t lsn);
+
+    uint64_t getNextLsn();
+
+    bool hasOldSegments();
+
+    // 删掉所有记录的 lsn 都小于 minLiveLsn 的段，正在写的段不删
+    void truncate(uint64_t minLiveLsn);
+
+    // 段太多时返回 true 并给出 bound：lsn 小于 bound 的 buffer 需要落盘；同一个请求只会返回一次
+    bool takeFlushRequest(uint64_t &bound);
+
+    // 正常退出时 buffer 都已经落盘，关掉并删除所有段
+    void clear();
+
+};
+
+
+#endif //TREEKV_WRITE_AHEAD_LOG_H
@@ -0,0 +1,92 @@
+#include "block_cache.h"
+#include "constant.h"
+#include "statistics_manager.h"
+
+// 每个块除了解压后的数据之外大致占用的内存：list 节点、shared_ptr 控制块、string 头、unordered_map 节点
+static const size_t BLOCK_CACHE_ENTRY_OVERHEAD = 160;
+
+BlockCache::BlockCache(size_t capacityBytes) {
+
+    enabled = capacityBytes > 0;
+    if (!enabled) {
+        return;
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_SHARD_NUM; ++i) {
+        auto *shard = new Shard();
+        shard->budget = capacityBytes / BLOCK_CACHE_SHARD_NUM;
+        shards.push_back(shard);
+    }
+
+}
+
+BlockCache::~BlockCache() {
+    for (auto &shard: shards) {
+        delete shard;
+    }
+}
+
+BlockCache::Shard *BlockCache::getShard(const CacheKey &key) {
+    size_t h = CacheKeyHash()(key);
+    return shards[(h ^ (h >> 17)) % BLOCK_CACHE_SHARD_NUM];
+}
+
+shared_ptr<const string> BlockCache::get(int groupId, uint32_t generation, size_t offset) {
+
+    if (!enabled) {
+        return nullptr;
+    }
+
+    CacheKey key{groupId, generation, offset};
+    Shard *shard = getShard(key);
+
+    shared_ptr<const string> block;
+    {
+        lock_guard<mutex> lockGuard(shard->m);
+        auto it = shard->index.find(key);
+        if (it != shard->index.end()) {
+            shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+            block = it->second->block;
+        }
+    }
+
+    StatisticsManager::getInstance()->addBlockCacheAccess(block != nullptr);
+
+    return block;
+
+}
+
+void BlockCache::put(int groupId, uint32_t generation, size_t offset, const shared_ptr<const string> &block) {
+
+    if (!enabled) {
+        return;
+    }
+
+    CacheKey key{groupId, generation, offset};
+    Shard *shard = getShard(key);
+    size_t charge = block->size() + BLOCK_CACHE_ENTRY_OVERHEAD;
+
+    // 比整个 shard 还大的块不缓存
+    if (charge > shard->budget) {
+        return;
+    }
+
+    lock_guard<mutex> lockGuard(shard->m);
+
+    // 并发的读者可能同时解压了同一个块，先放进来的留下
+    if (shard->index.count(key) > 0) {
+        return;
+    }
+
+    shard->lru.push_front(Entry{key, block});
+    shard->index[key] = shard->lru.begin();
+    shard->bytes += charge;
+
+    while (shard->bytes > shard->budget) {
+        Entry &victim = shard->lru.back();
+        shard->bytes -= victim.block->size() + BLOCK_CACHE_ENTRY_OVERHEAD;
+        shard->index.erase(victim.key);
+        shard->lru.pop_back();
+    }
+
+}
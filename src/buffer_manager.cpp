@@ -10,138 +10,405 @@
 #include "thread_pool_manager.h"
 #include "gc_manager.h"
 #include "file_manager.h"
+#include "write_ahead_log.h"
+#include "group.h"
 #include <numeric>
+#include <boost/bind.hpp>
 
 /*
     初始化 BufferManager 时，先查看 lsm 中有没有 pivots 的信息：
     - 如果有，就直接使用已有的 pivots 的信息，kv 都直接放到 buffers 里
-    - 如果没有，那么 kv 都先放到 initialBuffer 里，当 initialBuffer 满了，将其排序后等分点上的 key 作为 pivots，写入 lsm 中
+    - 如果没有，那么 kv 都先放到 initialBuffer 里，同时对写入的 key 抽样，写满 misc.pivotSampleKeys 个之后，
+      取样本按字节数加权的等分点作为 pivots，写入 lsm 中
 */
-BufferManager::BufferManager() {
+BufferManager::BufferManager() : initialBufferSize(0), initialFirstLsn(NO_LSN), initialPinnedLsn(NO_LSN),
+                                 initialUnsynced(false), spilled(false), sampledCount(0), pivotsVersion(0),
+                                 pivotsReady(false) {
 
     LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
 
+    groupNum = (int) ConfigManager::getInstance().getGroupNum();
+    nextPivotsAttempt = ConfigManager::getInstance().getPivotSampleKeys();
+
+    for (int i = 0; i < groupNum; ++i) {
+        groupBuffers.push_back(new GroupBuffer());
+    }
+
+    // pivots 可能是之后在 put 里才生成的，因此线程池在这里就要准备好
+    size_t flushThreadsNums = ConfigManager::getInstance().getNumParallelFlush();
+    _flushThreadPool.size_controller().resize(flushThreadsNums);
+
     string pivotsInfo;
     bool exist = levelDbKeyManager->getMeta(PIVOTS_KEY, pivotsInfo);
 
     if (!exist) {
 
+        if (loadSamples() || resampleFromLsm()) {
+            return;
+        }
+
+        // 之前的版本退出时把 initialBuffer 原样写进 initial group，没有建索引，读回来
         unordered_map<string, ValueLayout> layouts;
         // 构造函数里应该也不需要考虑锁
         ValueLog::getInstance()->readGroupAndReset(INITIAL_GROUP_ID, layouts);
 
         for (auto &layout: layouts) {
+            size_t size = Group::recordSize(layout.first.size(), layout.second.getValueInfo().value.length());
             initialBuffer[layout.first] = layout.second.getValueInfo().value;
-            initialBufferSize += (sizeof(uint32_t) + KEY_LENGTH + layout.second.getValueInfo().value.length());
+            initialBufferSize += size;
+            sampleKey(layout.first, size);
         }
 
         return;
 
     }
 
-    pivots = split(pivotsInfo, "|");
+    vector<string> newPivots = split(pivotsInfo, "|");
 
-    if (pivots.size() + 1 != GROUP_NUM) {
-        printf("pivots size = %d, groupNum = %d\n", pivots.size(), GROUP_NUM);
+    if (newPivots.size() + 1 != groupNum) {
+        printf("pivots size = %zu, groupNum = %d\n", newPivots.size(), groupNum);
         printf("invalid pivots size, maybe the db config and the old pivots are not match\n");
     }
 
-    buffers.resize(GROUP_NUM);
-    bufferSizes.resize(GROUP_NUM);
+    // pivots 写下去之后、前缀阶段落盘的 key 还没搬完时 crash 了，initial group 的文件不是空的，接着搬
+    if (FileManager::getInstance()->getFileSize(INITIAL_GROUP_ID) > 0) {
+        printf("migrate keys of initial group\n");
+        migrateSpilledKeys(newPivots);
+    }
 
-    size_t flushThreadsNums = ConfigManager::getInstance().getNumParallelFlush();
-    _flushThreadPool.size_controller().resize(flushThreadsNums);
-    
+    atomic_store(&pivots, shared_ptr<const vector<string>>(new vector<string>(move(newPivots))));
+
+    pivotsReady.store(true);
+
+}
+
+// Algorithm R：第 n 个 key 以 capacity / n 的概率替换掉样本里随机的一个
+void BufferManager::sampleKey(const string &key, size_t size) {
+    size_t capacity = (size_t) PIVOT_SAMPLES_PER_GROUP * groupNum;
+    sampledCount++;
+    if (samples.size() < capacity) {
+        samples.emplace_back(key, size);
+        return;
+    }
+    uint64_t i = sampleRandom() % sampledCount;
+    if (i < capacity) {
+        samples[i] = make_pair(key, size);
+    }
 }
 
-int BufferManager::put(const string &key, const string &value) {
+bool BufferManager::resampleFromLsm() {
 
     LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+    const leveldb::Snapshot *snapshot = levelDbKeyManager->getSnapshot();
 
-//    printf("key is %s!\n", key.c_str());
+    string fromKey = INF_LOWER_BOUND;
+    while (true) {
+        vector<string> keys;
+        vector<ValueLayout> layouts;
+        levelDbKeyManager->getKeys(snapshot, fromKey, false, INF_UPPER_BOUND, GC_SCAN_KEY_NUM, keys, layouts);
+        if (keys.empty()) {
+            break;
+        }
+        fromKey = keys.back();
+        for (int i = 0; i < keys.size(); ++i) {
+            sampleKey(keys[i], layouts[i].getPositionInfo().length);
+        }
+        spilled = true;
+    }
 
-    lock_guard<recursive_mutex> lockGuard(mutex);
+    levelDbKeyManager->releaseSnapshot(snapshot);
 
-    // 还没有 pivots 的信息，则放到 initialBuffer 中
-    if (!pivotsGenerated()) {
+    return spilled;
 
-        auto _it = initialBuffer.find(key);
+}
 
-        if (_it != initialBuffer.end()) {
-            initialBufferSize -= _it->second.length();
-            initialBufferSize += value.length();
+// "版本,sampledCount,initial group 的当前代,当前代大小|" 之后每个样本一段 "字节数,key|"
+bool BufferManager::loadSamples() {
+
+    string info;
+    if (!LevelDBKeyManager::getInstance()->getMeta(INITIAL_SAMPLES_KEY, info)) {
+        return false;
+    }
+
+    vector<string> v = split(info, "|");
+    FileManager *fileManager = FileManager::getInstance();
+    int version;
+    unsigned long long count;
+    uint32_t generation;
+    size_t fileSize;
+    // 最后一次落盘之后 initial group 又写过（落盘到一半 crash 了），抽样里少了这部分 key，不能用
+    if (v.empty() || sscanf(v[0].c_str(), "%d,%llu,%u,%zu", &version, &count, &generation, &fileSize) != 4 ||
+        version != CHECKPOINT_VERSION || generation != fileManager->getGeneration(INITIAL_GROUP_ID) ||
+        fileSize != fileManager->getFileSize(INITIAL_GROUP_ID)) {
+        return false;
+    }
+
+    vector<pair<string, size_t>> loaded;
+    for (size_t i = 1; i < v.size(); ++i) {
+        size_t pos = v[i].find(',');
+        if (pos == string::npos) {
+            return false;
+        }
+        loaded.emplace_back(v[i].substr(pos + 1), strtoull(v[i].c_str(), nullptr, 10));
+    }
+
+    samples = move(loaded);
+    sampledCount = count;
+    spilled = true;
+
+    printf("load %zu samples from checkpoint\n", samples.size());
+
+    return true;
+
+}
+
+void BufferManager::checkpointSamples() {
+
+    FileManager *fileManager = FileManager::getInstance();
+
+    string info = to_string(CHECKPOINT_VERSION) + "," + to_string(sampledCount) + "," +
+                  to_string(fileManager->getGeneration(INITIAL_GROUP_ID)) + "," +
+                  to_string(fileManager->getFileSize(INITIAL_GROUP_ID)) + "|";
+    for (auto &sample: samples) {
+        info += to_string(sample.second) + "," + sample.first + "|";
+    }
+
+    LevelDBKeyManager::getInstance()->writeMeta(INITIAL_SAMPLES_KEY, info);
+
+}
+
+void BufferManager::spillInitialBuffer() {
+
+    if (initialBuffer.empty()) {
+        return;
+    }
+
+    vector<ValueLayout> layouts;
+    ValueLog::getInstance()->groupBatchPut(initialBuffer, INITIAL_GROUP_ID, layouts);
+    LevelDBKeyManager::getInstance()->batchPut(layouts);
+
+    // 先标记再放开 pin，truncateWal 看到 pin 放开时一定也会同步这个文件
+    initialUnsynced = true;
+
+    initialBuffer.clear();
+    initialBufferSize = 0;
+    initialFirstLsn = NO_LSN;
+    initialPinnedLsn = NO_LSN;
+    spilled = true;
+
+    checkpointSamples();
+
+}
+
+bool BufferManager::generatePivots() {
+
+    // 同一个 key 被抽中多次只算一次，字节数以后抽到的为准
+    vector<pair<string, size_t>> sorted(samples);
+    stable_sort(sorted.begin(), sorted.end(),
+                [](const pair<string, size_t> &a, const pair<string, size_t> &b) { return a.first < b.first; });
+    vector<pair<string, size_t>> distinct;
+    for (auto &sample: sorted) {
+        if (!distinct.empty() && distinct.back().first == sample.first) {
+            distinct.back().second = sample.second;
         } else {
-            initialBufferSize += (sizeof(uint32_t) + KEY_LENGTH + value.length());
+            distinct.push_back(sample);
         }
+    }
 
-        initialBuffer[key] = value;
+    if (distinct.size() < groupNum) {
+        return false;
+    }
 
-        // 当 initialBuffer 满了，将其排序后等分点上的 key 作为 pivots，写入 lsm 中
-        if (initialBuffer.size() > MAX_INITIAL_BUFFER_AMOUNT) {
+    printf("generating pivots from %zu samples...\n", distinct.size());
 
-            printf("generating pivots...\n");
+    size_t totalSize = 0;
+    for (auto &sample: distinct) {
+        totalSize += sample.second;
+    }
 
-            // 把 key 都拿出来
-            vector<string> keys;
-            for (auto &it: initialBuffer) {
-                keys.push_back(it.first);
+    // 第 i 个 pivot 取累计字节数达到 i / groupNum 的样本，pivot 本身属于左边的 group
+    // 每个 pivot 至少往后挪一个样本，并给后面的 pivot 留够样本，保证 pivots 严格递增
+    vector<string> newPivots;
+    size_t accumulated = 0;
+    int idx = 0;
+    for (int i = 1; i < groupNum; ++i) {
+        double target = (double) totalSize * i / groupNum;
+        while (idx < distinct.size() - (groupNum - i) && accumulated + distinct[idx].second < target) {
+            accumulated += distinct[idx].second;
+            idx++;
+        }
+        newPivots.push_back(distinct[idx].first);
+        accumulated += distinct[idx].second;
+        idx++;
+    }
+
+    string pivotInfo;
+    for (auto &pivot: newPivots) {
+        pivotInfo += (pivot + "|");
+    }
+
+    // pivots 先同步写下去，落过盘的 key 搬到一半 crash 的话，重启后按同样的 pivots 接着搬
+    LevelDBKeyManager::getInstance()->writeMeta(PIVOTS_KEY, pivotInfo, true);
+
+    if (spilled) {
+        migrateSpilledKeys(newPivots);
+    }
+
+    // 接下来要把 initialBuffer 里的东西放到真正的 buffer 里，各个 group 的范围是左开右闭
+    // pivotsReady 还没置位，其他线程不会访问 group buffer，因此这里不需要拿 group 的锁
+    // 分到 initialBuffer 数据的 group 都要保留 initialBuffer 的 wal 记录
+    for (auto &pair: initialBuffer) {
+        int idx = lower_bound(newPivots.begin(), newPivots.end(), pair.first) - newPivots.begin();
+        groupBuffers[idx]->bufferSize += Group::recordSize(pair.first.size(), pair.second.length());
+        groupBuffers[idx]->buffer[pair.first] = move(pair.second);
+        groupBuffers[idx]->firstLsn = initialFirstLsn;
+        updatePin(groupBuffers[idx]);
+    }
+
+    // group 的 pin 设好之后才能放开 initial 的 pin
+    initialBuffer.clear();
+    initialBufferSize = 0;
+    initialFirstLsn = NO_LSN;
+    initialPinnedLsn = NO_LSN;
+    samples.clear();
+    samples.shrink_to_fit();
+
+    atomic_store(&pivots, shared_ptr<const vector<string>>(new vector<string>(move(newPivots))));
+    pivotsReady.store(true);
+
+    printf("generate pivots success\n");
+
+    return true;
+
+}
+
+void BufferManager::migrateSpilledKeys(const vector<string> &newPivots) {
+
+    LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+    ValueLog *valueLog = ValueLog::getInstance();
+    FileManager *fileManager = FileManager::getInstance();
+
+    // pivots 生成之前没有别的 group 的写入，快照里指向 initial group 的就是所有落过盘的 key
+    // 期间并发的 del 会改 lsm，gcBatchPut 只更新 position 没变的 key，不会把删掉的 key 写回来
+    const leveldb::Snapshot *snapshot = levelDbKeyManager->getSnapshot();
+
+    size_t movedSize = 0;
+    bool readFailed = false;
+    string fromKey = INF_LOWER_BOUND;
+
+    while (true) {
+
+        vector<string> keys;
+        vector<ValueLayout> layouts;
+        levelDbKeyManager->getKeys(snapshot, fromKey, false, INF_UPPER_BOUND, GC_SCAN_KEY_NUM, keys, layouts);
+        if (keys.empty()) {
+            break;
+        }
+        fromKey = keys.back();
+
+        // 按目标 group 分好，每个目标 group 一次追加
+        map<int, pair<vector<string>, vector<ValueLayout>>> chunks;
+        for (int i = 0; i < keys.size(); ++i) {
+            if (layouts[i].getPositionInfo().groupId != INITIAL_GROUP_ID) {
+                continue;
             }
+            int to = lower_bound(newPivots.begin(), newPivots.end(), keys[i]) - newPivots.begin();
+            chunks[to].first.push_back(keys[i]);
+            chunks[to].second.push_back(layouts[i]);
+        }
 
-            // 对 key 进行排序
-            sort(keys.begin(), keys.end());
+        for (auto &chunk: chunks) {
 
-            string pivotInfo;
+            vector<string> &chunkKeys = chunk.second.first;
+            vector<ValueLayout> &chunkLayouts = chunk.second.second;
 
-            int firstIndex = keys.size() % (GROUP_NUM - 1);
-            int gap = keys.size() / (GROUP_NUM - 1);
-            for (int i = firstIndex; i < keys.size(); i += gap) {
-                pivots.push_back(keys[i]);
-                pivotInfo += (keys[i] + "|");
+            vector<PositionInfo> oldPositions;
+            for (auto &layout: chunkLayouts) {
+                oldPositions.push_back(layout.getPositionInfo());
             }
 
-            if (pivots.size() != (GROUP_NUM - 1)) {
-                std::cout << "generate pivots fail" << std::endl;
-            } else {
-                std::cout << "generate pivots success" << std::endl;
-                // for (int i = 0; i < pivots.size(); ++i) {
-                //     cout << pivots[i] << " ";
-                // }
-                // cout << endl;
+            fileManager->operateFileSharedMutex(INITIAL_GROUP_ID, LOCK);
+            bool read = valueLog->assignValueInfo(chunkKeys, chunkLayouts, true);
+            fileManager->operateFileSharedMutex(INITIAL_GROUP_ID, UNLOCK);
+            if (!read) {
+                readFailed = true;
+                continue;
+            }
+            vector<string> droppedKeys;
+            vector<PositionInfo> droppedPositions;
+            valueLog->dropCorrupted(chunkKeys, chunkLayouts, oldPositions, droppedKeys, droppedPositions);
+            // 坏掉的 value 搬不走，initial group 的文件搬完就清空，key 不删的话就指向了不存在的记录
+            levelDbKeyManager->gcBatchDelete(droppedKeys, droppedPositions);
+            if (chunkLayouts.empty()) {
+                continue;
             }
 
-            buffers.resize(GROUP_NUM);
-            bufferSizes.resize(GROUP_NUM);
+            movedSize += valueLog->groupRewrite(chunkLayouts, chunk.first);
+            levelDbKeyManager->gcBatchPut(oldPositions, chunkLayouts);
 
-            // 至此，分组的信息已经出来了，把 pivot 的信息写到 lsm 中
-            levelDbKeyManager->writeMeta(PIVOTS_KEY, pivotInfo);
+        }
 
-            // 接下来要把 initialBuffer 里的东西放到真正的 buffer 里
-            // 各个 group 的范围是左开右闭
-            int ptr = 0;
+    }
 
-            for (const auto &_key: keys) {
+    levelDbKeyManager->releaseSnapshot(snapshot);
 
-                string _value = initialBuffer[_key];
+    // 没读出来的 key 还指向 initial group，文件留着，重启时 initial group 的文件不是空的，会接着搬
+    if (readFailed) {
+        printf("read initial group fail, migrate %zu bytes, keep the rest in initial group\n", movedSize);
+        return;
+    }
 
-                if (ptr == pivots.size()) {
-                    buffers[ptr][_key] = _value;
-                    bufferSizes[ptr] += (sizeof(uint32_t) + KEY_LENGTH + _value.length());
-                    continue;
-                }
+    // lsm 里已经没有指向 initial group 的 position 了，拿着独占锁清空，正在读它的 get 读完之后会重新查 position
+    fileManager->operateFileMutex(INITIAL_GROUP_ID, LOCK);
+    fileManager->resetFile(INITIAL_GROUP_ID);
+    fileManager->operateFileMutex(INITIAL_GROUP_ID, UNLOCK);
 
-                if (_key <= pivots[ptr]) {
-                    buffers[ptr][_key] = _value;
-                    bufferSizes[ptr] += (sizeof(uint32_t) + KEY_LENGTH + _value.length());
-                    if (_key == pivots[ptr]) {
-                        ptr++;
-                    }
-                }
+    spilled = false;
 
-            }
+    printf("migrate %zu bytes from initial group\n", movedSize);
+
+}
+
+int BufferManager::put(const string &key, const string &value, uint64_t &lsn) {
+
+//    printf("key is %s!\n", key.c_str());
+
+    // 还没有 pivots 的信息，则放到 initialBuffer 中
+    if (!pivotsGenerated()) {
+
+        lock_guard<mutex> lockGuard(initialMutex);
+
+        // 拿到锁之后再检查一次，pivots 可能刚被别的线程生成
+        if (pivotsGenerated()) {
+            return put(key, value, lsn);
+        }
+
+        pinNextLsn(initialPinnedLsn);
+        lsn = WriteAheadLog::getInstance()->append(WriteAheadLog::PUT_RECORD, key, value);
+        initialFirstLsn = min(initialFirstLsn, lsn);
+        initialPinnedLsn = initialFirstLsn;
+
+        auto _it = initialBuffer.find(key);
+
+        if (_it != initialBuffer.end()) {
+            initialBufferSize -= _it->second.length();
+            initialBufferSize += value.length();
+        } else {
+            initialBufferSize += Group::recordSize(key.size(), value.length());
+        }
+
+        initialBuffer[key] = value;
 
-            initialBuffer.clear();
-            initialBufferSize = 0;
+        sampleKey(key, Group::recordSize(key.size(), value.length()));
 
+        // 前缀很长时 initialBuffer 不能一直放在内存里
+        if (initialBufferSize > MAX_INITIAL_BUFFER_SIZE) {
+            spillInitialBuffer();
+        }
+
+        // 不同的 key 还不够多时（比如一直在覆盖少数几个 key）过一段再试
+        if (sampledCount >= nextPivotsAttempt && !generatePivots()) {
+            nextPivotsAttempt = sampledCount + ConfigManager::getInstance().getPivotSampleKeys();
         }
 
         return -1;
@@ -149,18 +416,27 @@ int BufferManager::put(const string &key, const string &value) {
     }
 
     // 已经有 pivots 的信息，则找到对应的 group
-    int idx = getBelongingGroup(key);
+    int idx;
+    unique_lock<mutex> lock = lockBelongingGroup(key, idx);
+
+    GroupBuffer *groupBuffer = groupBuffers[idx];
 
-    auto _it = buffers[idx].find(key);
+    // wal 的记录顺序和写 buffer 的顺序一致，重放时同一个 key 后写的覆盖先写的
+    pinNextLsn(groupBuffer->pinnedLsn);
+    lsn = WriteAheadLog::getInstance()->append(WriteAheadLog::PUT_RECORD, key, value);
+    groupBuffer->firstLsn = min(groupBuffer->firstLsn, lsn);
+    updatePin(groupBuffer);
 
-    if (_it != buffers[idx].end()) {
-        bufferSizes[idx] -= _it->second.length();
-        bufferSizes[idx] += value.length();
+    auto _it = groupBuffer->buffer.find(key);
+
+    if (_it != groupBuffer->buffer.end()) {
+        groupBuffer->bufferSize -= _it->second.length();
+        groupBuffer->bufferSize += value.length();
     } else {
-        bufferSizes[idx] += (sizeof(uint32_t) + KEY_LENGTH + value.length());
+        groupBuffer->bufferSize += Group::recordSize(key.size(), value.length());
     }
 
-    buffers[idx][key] = value;
+    groupBuffer->buffer[key] = value;
 
 //    // 每次 put 都这么算一次感觉挺花时间的
 //    // key valueSize
@@ -172,7 +448,7 @@ int BufferManager::put(const string &key, const string &value) {
 //                            }
 //    );
 
-    if (bufferSizes[idx] > MAX_BUFFER_SIZE) {
+    if (groupBuffer->bufferSize > MAX_BUFFER_SIZE) {
         return idx;
     }
 
@@ -182,53 +458,98 @@ int BufferManager::put(const string &key, const string &value) {
 
 bool BufferManager::get(const string &key, string &value) {
 
-    lock_guard<recursive_mutex> lockGuard(mutex);
-
-    unordered_map<string, string> *bufferToOperate;
-
     if (!pivotsGenerated()) {
-        bufferToOperate = &initialBuffer;
-    } else {
-        int idx = getBelongingGroup(key);
-        bufferToOperate = &buffers[idx];
+        lock_guard<mutex> lockGuard(initialMutex);
+        // pivots 可能刚被别的线程生成，initialBuffer 里的东西已经挪到 group buffer 里了
+        if (pivotsGenerated()) {
+            return get(key, value);
+        }
+        auto it = initialBuffer.find(key);
+        if (it == initialBuffer.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
     }
 
-    if ((*bufferToOperate).find(key) == (*bufferToOperate).end()) {
-        return false;
+    int idx;
+    unique_lock<mutex> lock = lockBelongingGroup(key, idx);
+
+    GroupBuffer *groupBuffer = groupBuffers[idx];
+
+    // 先找 active buffer，再找正在落盘的 immutable buffer
+    auto it = groupBuffer->buffer.find(key);
+    if (it != groupBuffer->buffer.end()) {
+        value = it->second;
+        return true;
     }
 
-    value = (*bufferToOperate)[key];
+    it = groupBuffer->immutableBuffer.find(key);
+    if (it != groupBuffer->immutableBuffer.end()) {
+        value = it->second;
+        return true;
+    }
 
-    return true;
+    return false;
 
 }
 
-void BufferManager::del(const std::string &key) {
-
-    lock_guard<recursive_mutex> lockGuard(mutex);
+// del 不进 buffer，不改 firstLsn；它的 wal 记录只在 lsm 里删完之前被 pin 住
+bool BufferManager::del(const std::string &key, uint64_t &lsn) {
 
-    unordered_map<string, string> *bufferToOperate;
-    size_t *bufferSize;
+    LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
 
     if (!pivotsGenerated()) {
-        bufferToOperate = &initialBuffer;
-        bufferSize = &initialBufferSize;
-    } else {
-        int idx = getBelongingGroup(key);
-        bufferToOperate = &buffers[idx];
-        bufferSize = &bufferSizes[idx];
+        lock_guard<mutex> lockGuard(initialMutex);
+        if (pivotsGenerated()) {
+            return del(key, lsn);
+        }
+        pinNextLsn(initialPinnedLsn);
+        lsn = WriteAheadLog::getInstance()->append(WriteAheadLog::DELETE_RECORD, key, "");
+        auto it = initialBuffer.find(key);
+        if (it != initialBuffer.end()) {
+            initialBufferSize -= Group::recordSize(it->first.size(), it->second.length());
+            initialBuffer.erase(it);
+        }
+        bool ret = levelDbKeyManager->deleteKey(key);
+        initialPinnedLsn = initialFirstLsn;
+        return ret;
     }
 
-    auto it = (*bufferToOperate).find(key);
+    int idx;
+    unique_lock<mutex> lock = lockBelongingGroup(key, idx);
+
+    GroupBuffer *groupBuffer = groupBuffers[idx];
 
-    if (it != (*bufferToOperate).end()) {
-        *bufferSize -= (sizeof(uint32_t) + KEY_LENGTH + it->second.length());
-        (*bufferToOperate).erase(it);
+    // 还是要记 wal：重放时它前面的 put 会被重新放进 buffer
+    pinNextLsn(groupBuffer->pinnedLsn);
+    lsn = WriteAheadLog::getInstance()->append(WriteAheadLog::DELETE_RECORD, key, "");
+    groupBuffer->deletingLsns.insert(lsn);
+    updatePin(groupBuffer);
+
+    auto it = groupBuffer->buffer.find(key);
+
+    if (it != groupBuffer->buffer.end()) {
+        groupBuffer->bufferSize -= Group::recordSize(it->first.size(), it->second.length());
+        groupBuffer->buffer.erase(it);
     }
 
+    // immutable buffer 正在被后台线程读，不能直接删，等它落盘后再到 lsm 里删除
+    if (groupBuffer->immutableBuffer.find(key) != groupBuffer->immutableBuffer.end()) {
+        waitForFlush(idx, lock);
+    }
+
+    // 持锁删 lsm：期间同一个 key 新的 put 只会留在 active buffer 里，不会被这里删掉
+    bool ret = levelDbKeyManager->deleteKey(key);
+
+    groupBuffer->deletingLsns.erase(groupBuffer->deletingLsns.find(lsn));
+    updatePin(groupBuffer);
+
+    return ret;
+
 }
 
-bool BufferManager::flush(int idx, bool needLock) {
+bool BufferManager::flush(int idx) {
 
     if (!pivotsGenerated()) {
         printf("pivot not generated, flush not allowed\n");
@@ -237,31 +558,65 @@ bool BufferManager::flush(int idx, bool needLock) {
 
 //    printf("flush group%d\n", idx);
 
-    if (needLock) mutex.lock();
-
-    unordered_map<string, string> buffer = buffers[idx];
-    size_t bufferSize = bufferSizes[idx];
-    buffers[idx].clear();
-    bufferSizes[idx] = 0;
-
-    if (needLock) mutex.unlock();
-
-    if (buffer.empty()) {
-        return true;
-    }
-
+    // 调用方不持有任何 buffer 的锁；空间不够时交给后台 gc 线程回收，没有开后台 gc 时在这里 gc
+    GcManager *gcManager = GcManager::getInstance();
     int loopCount = 0;
-    while (needLock && ValueLog::getInstance()->getTotalDbSize() >= DISK_SIZE) {
+    while (ValueLog::getInstance()->getTotalDbSize() >= DISK_SIZE) {
         if (++loopCount == 10000) {
             std::cout << "disk size not enough, exit" << std::endl;
             exit(0);
         }
         std::cout << "disk size not enough,waiting for gc" << std::endl;
-        GcManager::getInstance()->gc(INVALID_GROUP_ID);
+        if (gcManager->isRunning()) {
+            gcManager->waitForRound();
+        } else {
+            gcManager->gcVictims();
+        }
+    }
+
+    unique_lock<mutex> lock(groupBuffers[idx]->m);
+
+    return scheduleFlush(idx, lock);
+
+}
+
+// 调用前需持有 group idx 的锁
+bool BufferManager::scheduleFlush(int idx, unique_lock<mutex> &lock) {
+
+    GroupBuffer *groupBuffer = groupBuffers[idx];
+
+    // 只有 active buffer 和 immutable buffer 都满了，才需要在前台等待
+    waitForFlush(idx, lock);
+
+    // buffer 里的 put 都被 del 删光了，它们的 wal 记录已经不需要
+    if (groupBuffer->buffer.empty()) {
+        groupBuffer->firstLsn = NO_LSN;
+        updatePin(groupBuffer);
+        return true;
     }
 
+    groupBuffer->immutableBuffer.swap(groupBuffer->buffer);
+    groupBuffer->immutableBufferSize = groupBuffer->bufferSize;
+    groupBuffer->immutableFirstLsn = groupBuffer->firstLsn;
+    groupBuffer->buffer.clear();
+    groupBuffer->bufferSize = 0;
+    groupBuffer->firstLsn = NO_LSN;
+
+    groupBuffer->flushing = true;
+
+    _flushThreadPool.schedule(boost::bind(&BufferManager::backgroundFlush, this, idx));
+
+    return true;
+
+}
+
+// 在 _flushThreadPool 中执行，flushing 为 true 期间 immutable buffer 不会被修改，因此读它不需要持锁
+void BufferManager::backgroundFlush(int idx) {
+
+    GroupBuffer *groupBuffer = groupBuffers[idx];
+
     vector<ValueLayout> valueLayouts;
-    ValueLog::getInstance()->groupBatchPut(buffer, bufferSize, idx, valueLayouts);
+    ValueLog::getInstance()->groupBatchPut(groupBuffer->immutableBuffer, idx, valueLayouts);
 
     bool ret = LevelDBKeyManager::getInstance()->batchPut(valueLayouts);
 
@@ -269,110 +624,325 @@ bool BufferManager::flush(int idx, bool needLock) {
         printf("flush group%d fail\n", idx);
     }
 
-    return ret;
+    // 先标记再放开 pin，truncateWal 看到 pin 放开时一定也会同步这个文件
+    groupBuffer->unsynced = true;
+
+    {
+        // 必须在 lsm 更新之后再清空，否则 get 会出现 buffer 和 lsm 都找不到的窗口
+        lock_guard<mutex> lockGuard(groupBuffer->m);
+
+        groupBuffer->immutableBuffer.clear();
+        groupBuffer->immutableBufferSize = 0;
+        groupBuffer->immutableFirstLsn = NO_LSN;
+        updatePin(groupBuffer);
+        groupBuffer->flushing = false;
+
+        groupBuffer->flushCond.notify_all();
+    }
+
+    truncateWal();
+
+    ValueLog::getInstance()->checkpoint();
+
+}
+
+void BufferManager::truncateWal() {
+
+    WriteAheadLog *wal = WriteAheadLog::getInstance();
+    if (!wal->hasOldSegments()) {
+        return;
+    }
+
+    // 不拿 buffer 的锁：rebalance 可能拿着一个 group 的锁在等另一个 group 的 flush
+    lock_guard<mutex> lockGuard(truncateMutex);
+
+    // 先拿 nextLsn：之后新写入的记录 lsn 都不小于它，逐个看 pin 期间有新的写入也不会算漏
+    // 写 wal 之前已经 pin 住了 nextLsn，initial 的 pin 要先于 group 的读，生成 pivots 时是先设 group 的
+    uint64_t minLiveLsn = wal->getNextLsn();
+    minLiveLsn = min(minLiveLsn, initialPinnedLsn.load());
+    for (auto groupBuffer: groupBuffers) {
+        minLiveLsn = min(minLiveLsn, groupBuffer->pinnedLsn.load());
+    }
+
+    // 比 minLiveLsn 老的记录都写进了 group 文件和 lsm，但都没有同步
+    syncFlushed();
+
+    wal->truncate(minLiveLsn);
+
+}
+
+void BufferManager::syncFlushed() {
+
+    FileManager *fileManager = FileManager::getInstance();
+
+    if (initialUnsynced.exchange(false)) {
+        fileManager->syncFile(INITIAL_GROUP_ID);
+    }
+    for (int i = 0; i < groupNum; ++i) {
+        if (groupBuffers[i]->unsynced.exchange(false)) {
+            fileManager->syncFile(i);
+        }
+    }
+
+    LevelDBKeyManager::getInstance()->sync();
+
+}
 
+void BufferManager::pinNextLsn(atomic<uint64_t> &pinnedLsn) {
+    pinnedLsn = min(pinnedLsn.load(), WriteAheadLog::getInstance()->getNextLsn());
 }
 
+void BufferManager::updatePin(GroupBuffer *groupBuffer) {
+    uint64_t lsn = min(groupBuffer->firstLsn, groupBuffer->immutableFirstLsn);
+    if (!groupBuffer->deletingLsns.empty()) {
+        lsn = min(lsn, *groupBuffer->deletingLsns.begin());
+    }
+    groupBuffer->pinnedLsn = lsn;
+}
+
+// 调用前需持有 group idx 的锁
+void BufferManager::waitForFlush(int idx, unique_lock<mutex> &lock) {
+    GroupBuffer *groupBuffer = groupBuffers[idx];
+    groupBuffer->flushCond.wait(lock, [groupBuffer]() {
+        return !groupBuffer->flushing;
+    });
+}
+
+unique_lock<mutex> BufferManager::lockBelongingGroup(const string &key, int &idx) {
+    while (true) {
+        idx = getBelongingGroup(key);
+        unique_lock<mutex> lock(groupBuffers[idx]->m);
+        if (getBelongingGroup(key) == idx) {
+            return lock;
+        }
+    }
+}
+
+unique_lock<mutex> BufferManager::lockGroup(int idx, bool waitFlush) {
+    unique_lock<mutex> lock(groupBuffers[idx]->m);
+    if (waitFlush) {
+        waitForFlush(idx, lock);
+    }
+    return lock;
+}
+
+// immutable buffer 里的数据比 active buffer 旧，先拷 immutable 再用 active 覆盖
+void BufferManager::copyGroupBuffer(int idx, const string &startingKey, map<string, string> &entries) {
+    GroupBuffer *groupBuffer = groupBuffers[idx];
+    for (auto &pair: groupBuffer->immutableBuffer) {
+        if (pair.first >= startingKey) {
+            entries[pair.first] = pair.second;
+        }
+    }
+    for (auto &pair: groupBuffer->buffer) {
+        if (pair.first >= startingKey) {
+            entries[pair.first] = pair.second;
+        }
+    }
+}
+
+// 每次只持有一个 group 的锁
 void BufferManager::flushAll() {
 
     if (!pivotsGenerated()) {
-        printf("pivot not generated, flush not allowed\n");
-        return;
+        lock_guard<mutex> lockGuard(initialMutex);
+        if (!pivotsGenerated()) {
+            spillInitialBuffer();
+            return;
+        }
     }
 
-    mutex.lock();
+    for (int i = 0; i < groupNum; ++i) {
+        unique_lock<mutex> lock(groupBuffers[i]->m);
+        scheduleFlush(i, lock);
+    }
 
-    for (int i = 0; i < buffers.size(); ++i) {
-        flush(i, false);
+    // 等所有 group 都落盘完成
+    for (int i = 0; i < groupNum; ++i) {
+        unique_lock<mutex> lock(groupBuffers[i]->m);
+        waitForFlush(i, lock);
+    }
+
+}
+
+void BufferManager::flushBefore(uint64_t bound) {
+
+    if (!pivotsGenerated()) {
+        lock_guard<mutex> lockGuard(initialMutex);
+        if (!pivotsGenerated()) {
+            if (initialFirstLsn < bound) {
+                spillInitialBuffer();
+            }
+            return;
+        }
     }
 
-    mutex.unlock();
+    for (int i = 0; i < groupNum; ++i) {
+        unique_lock<mutex> lock(groupBuffers[i]->m);
+        if (groupBuffers[i]->firstLsn < bound) {
+            scheduleFlush(i, lock);
+        }
+    }
 
 }
 
 bool BufferManager::pivotsGenerated() {
-    return !pivots.empty();
+    return pivotsReady.load();
 }
 
-void BufferManager::initialGetRange(string &startingKey, int numKeys, vector<string> &keys,
+bool BufferManager::initialGetRange(const string &startingKey, int numKeys, vector<string> &keys,
                                     vector<string> &values) {
 
-    mutex.lock();
+    // 整个查询都持有 initialMutex，期间不会落盘，也不会生成 pivots 把 key 搬走
+    lock_guard<mutex> lockGuard(initialMutex);
+
+    if (pivotsGenerated()) {
+        return false;
+    }
 
     // 放到 map 里来达到排序的效果
     map<string, string> m;
 
     for (auto &it: initialBuffer) {
-        m[it.first] = it.second;
+        if (it.first >= startingKey) {
+            m[it.first] = it.second;
+        }
     }
 
-    mutex.unlock();
-
-    auto it = m.find(startingKey);
-
-    int count = 0;
+    // 落过盘的 key 都在 initial group 里，lsm 里最多取 numKeys 个就够了
+    vector<string> lsmKeys;
+    vector<ValueLayout> lsmLayouts;
+    if (spilled) {
+        LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+        FileManager *fileManager = FileManager::getInstance();
+        const leveldb::Snapshot *snapshot = levelDbKeyManager->getSnapshot();
+        levelDbKeyManager->getKeys(snapshot, startingKey, true, INF_UPPER_BOUND, numKeys, lsmKeys, lsmLayouts);
+        levelDbKeyManager->releaseSnapshot(snapshot);
+        fileManager->operateFileSharedMutex(INITIAL_GROUP_ID, LOCK);
+        ValueLog::getInstance()->assignValueInfo(lsmKeys, lsmLayouts);
+        fileManager->operateFileSharedMutex(INITIAL_GROUP_ID, UNLOCK);
+    }
 
-    while (true) {
+    // 归并，同一个 key 以 initialBuffer 为准
+    auto it = m.begin();
+    int lsmIdx = 0;
 
-        if (it == m.end() || count == numKeys) {
-            break;
-        }
+    while (keys.size() < numKeys && (it != m.end() || lsmIdx < lsmKeys.size())) {
 
-        if (it->second == DELETED_VALUE) {
+        if (lsmIdx == lsmKeys.size() || (it != m.end() && it->first <= lsmKeys[lsmIdx])) {
+            if (lsmIdx < lsmKeys.size() && it->first == lsmKeys[lsmIdx]) {
+                lsmIdx++;
+            }
+            if (it->second != DELETED_VALUE) {
+                keys.push_back(it->first);
+                values.push_back(it->second);
+            }
             it++;
-            continue;
+        } else {
+            if (lsmLayouts[lsmIdx].getValueInfo().valid) {
+                keys.push_back(lsmKeys[lsmIdx]);
+                values.push_back(lsmLayouts[lsmIdx].getValueInfo().value);
+            }
+            lsmIdx++;
         }
 
-        keys.push_back(it->first);
-        values.push_back(it->second);
+    }
 
-        it++;
-        count++;
+    return true;
 
-    }
+}
 
+shared_ptr<const vector<string>> BufferManager::loadPivots() {
+    return atomic_load(&pivots);
 }
 
 int BufferManager::getBelongingGroup(const string &key) {
-    int idx = lower_bound(pivots.begin(), pivots.end(), key) - pivots.begin();
+    shared_ptr<const vector<string>> p = loadPivots();
+    int idx = lower_bound(p->begin(), p->end(), key) - p->begin();
     return idx;
 }
 
 vector<string> BufferManager::getGroupBound(int groupId) {
+    shared_ptr<const vector<string>> p = loadPivots();
     vector<string> v;
     if (groupId == 0) {
         v.emplace_back(INF_LOWER_BOUND);
-        v.emplace_back(pivots[0]);
-    } else if (groupId == GROUP_NUM - 1) {
-        v.emplace_back(pivots[GROUP_NUM - 2]);
+        v.emplace_back((*p)[0]);
+    } else if (groupId == groupNum - 1) {
+        v.emplace_back((*p)[groupNum - 2]);
         v.emplace_back(INF_UPPER_BOUND);
     } else {
-        v.emplace_back(pivots[groupId - 1]);
-        v.emplace_back(pivots[groupId]);
+        v.emplace_back((*p)[groupId - 1]);
+        v.emplace_back((*p)[groupId]);
     }
     return v;
 }
 
+uint64_t BufferManager::getPivotsVersion() {
+    return pivotsVersion.load();
+}
+
+string BufferManager::setPivot(int boundary, const string &pivot) {
+
+    shared_ptr<const vector<string>> p = loadPivots();
+    auto *newPivots = new vector<string>(*p);
+    (*newPivots)[boundary] = pivot;
+
+    // pivot 往左挪时 boundary 里 > pivot 的归 boundary + 1，往右挪时 boundary + 1 里 <= pivot 的归 boundary
+    bool leftward = pivot < (*p)[boundary];
+    GroupBuffer *from = groupBuffers[leftward ? boundary : boundary + 1];
+    GroupBuffer *to = groupBuffers[leftward ? boundary + 1 : boundary];
+
+    for (auto it = from->buffer.begin(); it != from->buffer.end();) {
+        if ((it->first > pivot) != leftward) {
+            it++;
+            continue;
+        }
+        size_t size = Group::recordSize(it->first.size(), it->second.length());
+        from->bufferSize -= size;
+        to->bufferSize += size;
+        to->buffer[it->first] = move(it->second);
+        it = from->buffer.erase(it);
+        to->firstLsn = min(to->firstLsn, from->firstLsn);
+    }
+    updatePin(to);
+
+    string pivotInfo;
+    for (auto &key: *newPivots) {
+        pivotInfo += (key + "|");
+    }
+
+    atomic_store(&pivots, shared_ptr<const vector<string>>(newPivots));
+    pivotsVersion++;
+
+    return pivotInfo;
+
+}
+
 BufferManager::~BufferManager() {
 
-    // flush initial buffer
     if (!pivotsGenerated()) {
 
-        if (initialBuffer.empty()) {
-            return;
-        }
+        // initial buffer 落盘并在 lsm 里建好索引，重启后从 lsm 里重新抽样
+        spillInitialBuffer();
 
-        vector<ValueLayout> useless;
-        ValueLog::getInstance()->groupBatchPut(initialBuffer, initialBufferSize, INITIAL_GROUP_ID, useless);
+    } else {
 
-//        printf("destructor BufferManager\n");
+        // flush buffers
+        flushAll();
 
-        return;
+        // 等线程池里的任务都结束后再释放 group buffer
+        _flushThreadPool.wait();
 
     }
 
-    // flush buffers
-    flushAll();
+    // 所有写入都已经落盘，同步下去之后 wal 不再需要
+    syncFlushed();
+    WriteAheadLog::getInstance()->clear();
+
+    for (auto groupBuffer: groupBuffers) {
+        delete groupBuffer;
+    }
 
 //    printf("destructor BufferManager\n");
 
@@ -1,5 +1,6 @@
 #include <thread>
 #include "configManager.h"
+#include "constant.h"
 #include "debug.h"
 
 
@@ -31,9 +32,14 @@ void ConfigManager::setConfigPath (const char* path) {
     //     _buffer.numPipelinedBuffer = 1;
     // }
 
-    // // hotness
-    // _hotness.levels = 2;
-    // //if (_hotness.levels <= 0) _hotness.levels = 1;
+    // hotness
+    // 1 表示不区分冷热，2 表示每个 group 分成热文件和冷文件
+    _hotness.levels = (int) readUInt("hotness.levels", HOTNESS_DEFAULT_LEVELS);
+    if (_hotness.levels < 1) _hotness.levels = 1;
+    if (_hotness.levels > 2) _hotness.levels = 2;
+    _hotness.hotThreshold = readUInt("hotness.hotThreshold", HOTNESS_DEFAULT_HOT_THRESHOLD);
+    _hotness.coldGarbageRatio = readFloat("hotness.coldGarbageRatio", HOTNESS_DEFAULT_COLD_GARBAGE_RATIO);
+    _hotness.coldStorageDevice = readString("hotness.coldStorageDevice", "");
     // _hotness.useSlave = readBool("hotness.coldVLog");
     // if (!_hotness.useSlave) {
     //     _hotness.coldStorageSize = 0;
@@ -43,25 +49,43 @@ void ConfigManager::setConfigPath (const char* path) {
     //          _hotness.useSlave = false;
     //     }
     // }
-    // _hotness.coldStorageDevice = readString("hotness.coldStorageDevice");
 
     // key
     _key.lsmTreeDir = readString("key.lsmTreeDir");
     // _key.locationCacheSize = 0;
     // _key.dbType = readInt("key.useDB");
-    // _key.compress = readBool("key.useCompression");
+    _key.compress = readBool("key.useCompression", false);
+    // 以 lsm 里记录的 key 格式为准，打开 lsm 时设置
+    _key.padded = false;
     
     //val
     _val.Dir = readString("val.Dir");
+    // group 文件按块压缩，编译时没有 snappy 的话只能关掉
+    _val.compress = readBool("val.compression", false);
+#ifndef HAVE_SNAPPY
+    if (_val.compress) {
+        printf("snappy is not available, val.compression is ignored\n");
+        _val.compress = false;
+    }
+#endif
+    _val.blockCacheSize = readUInt("val.blockCacheSize", BLOCK_CACHE_DEFAULT_SIZE);
 
     // logmeta
     // _logmeta.persist = readBool("logmeta.persist");
 
-    // // gc
-    // _gc.greedyGCSize = readUInt("gc.greedyGCSize");
-    // if (_gc.greedyGCSize < 0) _gc.greedyGCSize = 1;
+    // gc
+    _gc.numThread = readUInt("gc.numGCThread", GC_DEFAULT_THREAD_NUM);
+    if (_gc.numThread == 0) _gc.numThread = 1;
+    _gc.greedyGCSize = readUInt("gc.greedyGCSize", _gc.numThread);
+    if (_gc.greedyGCSize == 0) _gc.greedyGCSize = 1;
     // _gc.mode = LOG_ONLY;
     // _gc.numReadThread = readUInt("gc.numReadThread");
+    _gc.background = readBool("gc.backgroundGC", true);
+    _gc.spaceThreshold = readFloat("gc.spaceThreshold", GC_DEFAULT_SPACE_THRESHOLD);
+    _gc.garbageRatio = readFloat("gc.garbageRatio", GC_DEFAULT_GARBAGE_RATIO);
+    _gc.idleSeconds = readUInt("gc.idleSeconds", GC_DEFAULT_IDLE_SECONDS);
+    _gc.idleGarbageRatio = readFloat("gc.idleGarbageRatio", GC_DEFAULT_IDLE_GARBAGE_RATIO);
+    _gc.rebalance = readBool("gc.rebalance", true);
     // if (_gc.numReadThread < 1) {
     //     _gc.numReadThread = 8;
     // }
@@ -90,8 +114,12 @@ void ConfigManager::setConfigPath (const char* path) {
     //     assert(_basic.numLogSegment > 0);
     // }
 
-    // // consistency
-    // _consistency.crash = readBool("consistency.crashProtected");
+    // consistency
+    // 打开时写入先记 wal，crash 之后重放 wal 恢复 buffer 里还没落盘的数据
+    _consistency.crash = readBool("consistency.crashProtected", true);
+    _consistency.walSync = readBool("consistency.walSync", false);
+    _consistency.walSyncInterval = readUInt("consistency.walSyncIntervalMs", WAL_DEFAULT_SYNC_INTERVAL);
+    if (_consistency.walSyncInterval == 0) _consistency.walSyncInterval = 1;
     // if (_consistency.crash && !_basic.segmentAsFile) {
     //     debug_error("Do not support block device crash consistency (%d, %d)\n", _consistency.crash, _basic.segmentAsFile);
     //     exit(-1);
@@ -107,10 +135,16 @@ void ConfigManager::setConfigPath (const char* path) {
     // _misc.numIoThread = readUInt("misc.numIoThread");
     // _misc.numCPUThread = std::thread::hardware_concurrency();
     // _misc.syncAfterWrite = readBool("misc.syncAfterWrite");
-    // _misc.numRangeScanThread = readUInt("misc.numRangeScanThread");
+    _misc.numRangeScanThread = readUInt("misc.numRangeScanThread", 1);
     // _misc.scanReadAhead = readBool("misc.enableScanReadAhead");
     // _misc.batchWriteThreshold = readInt("misc.writeBatchSize");
-    // _misc.useMmap = readBool("misc.enableMmap");
+    _misc.useMmap = readBool("misc.enableMmap", false);
+    // gc 和恢复时总是校验 group 文件里记录的 crc，get 和 range 查询只在打开时校验
+    _misc.verifyChecksum = readBool("misc.verifyChecksum", false);
+    _misc.locationCacheSize = readUInt("misc.locationCacheSize", LOCATION_CACHE_DEFAULT_SIZE);
+    _misc.valueCacheSize = readUInt("misc.valueCacheSize", VALUE_CACHE_DEFAULT_SIZE);
+    _misc.groupNum = readUInt("misc.groupNum", DEFAULT_GROUP_NUM);
+    _misc.pivotSampleKeys = readUInt("misc.pivotSampleKeys", PIVOT_DEFAULT_SAMPLE_KEYS);
     // _misc.maxOpenFiles = readInt("misc.maxOpenFiles");
 
     // if (_misc.numParallelFlush == 0) _misc.numParallelFlush = 1;
@@ -118,7 +152,9 @@ void ConfigManager::setConfigPath (const char* path) {
     // if (_misc.hashTableDefaultSize == 0) _misc.hashTableDefaultSize = 128 * 1024;
     // if (_misc.numIoThread <= 0) _misc.numIoThread = 1;
     // if (_misc.numCPUThread <= 0) { _misc.numCPUThread = NUM_THREAD; }
-    // if (_misc.numRangeScanThread == 0) { _misc.numRangeScanThread = 1; }
+    if (_misc.numRangeScanThread == 0) { _misc.numRangeScanThread = 1; }
+    if (_misc.groupNum < 2) { _misc.groupNum = 2; }
+    if (_misc.pivotSampleKeys < _misc.groupNum) { _misc.pivotSampleKeys = _misc.groupNum; }
     // if (_misc.maxOpenFiles < -1) { _misc.maxOpenFiles = -1; }
 
     // // debug
@@ -132,6 +168,10 @@ bool ConfigManager::readBool (const char* key) {
     return _pt.get<bool>(key);
 }
 
+bool ConfigManager::readBool (const char* key, bool defaultValue) {
+    return _pt.get<bool>(key, defaultValue);
+}
+
 int ConfigManager::readInt (const char* key) {
     return _pt.get<int>(key);
 }
@@ -140,6 +180,10 @@ unsigned int ConfigManager::readUInt (const char* key) {
     return _pt.get<unsigned int>(key);
 }
 
+unsigned int ConfigManager::readUInt (const char* key, unsigned int defaultValue) {
+    return _pt.get<unsigned int>(key, defaultValue);
+}
+
 LL ConfigManager::readLL (const char* key) {
     return _pt.get<LL>(key);
 }
@@ -152,10 +196,18 @@ double ConfigManager::readFloat (const char* key) {
     return _pt.get<double>(key);
 }
 
+double ConfigManager::readFloat (const char* key, double defaultValue) {
+    return _pt.get<double>(key, defaultValue);
+}
+
 std::string ConfigManager::readString (const char* key) {
     return _pt.get<std::string>(key);
 }
 
+std::string ConfigManager::readString (const char* key, const std::string &defaultValue) {
+    return _pt.get<std::string>(key, defaultValue);
+}
+
 segment_len_t ConfigManager::getSegmentSize(bool isLog) const {
     assert (!_pt.empty());
     return (isLog)? _basic.logSegmentSize : _basic.mainSegmentSize;
@@ -256,6 +308,16 @@ bool ConfigManager::useSeparateColdStorageDevice() const {
     return !_hotness.coldStorageDevice.empty();
 }
 
+uint32_t ConfigManager::getHotThreshold() const {
+    assert (!_pt.empty());
+    return _hotness.hotThreshold;
+}
+
+double ConfigManager::getColdGarbageRatio() const {
+    assert (!_pt.empty());
+    return _hotness.coldGarbageRatio;
+}
+
 std::string ConfigManager::getLSMTreeDir() const {
     assert (!_pt.empty());
     return _key.lsmTreeDir;
@@ -276,6 +338,24 @@ bool ConfigManager::dbNoCompress() const {
     return _key.compress == false;
 }
 
+bool ConfigManager::paddedKeys() const {
+    return _key.padded;
+}
+
+void ConfigManager::setPaddedKeys(bool padded) {
+    _key.padded = padded;
+}
+
+bool ConfigManager::compressValues() const {
+    assert(!_pt.empty());
+    return _val.compress;
+}
+
+uint32_t ConfigManager::getBlockCacheSize() const {
+    assert(!_pt.empty());
+    return _val.blockCacheSize;
+}
+
 bool ConfigManager::persistLogMeta() const {
     assert (!_pt.empty());
     return _logmeta.persist;
@@ -296,6 +376,41 @@ uint32_t ConfigManager::getNumGCReadThread() const {
     return _gc.numReadThread;
 }
 
+uint32_t ConfigManager::getNumGCThread() const {
+    assert (!_pt.empty());
+    return _gc.numThread;
+}
+
+bool ConfigManager::rebalanceGroups() const {
+    assert (!_pt.empty());
+    return _gc.rebalance;
+}
+
+bool ConfigManager::backgroundGC() const {
+    assert (!_pt.empty());
+    return _gc.background;
+}
+
+double ConfigManager::getGCSpaceThreshold() const {
+    assert (!_pt.empty());
+    return _gc.spaceThreshold;
+}
+
+double ConfigManager::getGCGarbageRatio() const {
+    assert (!_pt.empty());
+    return _gc.garbageRatio;
+}
+
+uint32_t ConfigManager::getGCIdleSeconds() const {
+    assert (!_pt.empty());
+    return _gc.idleSeconds;
+}
+
+double ConfigManager::getGCIdleGarbageRatio() const {
+    assert (!_pt.empty());
+    return _gc.idleGarbageRatio;
+}
+
 uint32_t ConfigManager::getMinValueSizeToLog() const {
     assert (!_pt.empty());
     return _kvsep.minValueSizeToLog;
@@ -321,6 +436,16 @@ bool ConfigManager::enableCrashConsistency() const {
     return _consistency.crash;
 }
 
+bool ConfigManager::syncWal() const {
+    assert (!_pt.empty());
+    return _consistency.walSync;
+}
+
+uint32_t ConfigManager::getWalSyncInterval() const {
+    assert (!_pt.empty());
+    return _consistency.walSyncInterval;
+}
+
 uint32_t ConfigManager::getHashTableDefaultSize() const {
     assert(!_pt.empty());
     return _misc.hashTableDefaultSize;
@@ -371,6 +496,35 @@ bool ConfigManager::useMmap() const {
     return _misc.useMmap;
 }
 
+bool ConfigManager::verifyChecksum() const {
+    assert(!_pt.empty());
+    return _misc.verifyChecksum;
+}
+
+uint32_t ConfigManager::getLocationCacheSize() const {
+    assert(!_pt.empty());
+    return _misc.locationCacheSize;
+}
+
+uint32_t ConfigManager::getValueCacheSize() const {
+    assert(!_pt.empty());
+    return _misc.valueCacheSize;
+}
+
+uint32_t ConfigManager::getGroupNum() const {
+    assert(!_pt.empty());
+    return _misc.groupNum;
+}
+
+uint32_t ConfigManager::getPivotSampleKeys() const {
+    assert(!_pt.empty());
+    return _misc.pivotSampleKeys;
+}
+
+void ConfigManager::setGroupNum(uint32_t groupNum) {
+    _misc.groupNum = groupNum;
+}
+
 int ConfigManager::getMaxOpenFiles() const {
     assert(!_pt.empty());
     return _misc.maxOpenFiles;
@@ -414,17 +568,23 @@ void ConfigManager::printConfig() const {
         " Use cold storage            : %s\n"
         " Cold storage size           : %lu\n"
         " Cold storage device         : %s\n"
+        " Hot threshold               : %u\n"
+        " Cold garbage ratio          : %.2f\n"
         , getHotnessLevel()
         , useSlave()? "true" : "false"
         , getColdStorageCapacity()
         , useSeparateColdStorageDevice()? getColdStorageDevice().c_str() : "(same, append)"
+        , getHotThreshold()
+        , getColdGarbageRatio()
     );
     printf(
         "--------- GC --------\n"
         " Greedy size                 : %d\n"
+        " GC threads                  : %u\n"
         " Mode                        : %s\n"
         " Read threads                : %u\n"
         , getGreedyGCSize()
+        , getNumGCThread()
         , getGCMode() == ALL? "all" : 
           getGCMode() == LOG_ONLY? "selctive (ratio)" :
           "unknown"
@@ -436,12 +596,19 @@ void ConfigManager::printConfig() const {
         " DB Type                     : %s\n"
         " Cache size                  : %lu records\n"
         " Disable compression         : %s\n"
+        "------ Values  ------\n"
+        " Path to value log           : %s\n"
+        " Block compression           : %s\n"
+        " Block cache size            : %u MB\n"
         "------ Log Meta -----\n"
         " Persist                     : %s\n"
         , getLSMTreeDir().c_str()
         , "LevelDB"
         , getKVLocationCacheSize()
         , dbNoCompress()? "true" : "false"
+        , getVALDir().c_str()
+        , compressValues()? "true" : "false"
+        , getBlockCacheSize()
         , persistLogMeta()? "true" : "false"
     );
     printf(
@@ -461,7 +628,11 @@ void ConfigManager::printConfig() const {
     printf(
         "---- Consistency ----\n"
         " Crash protection            : %s\n"
+        " Sync WAL on commit          : %s\n"
+        " WAL sync interval           : %u ms\n"
         , enableCrashConsistency()? "true" : "false"
+        , syncWal()? "true" : "false"
+        , getWalSyncInterval()
     );
     printf(
         "-------- Misc -------\n"
@@ -475,6 +646,9 @@ void ConfigManager::printConfig() const {
         " Max. size for batched write : %lu\n"
         " No. of scan threads         : %u\n"
         " Use mmap                    : %s\n"
+        " Verify checksum on reads    : %s\n"
+        " No. of groups               : %u\n"
+        " Keys sampled for pivots     : %u\n"
         "------- Debug  ------\n"
         " Debug Level                 : %d\n"
         , getHashTableDefaultSize()
@@ -491,6 +665,9 @@ void ConfigManager::printConfig() const {
         , getBatchWriteThreshold()
         , getNumRangeScanThread()
         , useMmap()? "true" : "false"
+        , verifyChecksum()? "true" : "false"
+        , getGroupNum()
+        , getPivotSampleKeys()
         , (int) getDebugLevel()
     );
 }
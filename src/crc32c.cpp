@@ -0,0 +1,95 @@
+#include "crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// 反射形式的多项式 0x82F63B78
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+struct Crc32cTable {
+    uint32_t t[256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            }
+            t[i] = c;
+        }
+    }
+};
+
+static uint32_t crc32cSoftware(const uint8_t *p, size_t length, uint32_t crc) {
+    static const Crc32cTable table;
+    while (length-- > 0) {
+        crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(const uint8_t *p, size_t length, uint32_t crc) {
+    uint64_t c = crc;
+    while (length >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        length -= 8;
+    }
+    auto c32 = (uint32_t) c;
+    while (length-- > 0) {
+        c32 = _mm_crc32_u8(c32, *p++);
+    }
+    return c32;
+}
+
+static bool hardwareSupported() {
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32cHardware(const uint8_t *p, size_t length, uint32_t crc) {
+    while (length >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+static bool hardwareSupported() {
+    return true;
+}
+
+#else
+
+static uint32_t crc32cHardware(const uint8_t *p, size_t length, uint32_t crc) {
+    return crc32cSoftware(p, length, crc);
+}
+
+static bool hardwareSupported() {
+    return false;
+}
+
+#endif
+
+uint32_t crc32c(const void *data, size_t length, uint32_t crc) {
+    auto *p = (const uint8_t *) data;
+    crc = ~crc;
+    crc = hardwareSupported() ? crc32cHardware(p, length, crc) : crc32cSoftware(p, length, crc);
+    return ~crc;
+}
@@ -5,75 +5,267 @@
 #include "file_manager.h"
 #include "constant.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <sys/mman.h>
 #include <boost/filesystem.hpp>
+#include <algorithm>
+#include <sys/stat.h>
 
 // FileManager* FileManager::instance = nullptr;
 // std::mutex FileManager::instance_mutex;
 
-FILE *FileManager::openFile(int groupId) {
+static bool writeFully(int fd, const void *data, size_t length, size_t offset) {
+    auto *ptr = (const uint8_t *) data;
+    while (length > 0) {
+        ssize_t n = pwrite(fd, ptr, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        ptr += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+FileWrapper *FileManager::findFile(int groupId, uint32_t generation) {
+    for (FileWrapper *file: groupFiles[groupId - INITIAL_GROUP_ID]) {
+        if (file->generation == generation) {
+            return file;
+        }
+    }
+    return nullptr;
+}
 
-    lock_guard<recursive_mutex> lockGuard(mutex);
+int FileManager::openFile(int groupId, uint32_t generation) {
 
-    FileWrapper *wrapper = openedFiles->get(groupId);
+    FileWrapper *file = findFile(groupId, generation);
 
-    if (wrapper != nullptr) {
-        return wrapper->fp;
+    if (file == nullptr) {
+        printf("file not exist, group %d, generation %u\n", groupId, generation);
+        return -1;
     }
 
-    FILE *fp;
+    return file->fd;
 
-    string filename = getFilename(groupId);
-    if (access(filename.c_str(), F_OK) == 0) {
-        fp = fopen(filename.c_str(), "rb+");
-    } else {
-        fp = fopen(filename.c_str(), "w+");
-    }
+}
 
-    if (!fp) {
-        printf("open file fail, file path: %s\n", filename.c_str());
+// 只在启动时读回 initial group 用到，调用方已经持有文件的独占锁；直接截断，fd 保持不变
+int FileManager::resetFile(int groupId) {
+
+//    printf("reset begin\n");
+
+    int fd = groupFiles[groupId - INITIAL_GROUP_ID].back()->fd;
+
+    if (ftruncate(fd, 0) != 0) {
+        printf("reset file fail, group %d\n", groupId);
     }
+    activeSizes[groupId - INITIAL_GROUP_ID].store(0);
 
-    openedFiles->put(groupId, new FileWrapper(fp));
-    fileMutexes[groupId] = new recursive_mutex();
+//    printf("reset success\n");
+
+    return fd;
 
-//    printf("open file success, file path: %s\n", filename);
+}
 
-    return fp;
+bool FileManager::readAt(int groupId, uint32_t generation, void *data, size_t length, size_t offset) {
+
+    int fd = openFile(groupId, generation);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto *ptr = (uint8_t *) data;
+    while (length > 0) {
+        ssize_t n = pread(fd, ptr, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("read file fail, group %d, offset %zu\n", groupId, offset);
+            return false;
+        }
+        ptr += n;
+        offset += n;
+        length -= n;
+    }
+
+    return true;
 
 }
 
-// gc 使用，不需要管文件相关的锁
-FILE *FileManager::resetFile(int groupId) {
+// 读者只会读 lsm 里已有的 position，因此不会读到写了一半的内容；共享锁只用来和切换、删除文件互斥
+size_t FileManager::appendFile(int groupId, const void *data, size_t length, uint32_t &generation) {
 
-//    printf("reset begin\n");
+    operateFileSharedMutex(groupId, LOCK);
 
-    lock_guard<recursive_mutex> lockGuard(mutex);
+    FileWrapper *file = groupFiles[groupId - INITIAL_GROUP_ID].back();
+    generation = file->generation;
 
-    FILE *fp = openFile(groupId);
+    size_t offset = activeSizes[groupId - INITIAL_GROUP_ID].fetch_add(length);
 
-    FileWrapper *wrapper = openedFiles->get(groupId);
+    if (!writeFully(file->fd, data, length, offset)) {
+        printf("write file fail, group %d, offset %zu\n", groupId, offset);
+    }
 
-    fclose(wrapper->fp);
+    bool remap = useMmap && (file->mapping == nullptr || offset + length > file->mapping->size);
 
-    wrapper->fp = fopen(getFilename(groupId).c_str(), "w+");
+    operateFileSharedMutex(groupId, UNLOCK);
 
-//    printf("reset success\n");
+    // mmap 读模式下文件长到了映射范围之外，换成独占锁重新映射，别的读者此时不能用旧的映射
+    if (remap) {
+        operateFileMutex(groupId, LOCK);
+        remapFile(groupId, generation, offset + length);
+        operateFileMutex(groupId, UNLOCK);
+    }
 
-    return wrapper->fp;
+    return offset;
 
 }
 
-recursive_mutex *FileManager::getFileMutex(int groupId) {
-    lock_guard<recursive_mutex> lockGuard(mutex);
-    if (fileMutexes.find(groupId) == fileMutexes.end()) {
+FileMapping *FileManager::mapFile(int groupId, int fd, size_t fileSize) {
+
+    size_t reserve = MMAP_MIN_RESERVE_SIZE;
+    while (reserve < fileSize * 2) {
+        reserve *= 2;
+    }
+
+    // 映射的范围可以超出文件末尾，文件追加之后新写的部分直接就能在映射里看到
+    // 读者只会读 lsm 里已有的 position，不会碰到文件末尾之后的页
+    void *addr = mmap(nullptr, reserve, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        printf("mmap file fail, group %d\n", groupId);
         return nullptr;
     }
-    return fileMutexes[groupId];
+
+    return new FileMapping{(uint8_t *) addr, reserve};
+
+}
+
+const uint8_t *FileManager::mappedData(int groupId, uint32_t generation, size_t offset, size_t length) {
+
+    if (!useMmap) {
+        return nullptr;
+    }
+
+    FileWrapper *file = findFile(groupId, generation);
+    if (file == nullptr || file->mapping == nullptr || offset + length > file->mapping->size) {
+        return nullptr;
+    }
+
+    return file->mapping->addr + offset;
+
+}
+
+void FileManager::remapFile(int groupId, uint32_t generation, size_t fileSize) {
+
+    FileWrapper *file = findFile(groupId, generation);
+
+    // 在拿到独占锁之前，可能已经有别人重新映射过了
+    if (file == nullptr || (file->mapping != nullptr && fileSize <= file->mapping->size)) {
+        return;
+    }
+
+    // 独占锁下没有读者在用旧的映射，可以直接释放
+    FileMapping *mapping = file->mapping;
+    file->mapping = mapFile(groupId, file->fd, fileSize);
+    if (mapping != nullptr) {
+        munmap(mapping->addr, mapping->size);
+        delete mapping;
+    }
+
+}
+
+uint32_t FileManager::addGeneration(int groupId) {
+
+    vector<FileWrapper *> &files = groupFiles[groupId - INITIAL_GROUP_ID];
+    uint32_t generation = files.back()->generation + 1;
+
+    string filename = getFilename(groupId, generation);
+    // 上一次 gc 中途退出时可能留下了同名的空文件，lsm 里不会有指向它的 position，直接截断
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("open file fail, file path: %s\n", filename.c_str());
+        return files.back()->generation;
+    }
+
+    auto *file = new FileWrapper(fd, generation);
+    if (useMmap) {
+        file->mapping = mapFile(groupId, fd, 0);
+    }
+    files.push_back(file);
+
+    activeSizes[groupId - INITIAL_GROUP_ID].store(0);
+    activeGenerations[groupId - INITIAL_GROUP_ID].store(generation);
+
+    return generation;
+
+}
+
+size_t FileManager::retireGenerations(int groupId, uint32_t generation) {
+
+    vector<FileWrapper *> &files = groupFiles[groupId - INITIAL_GROUP_ID];
+
+    size_t freed = 0;
+    while (files.size() > 1 && files.front()->generation < generation) {
+        FileWrapper *file = files.front();
+        struct stat st{};
+        if (fstat(file->fd, &st) == 0) {
+            freed += st.st_size;
+        }
+        unlink(getFilename(groupId, file->generation).c_str());
+        delete file;
+        files.erase(files.begin());
+    }
+
+    return freed;
+
+}
+
+void FileManager::syncFile(int groupId) {
+
+    operateFileSharedMutex(groupId, LOCK);
+
+    for (FileWrapper *file: groupFiles[groupId - INITIAL_GROUP_ID]) {
+        if (fdatasync(file->fd) != 0) {
+            printf("sync file fail, group %d, generation %u\n", groupId, file->generation);
+        }
+    }
+
+    // 新的一代是 gc 时才创建的，目录项也要落盘，否则掉电后文件本身可能不见了
+    string dir = boost::filesystem::path(getFilename(groupId)).parent_path().string();
+    int dirFd = open(dir.c_str(), O_RDONLY);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+
+    operateFileSharedMutex(groupId, UNLOCK);
+
+}
+
+uint32_t FileManager::getGeneration(int groupId) {
+    return activeGenerations[groupId - INITIAL_GROUP_ID].load();
+}
+
+size_t FileManager::getGenerationCount(int groupId) {
+    operateFileSharedMutex(groupId, LOCK);
+    size_t count = groupFiles[groupId - INITIAL_GROUP_ID].size();
+    operateFileSharedMutex(groupId, UNLOCK);
+    return count;
+}
+
+RWMutex *FileManager::getFileMutex(int groupId) {
+    return fileMutexes[groupId - INITIAL_GROUP_ID];
 }
 
 void FileManager::operateFileMutex(int groupId, bool lock) {
 
-    recursive_mutex *fileMutex = getFileMutex(groupId);
+    RWMutex *fileMutex = getFileMutex(groupId);
 
     if (lock) {
         fileMutex->lock();
@@ -85,14 +277,140 @@ void FileManager::operateFileMutex(int groupId, bool lock) {
 
 }
 
-string FileManager::getFilename(int groupId) {
-    std:: string val_dir = ConfigManager::getInstance().getVALDir();
-    return val_dir + "/group@" + to_string(groupId) + "@";
+void FileManager::operateFileSharedMutex(int groupId, bool lock) {
+
+    RWMutex *fileMutex = getFileMutex(groupId);
+
+    if (lock) {
+        fileMutex->lock_shared();
+    } else {
+        fileMutex->unlock_shared();
+    }
+
+}
+
+string FileManager::getFilename(int groupId, uint32_t generation) {
+    string filename;
+    if (isColdGroup(groupId)) {
+        filename = getColdDir() + "/cold@" + to_string(groupId - groupNum) + "@";
+    } else {
+        filename = ConfigManager::getInstance().getVALDir() + "/group@" + to_string(groupId) + "@";
+    }
+    if (generation > 0) {
+        filename += "." + to_string(generation);
+    }
+    return filename;
+}
+
+string FileManager::getColdDir() {
+    ConfigManager &configManager = ConfigManager::getInstance();
+    return configManager.useSeparateColdStorageDevice() ? configManager.getColdStorageDevice()
+                                                        : configManager.getVALDir();
 }
 
-FileManager::FileManager(const char *val_dir) {
+// 在 dir 里找 prefix@N@ 或者 prefix@N@.<generation> 的文件，N + idOffset 是文件的 groupId
+static void scanFiles(const string &dir, const char *prefix, int idOffset, int groupNum,
+                      vector<vector<uint32_t>> &generations) {
 
-    this->openedFiles = new LruList<int, FileWrapper *>(FILE_LRU_CAPACITY);
+    boost::filesystem::path dirPath(dir);
+    if (!boost::filesystem::exists(dirPath)) {
+        boost::filesystem::create_directory(dirPath);
+    }
+
+    string pattern = string(prefix) + "@%d@%31s";
+    boost::filesystem::directory_iterator itEnd;
+    for (boost::filesystem::directory_iterator it(dirPath); it != itEnd; ++it) {
+        string name = it->path().filename().string();
+        int groupId;
+        char suffix[32] = {0};
+        if (sscanf(name.c_str(), pattern.c_str(), &groupId, suffix) < 1 ||
+            groupId < INITIAL_GROUP_ID || groupId >= groupNum || (idOffset > 0 && groupId < 0)) {
+            continue;
+        }
+        uint32_t generation = 0;
+        if (suffix[0] != '\0') {
+            char *end;
+            generation = strtoul(suffix + 1, &end, 10);
+            if (suffix[0] != '.' || *end != '\0') {
+                continue;
+            }
+        }
+        generations[groupId + idOffset - INITIAL_GROUP_ID].push_back(generation);
+    }
+
+}
+
+void FileManager::loadFiles() {
+
+    vector<vector<uint32_t>> generations(2 * groupNum + 1);
+    scanFiles(ConfigManager::getInstance().getVALDir(), "group", 0, groupNum, generations);
+    scanFiles(getColdDir(), "cold", groupNum, groupNum, generations);
+
+    // 开了冷热分离，或者之前开过、已经有冷文件了，才打开各个 group 的冷文件，否则冷文件的位置空着
+    coldEnabled = ConfigManager::getInstance().getHotnessLevel() > 1;
+    for (int groupId = groupNum; groupId < 2 * groupNum; ++groupId) {
+        coldEnabled = coldEnabled || !generations[groupId - INITIAL_GROUP_ID].empty();
+    }
+
+    int endId = coldEnabled ? 2 * groupNum : groupNum;
+    for (int groupId = INITIAL_GROUP_ID; groupId < endId; ++groupId) {
+
+        vector<uint32_t> &gens = generations[groupId - INITIAL_GROUP_ID];
+        if (gens.empty()) {
+            gens.push_back(0);
+        }
+        sort(gens.begin(), gens.end());
+
+        for (uint32_t generation: gens) {
+            string filename = getFilename(groupId, generation);
+            int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0) {
+                printf("open file fail, file path: %s\n", filename.c_str());
+                continue;
+            }
+            auto *file = new FileWrapper(fd, generation);
+            struct stat st{};
+            fstat(fd, &st);
+            if (useMmap) {
+                file->mapping = mapFile(groupId, fd, st.st_size);
+            }
+            groupFiles[groupId - INITIAL_GROUP_ID].push_back(file);
+            activeSizes[groupId - INITIAL_GROUP_ID].store(st.st_size);
+            activeGenerations[groupId - INITIAL_GROUP_ID].store(generation);
+        }
+
+    }
+
+}
+
+bool FileManager::isColdGroup(int groupId) {
+    return groupId >= groupNum;
+}
+
+int FileManager::getColdGroupId(int groupId) {
+    return groupId + groupNum;
+}
+
+int FileManager::getOwnerGroupId(int groupId) {
+    return isColdGroup(groupId) ? groupId - groupNum : groupId;
+}
+
+bool FileManager::coldFilesEnabled() {
+    return coldEnabled;
+}
+
+FileManager::FileManager(const char *val_dir) :
+        groupFiles(2 * ConfigManager::getInstance().getGroupNum() + 1),
+        activeGenerations(2 * ConfigManager::getInstance().getGroupNum() + 1),
+        activeSizes(2 * ConfigManager::getInstance().getGroupNum() + 1),
+        groupNum((int) ConfigManager::getInstance().getGroupNum()) {
+
+    // initial group、各个 group 的热文件和冷文件各一把锁，冷文件没有打开时锁也先建好
+    for (int i = 0; i < groupFiles.size(); ++i) {
+        fileMutexes.push_back(new RWMutex());
+    }
+
+    useMmap = ConfigManager::getInstance().useMmap();
 
     boost::filesystem::path path;
     path += boost::filesystem::path(val_dir);
@@ -103,45 +421,52 @@ FileManager::FileManager(const char *val_dir) {
         printf("path %s generate success\n", path.c_str());
     }
 
+    loadFiles();
+
 }
 
 FileManager::~FileManager() {
-    delete openedFiles;
-    for (auto &fileMutex: fileMutexes) {
-        delete fileMutex.second;
+    for (auto &files: groupFiles) {
+        for (FileWrapper *file: files) {
+            delete file;
+        }
+    }
+    for (RWMutex *fileMutex: fileMutexes) {
+        delete fileMutex;
     }
 //    printf("destructor FileManager\n");
 }
 
 size_t FileManager::getFileSize(int groupId) {
+    return activeSizes[groupId - INITIAL_GROUP_ID].load();
+}
+
+size_t FileManager::getDiskSize(int groupId) {
 
-    boost::filesystem::path filePath(getFilename(groupId));
+    operateFileSharedMutex(groupId, LOCK);
 
-    if (!exists(filePath)) {
-        return 0;
+    size_t size = 0;
+    for (FileWrapper *file: groupFiles[groupId - INITIAL_GROUP_ID]) {
+        struct stat st{};
+        if (fstat(file->fd, &st) == 0) {
+            size += st.st_size;
+        }
     }
 
-    return file_size(filePath);
+    operateFileSharedMutex(groupId, UNLOCK);
 
-//    // 下面是如何遍历一个文件夹的案例，留着不删了
-//    boost::filesystem::path dirPath("../data/group@" + to_string(groupId) + "@");
-//
-//    boost::filesystem::directory_iterator it(dirPath);
-//    boost::filesystem::directory_iterator itEnd;
-//
-//    int dirSize = 0;
-//
-//    while (it != itEnd) {
-//        dirSize += (file_size(it->path()));
-//        it++;
-//    }
-//
-//    return dirSize;
+    return size;
 
 }
 
-FileWrapper::FileWrapper(FILE *fp) : fp(fp) {}
+FileWrapper::FileWrapper(int fd, uint32_t generation) : fd(fd), generation(generation), mapping(nullptr) {}
 
 FileWrapper::~FileWrapper() {
-    fclose(fp);
+    if (mapping != nullptr) {
+        munmap(mapping->addr, mapping->size);
+        delete mapping;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
 }
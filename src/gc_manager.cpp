@@ -12,6 +12,11 @@
 #include "thread_pool_manager.h"
 #include "server.h"
 #include "statistics_manager.h"
+#include "configManager.h"
+#include "rebalance_manager.h"
+#include "hotness_sketch.h"
+#include <chrono>
+#include <boost/bind.hpp>
 
 void GcManager::gc(int groupId) {
 
@@ -28,51 +33,174 @@ void GcManager::gc(int groupId) {
 
     ValueLog *valueLog = ValueLog::getInstance();
     if (groupId == INVALID_GROUP_ID) {
-        groupId = valueLog->getGroupWithMaxIncr();
+        vector<int> victims = valueLog->pickVictims(0, 1);
+        groupId = victims.empty() ? valueLog->getGroupWithMaxIncr() : victims[0];
     }
 //    printf("gc group %d\n", groupId);
 
     FileManager *fileManager = FileManager::getInstance();
-    dfdb::Server *server = dfdb::Server::getInstance();
-    assert(server != nullptr);
     LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+    HotnessSketch *hotnessSketch = HotnessSketch::getInstance();
+    ConfigManager &configManager = ConfigManager::getInstance();
 
-    lock_guard<recursive_mutex> lockGuard1(bufferManager->mutex);
-    lock_guard<recursive_mutex> lockGuard2(levelDbKeyManager->mutex);
+    // groupId 可能是冷文件，冷文件和它所属 group 的热文件共用 group 的 key range、buffer 锁和 gc 锁
+    int ownerId = fileManager->getOwnerGroupId(groupId);
+    int coldId = fileManager->getColdGroupId(ownerId);
 
-    fileManager->operateFileMutex(groupId, LOCK);
+    // 热文件里存活下来、最近更新得少的 value 降级到冷文件，冷文件里存活的还写回冷文件
+    bool demote = !fileManager->isColdGroup(groupId) && configManager.getHotnessLevel() > 1;
+    uint32_t hotThreshold = configManager.getHotThreshold();
 
-    // 得到 group 的 range
-    vector<string> v = bufferManager->getGroupBound(groupId);
+    // 同一个 group 同时只能有一个 gc
+    lock_guard<mutex> gcLock(groupGcMutexes[ownerId]);
+
+    // 加锁顺序固定为 group 的 buffer -> group 的文件 -> lsm，与 Server::get / getRange 的文件 -> lsm 一致，避免死锁
+    // gc 不再在整个过程中持有这些锁：
+    // 1. 短暂地锁住 group 的 buffer（等它正在进行的 flush 结束）和文件，切到新的一代并拿 lsm 快照，
+    //    之后的 flush 都追加到新的一代里，快照里这个 group 的 position 就是所有指向旧的各代的 position
+    // 2. 不持有任何锁，把快照里的 kv 一个 chunk 一个 chunk 地搬到新的一代，按 position 是否变过有条件地更新 lsm，
+    //    读者照常读旧的各代，写入和 flush 照常进行
+    // 3. 再短暂地锁住 buffer 和文件，删掉旧的各代；独占锁会等正在读旧文件的读者读完，
+    //    buffer 锁挡住 getRange 在拿快照和拿文件锁之间的那段时间
+    vector<string> v = bufferManager->getGroupBound(ownerId);
     string lowerBound = v[0];
     string upperBound = v[1];
 
-    // 对 server 进行一次 range 内的范围查询
-    vector<string> keys;
-    vector<string> values;
-    std::cout << "start: server->getRange (lsm get gc old index)" << std::endl;
-    server->getRange(lowerBound, upperBound, keys, values);
-//    for (int i = 0; i < keys.size(); ++i) {
-//        printf("key = %s, value = %s\n", keys[i].c_str(), values[i].c_str());
-//    }
-    std::cout << "finish: server->getRange (lsm get gc old index)" << std::endl;
-    // 用最新的 kv 覆写原本的 group
-    vector<ValueLayout> valueLayouts;
+    uint32_t generation;
+    const leveldb::Snapshot *snapshot;
+    {
+        unique_lock<mutex> groupLock = bufferManager->lockGroup(ownerId);
+        fileManager->operateFileMutex(groupId, LOCK);
+        generation = valueLog->startGroupRewrite(groupId);
+        snapshot = levelDbKeyManager->getSnapshot();
+        fileManager->operateFileMutex(groupId, UNLOCK);
+    }
+
+    // 按 key 的顺序每次从快照取一批 position，再按字节数切成 chunk，每个 chunk 读出 value、追加到新的一代、
+    // 用一个 WriteBatch 更新 position，内存占用只和 chunk 的大小有关
     std::cout << "start: valueLog->groupRewrite (val-log gc)" << std::endl;
-    size_t rewriteSize = valueLog->groupRewrite(keys, values, groupId, valueLayouts);
+
+    size_t rewriteSize = 0;
+    size_t demotedSize = 0;
+    // 有 chunk 读失败的话它的 key 还留在旧的各代里，这次不能删旧的各代
+    bool readFailed = false;
+    // group 的范围左开右闭，下界的 pivot 属于前一个 group，不能搬到这个 group 里
+    string fromKey = lowerBound;
+
+    while (true) {
+
+        vector<string> keys;
+        vector<ValueLayout> layouts;
+        levelDbKeyManager->getKeys(snapshot, fromKey, false, upperBound, GC_SCAN_KEY_NUM, keys, layouts);
+        if (keys.empty()) {
+            break;
+        }
+        fromKey = keys.back();
+
+        size_t begin = 0;
+        while (begin < keys.size()) {
+
+            vector<string> chunkKeys;
+            vector<ValueLayout> chunkLayouts;
+            size_t chunkSize = 0;
+            while (begin < keys.size() &&
+                   (chunkLayouts.empty() || chunkSize + layouts[begin].getPositionInfo().length <= GC_CHUNK_SIZE)) {
+                // 只搬这个文件的；重启前没搬完的 gc 留下的、已经在新一代里的不用再搬
+                const PositionInfo &position = layouts[begin].getPositionInfo();
+                if (position.groupId == groupId && position.generation < generation) {
+                    chunkSize += layouts[begin].getPositionInfo().length;
+                    chunkKeys.push_back(keys[begin]);
+                    chunkLayouts.push_back(layouts[begin]);
+                }
+                begin++;
+            }
+            if (chunkLayouts.empty()) {
+                continue;
+            }
+
+            vector<PositionInfo> oldPositions;
+            for (auto &layout: chunkLayouts) {
+                oldPositions.push_back(layout.getPositionInfo());
+            }
+
+            // 旧的各代只会在第 3 步被删除，读它们只需要共享锁
+            fileManager->operateFileSharedMutex(groupId, LOCK);
+            bool read = valueLog->assignValueInfo(chunkKeys, chunkLayouts, true);
+            fileManager->operateFileSharedMutex(groupId, UNLOCK);
+            if (!read) {
+                readFailed = true;
+                continue;
+            }
+            vector<string> droppedKeys;
+            vector<PositionInfo> droppedPositions;
+            valueLog->dropCorrupted(chunkKeys, chunkLayouts, oldPositions, droppedKeys, droppedPositions);
+            // 坏掉的 value 留在要删掉的旧文件里，lsm 里的 key 不删的话就指向了不存在的文件
+            levelDbKeyManager->gcBatchDelete(droppedKeys, droppedPositions);
+            if (chunkLayouts.empty()) {
+                continue;
+            }
+
+            if (!demote) {
+                rewriteSize += valueLog->groupRewrite(chunkLayouts, groupId);
+                levelDbKeyManager->gcBatchPut(oldPositions, chunkLayouts);
+                continue;
+            }
+
+            vector<ValueLayout> hotLayouts, coldLayouts;
+            vector<PositionInfo> hotPositions, coldPositions;
+            for (int i = 0; i < chunkLayouts.size(); ++i) {
+                if (hotnessSketch->estimate(chunkKeys[i]) >= hotThreshold) {
+                    hotLayouts.push_back(chunkLayouts[i]);
+                    hotPositions.push_back(oldPositions[i]);
+                } else {
+                    coldLayouts.push_back(chunkLayouts[i]);
+                    coldPositions.push_back(oldPositions[i]);
+                }
+            }
+
+            if (!hotLayouts.empty()) {
+                rewriteSize += valueLog->groupRewrite(hotLayouts, groupId);
+                levelDbKeyManager->gcBatchPut(hotPositions, hotLayouts);
+            }
+            if (!coldLayouts.empty()) {
+                demotedSize += valueLog->groupRewrite(coldLayouts, coldId);
+                levelDbKeyManager->gcBatchPut(coldPositions, coldLayouts);
+            }
+
+        }
+
+    }
+
+    levelDbKeyManager->releaseSnapshot(snapshot);
+
     std::cout << "finish: valueLog->groupRewrite (val-log gc)" << std::endl;
-    statisticsManager->addCount(GC_WRITE_BYTES, rewriteSize);
-//    for (int i = 0; i < valueLayouts.size(); ++i) {
-//        printf("groupId = %d, offset = %d, length = %d\n", valueLayouts[i].getPositionInfo().groupId,
-//               valueLayouts[i].getPositionInfo().offset, valueLayouts[i].getPositionInfo().length);
-//    }
+    if (demotedSize > 0) {
+        printf("gc group %d: %zu bytes stay hot, %zu bytes demoted to cold file\n", groupId, rewriteSize, demotedSize);
+    }
+    statisticsManager->addCount(GC_WRITE_BYTES, rewriteSize + demotedSize);
 
-    std::cout << "start: levelDbKeyManager->batchPut (lsm update gc new index)" << std::endl;
-    // 更新 lsm 中 value 的位置
-    levelDbKeyManager->batchPut(valueLayouts);
-    std::cout << "finish: levelDbKeyManager->batchPut (lsm update gc new index)" << std::endl;
+    // 删除旧文件之前先把搬过去的数据落盘（包括降级到的冷文件），再把 lsm 同步落盘，
+    // 掉电重启后 lsm 里的 position 指向的数据一定在盘上，不会指向已经删掉的旧文件或者没写下去的新文件
+    // 降级到冷文件的 position 也在这之前的 WriteBatch 里，一起落盘
+    fileManager->syncFile(groupId);
+    if (demotedSize > 0) {
+        fileManager->syncFile(coldId);
+    }
+    levelDbKeyManager->writeGroupStats(groupId);
 
-    fileManager->operateFileMutex(groupId, UNLOCK);
+    // 旁边的 boundary 挪了一半时，挪进来的 position 不在这次扫的 key range 里，旧的各代留到挪完之后的 gc 再删
+    if (readFailed) {
+        printf("gc group %d: read fail, keep old generations\n", groupId);
+    } else if (RebalanceManager::getInstance()->isMoving(ownerId)) {
+        printf("gc group %d: rebalance unfinished, keep old generations\n", groupId);
+    } else {
+        unique_lock<mutex> groupLock = bufferManager->lockGroup(ownerId, false);
+        fileManager->operateFileMutex(groupId, LOCK);
+        valueLog->finishGroupRewrite(groupId, generation);
+        fileManager->operateFileMutex(groupId, UNLOCK);
+    }
+
+    valueLog->checkpoint();
 
     statisticsManager->stopTimer(GC_TIME_COST, randomNumber);
 
@@ -80,54 +208,193 @@ void GcManager::gc(int groupId) {
 
 }
 
-// GcManager::GcManager(boost::asio::io_service &_ctx) : ctx(_ctx), timer(_ctx) {
-//     startTimer();
-//     // 一定要 run 才会真正让计时器启动，但 run 又是个阻塞操作，直到计时器操作完毕，因此得放到一个线程里 run
-//     thread = std::thread([this]() {
-//         ctx.run();
-//     });
-// }
+mutex &GcManager::getGroupGcMutex(int groupId) {
+    return groupGcMutexes[groupId];
+}
 
-GcManager::GcManager() {
+GcManager::GcManager() : groupGcMutexes(ConfigManager::getInstance().getGroupNum()) {
 
 }
 
-// GcManager::~GcManager() {
-//     timer.cancel();
-//     ctx.stop();
-//     thread.join();
-// //    printf("destructor GcManager\n");
-// }
+GcManager::~GcManager() {
+    stop();
+}
 
-// GcManager::~GcManager() {
-//     timer.cancel();
-//     ctx.stop();
-//     thread.join();
-// //    printf("destructor GcManager\n");
-// }
+void GcManager::start() {
+    lock_guard<mutex> lockGuard(m);
+    if (running) {
+        return;
+    }
+    running = true;
+    thread = std::thread(&GcManager::backgroundGC, this);
+}
 
-GcManager::~GcManager() {
+void GcManager::stop() {
+    {
+        lock_guard<mutex> lockGuard(m);
+        if (!running) {
+            return;
+        }
+        running = false;
+        cond.notify_all();
+        roundCond.notify_all();
+    }
+    thread.join();
+}
+
+bool GcManager::isRunning() {
+    lock_guard<mutex> lockGuard(m);
+    return running;
+}
 
+void GcManager::waitForRound() {
+    unique_lock<mutex> lock(m);
+    if (!running) {
+        return;
+    }
+    uint64_t target = rounds + 2;
+    wakeUpRequested = true;
+    cond.notify_all();
+    // 唤醒时可能正好有一轮在进行，这一轮挑 group 时不一定看到了最新的空间，所以等下一轮做完
+    roundCond.wait(lock, [this, target]() {
+        return !running || rounds >= target;
+    });
 }
 
-// void GcManager::startTimer() {
-//     timer.expires_from_now(std::chrono::seconds(GC_CHECK_INTERVAL));
-//     timer.async_wait([this](const boost::system::error_code &ec) {
-//         if (ec) {
-//             printf("timer error!!\n");
-//         } else {
-//             ValueLog *valueLog = ValueLog::getInstance();
-//             int groupId = valueLog->getGroupWithMaxIncr();
-//             if (groupId != -1) {
-//                 gc(groupId);
-//             }
-//         }
-//         startTimer();
-//     });
-// }
+void GcManager::backgroundGC() {
+
+    // 上一轮 gc 了某个 group 的话不等待，立刻开始下一轮，直到没有需要 gc 的 group
+    bool busy = false;
+    bool requested;
+
+    while (true) {
+
+        {
+            unique_lock<mutex> lock(m);
+            if (!busy) {
+                cond.wait_for(lock, chrono::seconds(GC_CHECK_INTERVAL), [this]() {
+                    return !running || wakeUpRequested;
+                });
+            }
+            if (!running) {
+                break;
+            }
+            requested = wakeUpRequested;
+            wakeUpRequested = false;
+        }
+
+        vector<int> groupIds = pickGroups(requested);
+        busy = !groupIds.empty();
+        if (busy) {
+            gcGroups(groupIds);
+        } else if (ConfigManager::getInstance().rebalanceGroups()) {
+            // 没有需要 gc 的 group 时才考虑 rebalance，挪了的话下一轮接着看
+            busy = RebalanceManager::getInstance()->rebalance();
+        }
 
+        lock_guard<mutex> lockGuard(m);
+        rounds++;
+        roundCond.notify_all();
+
+    }
+
+}
+
+vector<int> GcManager::pickGroups(bool requested) {
+
+    if (!BufferManager::getInstance()->pivotsGenerated()) {
+        return {};
+    }
+
+    ConfigManager &configManager = ConfigManager::getInstance();
+    ValueLog *valueLog = ValueLog::getInstance();
+    size_t maxCount = configManager.getGreedyGCSize();
+
+    // 空间不够时，在所有有垃圾的 group 里按 cost-benefit 挑
+    // 不知道垃圾在哪里（比如旧数据还没有统计）时，只有 flush 在等空间才退回到增量最大的 group，否则会一直重写没有垃圾的 group
+    if (valueLog->getTotalDbSize() >= configManager.getGCSpaceThreshold() * DISK_SIZE) {
+        vector<int> groupIds = valueLog->pickVictims(0, maxCount);
+        if (groupIds.empty() && requested) {
+            groupIds.push_back(valueLog->getGroupWithMaxIncr());
+        }
+        if (!groupIds.empty()) {
+            return groupIds;
+        }
+    }
+
+    vector<int> groupIds = valueLog->pickVictims(configManager.getGCGarbageRatio(), maxCount);
+    if (!groupIds.empty()) {
+        return groupIds;
+    }
+
+    // 一段时间没有 flush，说明写入空闲，可以用更低的阈值把垃圾清掉
+    int64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    if (now - valueLog->getLastFlushTime() >= configManager.getGCIdleSeconds()) {
+        return valueLog->pickVictims(configManager.getGCIdleGarbageRatio(), maxCount);
+    }
+
+    return {};
+
+}
+
+// 一次 gcGroups 里各个 group 的 gc 任务的完成计数
+// 和 range 查询一样不能用 pool.wait()，那样会连别人放进池子里的 gc 一起等
+struct GcCountdown {
+    mutex m;
+    condition_variable cond;
+    size_t remaining;
+};
+
+static void gcTask(GcManager *gcManager, int groupId, GcCountdown *countdown) {
+    gcManager->gc(groupId);
+    lock_guard<mutex> lockGuard(countdown->m);
+    if (--countdown->remaining == 0) {
+        countdown->cond.notify_one();
+    }
+}
+
+void GcManager::gcGroups(const vector<int> &groupIds) {
+
+    // 不同 group 的 gc 只在 ValueLog / lsm 的短临界区里碰面，读旧文件、写新文件都可以并行
+    boost::threadpool::pool &pool = ThreadPoolManager::getInstance()->_gcThreadPool;
+    if (groupIds.size() <= 1 || pool.size() <= 1) {
+        for (int groupId: groupIds) {
+            gc(groupId);
+        }
+        return;
+    }
+
+    GcCountdown countdown;
+    countdown.remaining = groupIds.size();
+    for (int groupId: groupIds) {
+        pool.schedule(boost::bind(&gcTask, this, groupId, &countdown));
+    }
+
+    unique_lock<mutex> lock(countdown.m);
+    countdown.cond.wait(lock, [&countdown] { return countdown.remaining == 0; });
+
+}
+
+void GcManager::gcVictims() {
+    ValueLog *valueLog = ValueLog::getInstance();
+    vector<int> groupIds = valueLog->pickVictims(0, ConfigManager::getInstance().getGreedyGCSize());
+    if (groupIds.empty()) {
+        groupIds.push_back(valueLog->getGroupWithMaxIncr());
+    }
+    gcGroups(groupIds);
+}
+
+// 冷文件打开了的话也都 gc 一遍
 void GcManager::gcAll() {
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        gc(i);
+    FileManager *fileManager = FileManager::getInstance();
+    vector<int> groupIds;
+    for (int i = 0; i < groupGcMutexes.size(); ++i) {
+        groupIds.push_back(i);
+    }
+    if (fileManager->coldFilesEnabled()) {
+        for (int i = 0; i < groupGcMutexes.size(); ++i) {
+            groupIds.push_back(fileManager->getColdGroupId(i));
+        }
     }
+    gcGroups(groupIds);
 }
@@ -1,217 +1,431 @@
 #include "group.h"
 #include "file_manager.h"
 #include "constant.h"
+#include "io_engine.h"
+#include "crc32c.h"
+#include "block_cache.h"
+#include "configManager.h"
+#ifdef HAVE_SNAPPY
+#include <snappy.h>
+#endif
+#include <memory>
 #include <numeric>
+#include <algorithm>
 
-Group::Group(int groupId) : groupId(groupId) {}
+Group::Group(int groupId, uint32_t generation) : groupId(groupId), generation(generation) {}
 
-void Group::batchPut(unordered_map<string, string> &pairs, size_t totalSize, vector<ValueLayout> &valueLayouts) {
+size_t Group::recordSize(size_t keySize, size_t valueSize) {
+    return RECORD_HEADER_SIZE + keySize + valueSize;
+}
 
-//    cout << "===========groupBatchPut begin===========" << endl;
+uint8_t *Group::encodeRecord(uint8_t *ptr, const string &key, const string &value) {
 
-    FileManager *fileManager = FileManager::getInstance();
+    // 版本, valueSize, 4B
+    uint32_t header = (RECORD_FORMAT_VERSION << RECORD_VERSION_SHIFT) | (uint32_t) value.size();
+    memcpy(ptr, &header, sizeof(uint32_t));
 
-    // 最终要落盘的文件
-    FILE *fp = fileManager->openFile(groupId);
-    fileManager->operateFileMutex(groupId, LOCK);
+    // keySize, 2B
+    auto keySize = (uint16_t) key.size();
+    memcpy(ptr + 2 * sizeof(uint32_t), &keySize, sizeof(uint16_t));
 
-    // 先把 kv 都写到 data 里
-    void *data = malloc(totalSize);
-    auto *ptr = (uint8_t *) data;
+    // key
+    memcpy(ptr + RECORD_HEADER_SIZE, key.c_str(), key.size());
 
-    fseek(fp, 0, SEEK_END);
-    size_t writeFrom = ftell(fp);
+    // value
+    memcpy(ptr + RECORD_HEADER_SIZE + key.size(), value.c_str(), value.size());
 
-    for (auto &pair: pairs) {
+    // crc, 4B，先算头部再接着算 keySize、key 和 value
+    uint32_t crc = crc32c(ptr, sizeof(uint32_t));
+    crc = crc32c(ptr + 2 * sizeof(uint32_t), sizeof(uint16_t) + key.size() + value.size(), crc);
+    memcpy(ptr + sizeof(uint32_t), &crc, sizeof(uint32_t));
 
-        string key = pair.first;
-        string value = pair.second;
-        uint32_t valueSize = value.length();
+    return ptr + RECORD_HEADER_SIZE + key.size() + value.size();
 
-        ValueLayout valueLayout;
-        valueLayout.setValueInfo(valueSize, key, value);
-        valueLayout.setPositionInfo(groupId, writeFrom + ptr - (uint8_t *) data,
-                                    sizeof(uint32_t) + key.length() + value.length());
-        valueLayouts.push_back(valueLayout);
+}
+
+bool Group::decodeRecord(const uint8_t *data, size_t available, bool verify, string *key, string &value,
+                         size_t &recordLength) {
 
-        // value size, 4B
-        memcpy(ptr, &valueSize, sizeof(uint32_t));
-//        printf("put valueSize = %d\n", valueSize);
-        ptr += sizeof(uint32_t);
+    uint32_t header;
+    if (available < sizeof(uint32_t)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(uint32_t));
+
+    uint32_t version = header >> RECORD_VERSION_SHIFT;
+    size_t headerSize;
+    size_t keySize = KEY_LENGTH;
+    uint32_t valueSize = header & MAX_VALUE_SIZE;
+    if (version == 0) {
+        // 旧格式没有 crc，没法校验
+        headerSize = LEGACY_RECORD_HEADER_SIZE;
+        valueSize = header;
+    } else if (version == FIXED_KEY_RECORD_VERSION) {
+        headerSize = FIXED_KEY_RECORD_HEADER_SIZE;
+    } else if (version == RECORD_FORMAT_VERSION) {
+        headerSize = RECORD_HEADER_SIZE;
+        if (available < RECORD_HEADER_SIZE) {
+            return false;
+        }
+        uint16_t size;
+        memcpy(&size, data + 2 * sizeof(uint32_t), sizeof(uint16_t));
+        keySize = size;
+    } else {
+        return false;
+    }
 
-        // key
-        memcpy(ptr, key.c_str(), key.size());
-        ptr += key.size();
+    recordLength = headerSize + keySize + valueSize;
+    if (recordLength > available) {
+        return false;
+    }
 
-        // value
-        memcpy(ptr, value.c_str(), value.size());
-        ptr += value.size();
+    // crc 从第 8B 开始覆盖到记录末尾，新格式的 keySize 也在里面
+    if (verify && version != 0) {
+        uint32_t stored;
+        memcpy(&stored, data + sizeof(uint32_t), sizeof(uint32_t));
+        uint32_t crc = crc32c(data, sizeof(uint32_t));
+        crc = crc32c(data + 2 * sizeof(uint32_t), recordLength - 2 * sizeof(uint32_t), crc);
+        if (crc != stored) {
+            return false;
+        }
+    }
 
+    if (key != nullptr) {
+        key->assign((const char *) data + headerSize, keySize);
     }
+    value.assign((const char *) data + headerSize + keySize, valueSize);
 
-    fwrite(data, 1, totalSize, fp);
+    return true;
 
-    fileManager->operateFileMutex(groupId, UNLOCK);
+}
 
-    free(data);
+bool Group::encodeBlock(const string &raw, string &block) {
 
-//    cout << "===========groupBatchPut end===========" << endl;
+#ifdef HAVE_SNAPPY
+    block.resize(BLOCK_HEADER_SIZE + snappy::MaxCompressedLength(raw.size()));
+    size_t compressedLength;
+    snappy::RawCompress(raw.data(), raw.size(), &block[BLOCK_HEADER_SIZE], &compressedLength);
+
+    // 省不到 1/8 的不值得，读的时候还要多解压一次
+    if (compressedLength > MAX_VALUE_SIZE || BLOCK_HEADER_SIZE + compressedLength > raw.size() - raw.size() / 8) {
+        return false;
+    }
+    block.resize(BLOCK_HEADER_SIZE + compressedLength);
+
+    // 版本, 压缩后长度, 4B；原始长度, 4B；crc, 4B
+    uint32_t header = (BLOCK_FORMAT_VERSION << RECORD_VERSION_SHIFT) | (uint32_t) compressedLength;
+    auto rawLength = (uint32_t) raw.size();
+    memcpy(&block[0], &header, sizeof(uint32_t));
+    memcpy(&block[sizeof(uint32_t)], &rawLength, sizeof(uint32_t));
+    uint32_t crc = crc32c(block.data(), 2 * sizeof(uint32_t));
+    crc = crc32c(block.data() + BLOCK_HEADER_SIZE, compressedLength, crc);
+    memcpy(&block[2 * sizeof(uint32_t)], &crc, sizeof(uint32_t));
+
+    return true;
+#else
+    (void) raw;
+    (void) block;
+    return false;
+#endif
 
 }
 
-size_t
-Group::rewrite(vector<std::string> &keys, vector<std::string> &values, vector<ValueLayout> &valueLayouts) {
+bool Group::decodeBlock(const uint8_t *data, size_t length, bool verify, string &raw) {
 
-    size_t totalSize = accumulate(values.begin(), values.end(), 0, [](size_t sum, const std::string &value) {
-        return sum + (sizeof(uint32_t) + KEY_LENGTH + value.length());
-    });
+    if (length < BLOCK_HEADER_SIZE) {
+        return false;
+    }
 
-    FileManager *fileManager = FileManager::getInstance();
+    uint32_t header, rawLength;
+    memcpy(&header, data, sizeof(uint32_t));
+    memcpy(&rawLength, data + sizeof(uint32_t), sizeof(uint32_t));
 
-    fileManager->operateFileMutex(groupId, LOCK);
+    size_t compressedLength = header & MAX_VALUE_SIZE;
+    if (header >> RECORD_VERSION_SHIFT != BLOCK_FORMAT_VERSION || BLOCK_HEADER_SIZE + compressedLength != length) {
+        return false;
+    }
 
-    FILE *fp = fileManager->resetFile(groupId);
+    if (verify) {
+        uint32_t stored;
+        memcpy(&stored, data + 2 * sizeof(uint32_t), sizeof(uint32_t));
+        uint32_t crc = crc32c(data, 2 * sizeof(uint32_t));
+        crc = crc32c(data + BLOCK_HEADER_SIZE, compressedLength, crc);
+        if (crc != stored) {
+            return false;
+        }
+    }
 
-    // 先把 kv 都写到 data 里
-    void *data = malloc(totalSize);
-    auto *ptr = (uint8_t *) data;
+#ifdef HAVE_SNAPPY
+    // 压缩数据坏了的话 snappy 会报错，不会越界
+    const char *compressed = (const char *) data + BLOCK_HEADER_SIZE;
+    size_t uncompressedLength;
+    if (!snappy::GetUncompressedLength(compressed, compressedLength, &uncompressedLength) ||
+        uncompressedLength != rawLength) {
+        return false;
+    }
+    raw.resize(rawLength);
+    return snappy::RawUncompress(compressed, compressedLength, &raw[0]);
+#else
+    (void) data;
+    (void) length;
+    (void) verify;
+    (void) raw;
+    printf("compressed block found but snappy is not available\n");
+    return false;
+#endif
 
-//    fseek(fp, 0, SEEK_SET);
-//    int writeFrom = ftell(fp);
-//    if (writeFrom != 0) {
-//        printf("writeFrom should be 0\n");
-//    }
+}
+
+bool Group::decodeBlockRecord(const string &raw, const PositionInfo &position, bool verify, string *key,
+                              string &value) {
+    size_t recordLength;
+    return position.inBlockOffset < raw.size() &&
+           decodeRecord((const uint8_t *) raw.data() + position.inBlockOffset, raw.size() - position.inBlockOffset,
+                        verify, key, value, recordLength);
+}
 
-    for (int i = 0; i < keys.size(); ++i) {
+size_t Group::batchPut(unordered_map<string, string> &pairs, vector<ValueLayout> &valueLayouts) {
+
+//    cout << "===========groupBatchPut begin===========" << endl;
 
-        string key = keys[i];
-        string value = values[i];
-        uint32_t valueSize = value.length();
+    size_t first = valueLayouts.size();
 
+    // 按 key 排好序再写，每次 flush 在文件里留下一段有序的 run，range 查询和 gc 读相邻的 key 时能合成一次 io
+    vector<const pair<const string, string> *> sortedPairs;
+    sortedPairs.reserve(pairs.size());
+    for (auto &pair: pairs) {
+        sortedPairs.push_back(&pair);
+    }
+    sort(sortedPairs.begin(), sortedPairs.end(),
+         [](const pair<const string, string> *a, const pair<const string, string> *b) { return a->first < b->first; });
+
+    for (auto pair: sortedPairs) {
         ValueLayout valueLayout;
-        valueLayout.setValueInfo(valueSize, key, value);
-        valueLayout.setPositionInfo(groupId, ptr - (uint8_t *) data,
-                                    sizeof(uint32_t) + key.length() + value.length());
+        valueLayout.setValueInfo(pair->second.length(), pair->first, pair->second);
         valueLayouts.push_back(valueLayout);
+    }
 
-        // value size, 4B
-        memcpy(ptr, &valueSize, sizeof(uint32_t));
-//        printf("put valueSize = %d\n", valueSize);
-        ptr += sizeof(uint32_t);
+//    cout << "===========groupBatchPut end===========" << endl;
 
-        // key
-        memcpy(ptr, key.c_str(), key.size());
-        ptr += key.size();
+    return append(valueLayouts, first);
 
-        // value
-        memcpy(ptr, value.c_str(), value.size());
-        ptr += value.size();
+}
 
-    }
+// gc 使用，把读出了 value 的一批 kv 追加到当前代（gc 新建的那一代）的文件里，并把 position 改成新的位置
+// 每次只处理 gc 的一个 chunk，buffer 的大小是有上限的
+size_t Group::rewrite(vector<ValueLayout> &valueLayouts) {
+    // gc 读出来的记录可能是旧格式的，重写时统一写成新格式
+    return append(valueLayouts, 0);
+}
 
-    fwrite(data, 1, totalSize, fp);
+size_t Group::append(vector<ValueLayout> &valueLayouts, size_t first) {
 
-    fileManager->operateFileMutex(groupId, UNLOCK);
+    // initial group 的文件会被截断重用，同一个 offset 可能先后是不同的块，块缓存分不清，所以它不压缩
+    bool compress = groupId != INITIAL_GROUP_ID && ConfigManager::getInstance().compressValues();
 
-    free(data);
+    auto sizeOf = [&valueLayouts](size_t i) {
+        return recordSize(valueLayouts[i].getValueInfo().key.size(), valueLayouts[i].getValueInfo().value.size());
+    };
 
-    return totalSize;
+    // 先把 kv 都写到 data 里，position 里先记相对于 data 的偏移
+    string data;
 
-}
+    if (!compress) {
+        size_t totalSize = 0;
+        for (size_t i = first; i < valueLayouts.size(); ++i) {
+            totalSize += sizeOf(i);
+        }
+        data.resize(totalSize);
+        auto *ptr = (uint8_t *) &data[0];
+        for (size_t i = first; i < valueLayouts.size(); ++i) {
+            const ValueInfo &valueInfo = valueLayouts[i].getValueInfo();
+            valueLayouts[i].setPositionInfo(groupId, ptr - (uint8_t *) data.data(), sizeOf(i));
+            ptr = encodeRecord(ptr, valueInfo.key, valueInfo.value);
+        }
+    }
 
-// 一个 offset 和 length 里可能会对应多个 valueLayout
-void Group::read(vector<size_t> &offsets, vector<size_t> &lengths, vector<ValueLayout *> &valueLayouts) {
+    // 按写入的顺序每凑够 COMPRESSION_BLOCK_SIZE 的记录压成一个块，range 查询读相邻的记录时一个块只解压一次
+    size_t begin = compress ? first : valueLayouts.size();
+    while (begin < valueLayouts.size()) {
+
+        size_t end = begin;
+        size_t rawSize = 0;
+        while (end < valueLayouts.size()) {
+            size_t size = sizeOf(end);
+            if (end > begin && rawSize + size > COMPRESSION_BLOCK_SIZE) {
+                break;
+            }
+            rawSize += size;
+            end++;
+        }
 
-    // 处理到哪个 valueLayout 了
-    int layoutPtr = 0;
+        string raw(rawSize, '\0');
+        auto *ptr = (uint8_t *) &raw[0];
+        for (size_t i = begin; i < end; ++i) {
+            ptr = encodeRecord(ptr, valueLayouts[i].getValueInfo().key, valueLayouts[i].getValueInfo().value);
+        }
 
-    FileManager *fileManager = FileManager::getInstance();
+        string block;
+        bool compressed = encodeBlock(raw, block);
+
+        size_t offset = data.size();
+        size_t inBlockOffset = 0;
+        for (size_t i = begin; i < end; ++i) {
+            size_t size = sizeOf(i);
+            if (compressed) {
+                // 块里的每条记录按原始大小分摊压缩后的字节数，至少记 1B
+                size_t share = max((size_t) 1, size * block.size() / rawSize);
+                valueLayouts[i].setPositionInfo(groupId, offset, share, 0, block.size(), inBlockOffset);
+            } else {
+                valueLayouts[i].setPositionInfo(groupId, offset + inBlockOffset, size);
+            }
+            inBlockOffset += size;
+        }
 
-    for (int i = 0; i < offsets.size(); ++i) {
+        data += compressed ? block : raw;
+        begin = end;
 
-        size_t offset = offsets[i];
-        size_t length = lengths[i];
+    }
 
-        void *data = malloc(length);
+    // 追加到当前代的文件末尾，gc 进行中的话当前代就是 gc 正在写的新文件
+    uint32_t generation;
+    size_t writeFrom = FileManager::getInstance()->appendFile(groupId, data.data(), data.size(), generation);
 
-        FILE *fp = fileManager->openFile(groupId);
-        fileManager->operateFileMutex(groupId, LOCK);
-        fseek(fp, offset, SEEK_SET);
-        fread(data, 1, length, fp);
-        fileManager->operateFileMutex(groupId, UNLOCK);
+    for (size_t i = first; i < valueLayouts.size(); ++i) {
+        PositionInfo positionInfo = valueLayouts[i].getPositionInfo();
+        positionInfo.offset += writeFrom;
+        positionInfo.generation = generation;
+        valueLayouts[i].setPositionInfo(positionInfo);
+    }
 
-        auto *ptr = (uint8_t *) data;
+    return data.size();
 
-        while (ptr - (uint8_t *) data < length) {
+}
 
-            uint32_t valueSize;
-            string key;
-            string value;
+// 一个 offset 和 length 里可能会对应多个 valueLayout，压缩块里的多条记录对应同一个块
+// 调用方需持有该 group 文件的锁（共享或独占），从 generation 这一代的文件里读，所有 extent 交给 IoEngine 一次性读
+bool Group::read(vector<size_t> &offsets, vector<size_t> &lengths, vector<ValueLayout *> &valueLayouts,
+                 bool verify, bool fillCache) {
+
+    // extent 读完的顺序不确定，先算出每个 extent 对应的第一个 valueLayout
+    // 属于同一个 extent 的 layout 是连续的，并且整条记录（或者整个块）都落在这个 extent 里
+    // extent 之间可能有重叠，下一个 extent 开头的 layout 如果也整个落在这个 extent 里，从这个 extent 里解析也一样
+    vector<size_t> firstLayouts(offsets.size() + 1);
+    size_t layoutPtr = 0;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        firstLayouts[i] = layoutPtr;
+        while (layoutPtr < valueLayouts.size()) {
+            const PositionInfo &position = valueLayouts[layoutPtr]->getPositionInfo();
+            size_t length = position.blockLength > 0 ? position.blockLength : position.length;
+            if (position.offset < offsets[i] || position.offset + length > offsets[i] + lengths[i]) {
+                break;
+            }
+            layoutPtr++;
+        }
+    }
+    firstLayouts[offsets.size()] = layoutPtr;
+
+    BlockCache *blockCache = BlockCache::getInstance();
 
-            memcpy(&valueSize, ptr, sizeof(uint32_t));
-            ptr += sizeof(uint32_t);
+    auto parseExtent = [&](int i, const uint8_t *data) {
 
-            key.resize(KEY_LENGTH);
-            value.resize(valueSize);
+        // 这个 extent 里已经解压过的块，块内的记录在 layout 里不一定挨着
+        unordered_map<size_t, shared_ptr<const string>> blocks;
 
-            memcpy((void *) key.c_str(), ptr, KEY_LENGTH);
-            ptr += KEY_LENGTH;
+        for (size_t layoutIdx = firstLayouts[i]; layoutIdx < firstLayouts[i + 1]; ++layoutIdx) {
 
-            memcpy((void *) value.c_str(), ptr, valueSize);
-            ptr += valueSize;
+            // 按 position 里的 offset 找记录，一条记录坏了不会影响后面的记录
+            ValueLayout *layout = valueLayouts[layoutIdx];
+            const PositionInfo &position = layout->getPositionInfo();
+            const uint8_t *ptr = data + (position.offset - offsets[i]);
 
-            valueLayouts[layoutPtr++]->setValueInfo(valueSize, key, value);
+            string key;
+            string value;
+            bool ok;
+            if (position.blockLength > 0) {
+                auto it = blocks.find(position.offset);
+                if (it == blocks.end()) {
+                    string raw;
+                    shared_ptr<const string> block;
+                    if (decodeBlock(ptr, position.blockLength, verify, raw)) {
+                        block = make_shared<const string>(move(raw));
+                        if (fillCache) {
+                            blockCache->put(groupId, generation, position.offset, block);
+                        }
+                    }
+                    it = blocks.emplace(position.offset, block).first;
+                }
+                ok = it->second != nullptr && decodeBlockRecord(*it->second, position, verify, &key, value);
+            } else {
+                size_t recordLength;
+                ok = decodeRecord(ptr, position.length, verify, &key, value, recordLength) &&
+                     recordLength == position.length;
+            }
+
+            if (!ok) {
+                printf("corrupted record in group %d generation %u offset %zu\n", groupId, generation,
+                       position.offset);
+            } else {
+                layout->setValueInfo(value.size(), key, value);
+            }
 
         }
 
-        free(data);
+    };
 
+    // mmap 读模式下直接在映射上解析，没有额外的拷贝和系统调用
+    FileManager *fileManager = FileManager::getInstance();
+    size_t end = 0;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        end = max(end, offsets[i] + lengths[i]);
+    }
+    const uint8_t *mapped = fileManager->mappedData(groupId, generation, 0, end);
+    if (mapped != nullptr) {
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            parseExtent(i, mapped + offsets[i]);
+        }
+        return true;
     }
 
+    return IoEngine::getInstance()->readExtents(groupId, generation, offsets, lengths, parseExtent);
+
 }
 
-// 只有 gc 才会用到这个方法，而 gc 肯定是已经获取了对应 group 的写锁的，因此方法内部不再需要考虑锁的事情
+// 只在启动时读回 initial group 用到，持有独占锁把整个文件读出来再截断
 void Group::readAndReset(unordered_map<string, ValueLayout> &layouts) {
 
     FileManager *fileManager = FileManager::getInstance();
 
-    FILE *fp = fileManager->openFile(groupId);
+    fileManager->operateFileMutex(groupId, LOCK);
 
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
+    size_t size = fileManager->getFileSize(groupId);
 
     if (size == 0) {
+        fileManager->operateFileMutex(groupId, UNLOCK);
         return;
     }
 
     void *data = malloc(size);
 
-    fileManager->operateFileMutex(groupId, LOCK);
-    fseek(fp, 0, SEEK_SET);
-    fread(data, 1, size, fp);
-    fileManager->operateFileMutex(groupId, UNLOCK);
+    fileManager->readAt(groupId, fileManager->getGeneration(groupId), data, size, 0);
 
     auto *ptr = (uint8_t *) data;
 
+    // 恢复时总是校验，没有 position 可以对照，遇到坏的记录后面的就都不可信了
     while (ptr - (uint8_t *) data < size) {
 
-        uint32_t valueSize;
         string key;
         string value;
+        size_t recordLength;
 
-        memcpy(&valueSize, ptr, sizeof(uint32_t));
-        ptr += sizeof(uint32_t);
-
-        key.resize(KEY_LENGTH);
-        value.resize(valueSize);
-
-        memcpy((void *) key.c_str(), ptr, KEY_LENGTH);
-        ptr += KEY_LENGTH;
-
-        memcpy((void *) value.c_str(), ptr, valueSize);
-        ptr += valueSize;
+        if (!decodeRecord(ptr, size - (ptr - (uint8_t *) data), true, &key, value, recordLength)) {
+            printf("corrupted record in group %d offset %zu, %zu bytes dropped\n", groupId,
+                   (size_t) (ptr - (uint8_t *) data), size - (ptr - (uint8_t *) data));
+            break;
+        }
+        ptr += recordLength;
 
-        layouts[key].setValueInfo(valueSize, key, value);
+        layouts[key].setValueInfo(value.size(), key, value);
 
     }
 
@@ -219,6 +433,8 @@ void Group::readAndReset(unordered_map<string, ValueLayout> &layouts) {
 
     fileManager->resetFile(groupId);
 
+    fileManager->operateFileMutex(groupId, UNLOCK);
+
 }
 
 // 文件统一在 FileManager 中关闭
@@ -0,0 +1,66 @@
+#include "hotness_sketch.h"
+#include "constant.h"
+#include <string_view>
+
+// 双重 hash：第 i 行的下标是 h1 + i * h2，只需要算一次 hash
+static size_t sketchIndex(size_t h, int row) {
+    size_t h1 = h & 0xffffffff;
+    size_t h2 = (h >> 32) | 1;
+    return row * HOTNESS_SKETCH_WIDTH + (h1 + row * h2) % HOTNESS_SKETCH_WIDTH;
+}
+
+HotnessSketch::HotnessSketch() : counters(HOTNESS_SKETCH_DEPTH * HOTNESS_SKETCH_WIDTH), additions(0) {
+}
+
+void HotnessSketch::record(const string &key) {
+
+    size_t h = hash<string_view>()(string_view(key));
+
+    // 只加最小的那几个计数器（conservative update），其他行的计数器已经被别的 key 撑大了，不必再加
+    uint8_t minimum = UINT8_MAX;
+    for (int i = 0; i < HOTNESS_SKETCH_DEPTH; ++i) {
+        minimum = min(minimum, counters[sketchIndex(h, i)].load(memory_order_relaxed));
+    }
+    // 其他线程可能同时在加同一个计数器，用 CAS 加，到 UINT8_MAX 为止，不会绕回 0
+    if (minimum < UINT8_MAX) {
+        for (int i = 0; i < HOTNESS_SKETCH_DEPTH; ++i) {
+            atomic<uint8_t> &counter = counters[sketchIndex(h, i)];
+            uint8_t value = counter.load(memory_order_relaxed);
+            if (value != minimum) {
+                continue;
+            }
+            while (value < UINT8_MAX &&
+                   !counter.compare_exchange_weak(value, value + 1, memory_order_relaxed)) {
+            }
+        }
+    }
+
+    if (additions.fetch_add(1, memory_order_relaxed) + 1 >= HOTNESS_SKETCH_WIDTH * HOTNESS_SKETCH_RESET_FACTOR) {
+        age();
+    }
+
+}
+
+uint8_t HotnessSketch::estimate(const string &key) {
+    size_t h = hash<string_view>()(string_view(key));
+    uint8_t minimum = UINT8_MAX;
+    for (int i = 0; i < HOTNESS_SKETCH_DEPTH; ++i) {
+        minimum = min(minimum, counters[sketchIndex(h, i)].load(memory_order_relaxed));
+    }
+    return minimum;
+}
+
+void HotnessSketch::age() {
+    unique_lock<mutex> lock(agingMutex, try_to_lock);
+    // 别的线程正在减半
+    if (!lock.owns_lock()) {
+        return;
+    }
+    if (additions.load() < HOTNESS_SKETCH_WIDTH * HOTNESS_SKETCH_RESET_FACTOR) {
+        return;
+    }
+    additions.store(0);
+    for (auto &counter: counters) {
+        counter.store(counter.load(memory_order_relaxed) >> 1, memory_order_relaxed);
+    }
+}
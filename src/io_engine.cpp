@@ -0,0 +1,315 @@
+#include "io_engine.h"
+#include "file_manager.h"
+#include "constant.h"
+#include <cstdlib>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+
+#include <liburing.h>
+#include <sys/uio.h>
+
+// 每个线程自己的 ring，第一次用到时初始化，线程退出时释放
+// ring 的提交队列不是线程安全的，所以不能在线程之间共享
+struct ThreadRing {
+
+    struct io_uring ring;
+
+    // 初始化是否成功，失败后这个线程一直走同步 pread
+    bool ready = false;
+
+    // 注册给内核的固定 buffer，按 IO_URING_SLOT_SIZE 切成 IO_URING_QUEUE_DEPTH 个槽位
+    // 注册失败时（比如 RLIMIT_MEMLOCK 不够）仍然可以用，只是提交的是普通 read
+    uint8_t *arena = nullptr;
+    bool registered = false;
+
+    // 空闲的槽位
+    vector<int> freeSlots;
+
+    ThreadRing() {
+
+        if (io_uring_queue_init(IO_URING_QUEUE_DEPTH, &ring, 0) < 0) {
+            printf("io_uring init fail, fall back to pread\n");
+            return;
+        }
+
+        if (posix_memalign((void **) &arena, 4096, IO_URING_QUEUE_DEPTH * IO_URING_SLOT_SIZE) != 0) {
+            arena = nullptr;
+            io_uring_queue_exit(&ring);
+            return;
+        }
+
+        vector<struct iovec> iovecs(IO_URING_QUEUE_DEPTH);
+        for (int i = 0; i < IO_URING_QUEUE_DEPTH; ++i) {
+            iovecs[i].iov_base = arena + i * IO_URING_SLOT_SIZE;
+            iovecs[i].iov_len = IO_URING_SLOT_SIZE;
+            freeSlots.push_back(i);
+        }
+        registered = io_uring_register_buffers(&ring, iovecs.data(), IO_URING_QUEUE_DEPTH) == 0;
+
+        ready = true;
+
+    }
+
+    virtual ~ThreadRing() {
+        if (ready) {
+            io_uring_queue_exit(&ring);
+        }
+        free(arena);
+    }
+
+};
+
+#endif
+
+IoEngine::IoEngine() = default;
+
+bool IoEngine::readExtents(int groupId, uint32_t generation, const vector<size_t> &offsets,
+                           const vector<size_t> &lengths, const ExtentCallback &onExtent) {
+
+#ifdef USE_IO_URING
+    // 只有一个 extent 时走 io_uring 没有任何收益
+    if (offsets.size() > 1) {
+        return uringReadExtents(groupId, generation, offsets, lengths, onExtent);
+    }
+#endif
+
+    return syncReadExtents(groupId, generation, offsets, lengths, onExtent);
+
+}
+
+// 同步读，所有 extent 共用一块 buffer，不再每个 extent malloc 一次
+bool IoEngine::syncReadExtents(int groupId, uint32_t generation, const vector<size_t> &offsets,
+                               const vector<size_t> &lengths, const ExtentCallback &onExtent) {
+
+    FileManager *fileManager = FileManager::getInstance();
+
+    size_t maxLength = 0;
+    for (size_t length: lengths) {
+        maxLength = max(maxLength, length);
+    }
+
+    auto *data = (uint8_t *) malloc(maxLength);
+
+    // 一个 extent 读失败不影响后面的 extent
+    bool success = true;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (!fileManager->readAt(groupId, generation, data, lengths[i], offsets[i])) {
+            success = false;
+            continue;
+        }
+        onExtent(i, data);
+    }
+
+    free(data);
+
+    return success;
+
+}
+
+#ifdef USE_IO_URING
+
+bool IoEngine::uringReadExtents(int groupId, uint32_t generation, const vector<size_t> &offsets,
+                                const vector<size_t> &lengths, const ExtentCallback &onExtent) {
+
+    static thread_local ThreadRing threadRing;
+
+    if (!threadRing.ready) {
+        return syncReadExtents(groupId, generation, offsets, lengths, onExtent);
+    }
+
+    FileManager *fileManager = FileManager::getInstance();
+    int fd = fileManager->openFile(groupId, generation);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct io_uring *ring = &threadRing.ring;
+
+    // 取消请求的完成事件用这个 user data，和 extent 的下标区分开
+    const uintptr_t cancelTag = UINTPTR_MAX;
+
+    // 每个 extent 读到哪块内存里，用的是哪个槽位（-1 表示单独 malloc 的），以及是否已经处理完
+    vector<uint8_t *> buffers(offsets.size(), nullptr);
+    vector<int> slots(offsets.size(), -1);
+    vector<bool> finished(offsets.size(), false);
+
+    size_t next = 0;
+    int inflight = 0;
+    int cancelling = 0;
+    bool success = true;
+    bool broken = false;
+
+    auto releaseBuffer = [&](int i) {
+        if (slots[i] >= 0) {
+            threadRing.freeSlots.push_back(slots[i]);
+            slots[i] = -1;
+        } else {
+            free(buffers[i]);
+        }
+        buffers[i] = nullptr;
+    };
+
+    // 处理一个完成事件；被取消的 extent 不算处理完，留给后面的 pread
+    auto complete = [&](struct io_uring_cqe *cqe) {
+
+        uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+
+        if (data == cancelTag) {
+            cancelling--;
+            return;
+        }
+
+        int i = (int) data;
+        inflight--;
+
+        if (res == -ECANCELED) {
+            releaseBuffer(i);
+            return;
+        }
+
+        if (res < 0) {
+            printf("io_uring read fail, group %d, offset %zu, res %d\n", groupId, offsets[i], res);
+            success = false;
+        } else if ((size_t) res < lengths[i]) {
+            // 短读，剩下的部分同步补齐
+            if (!fileManager->readAt(groupId, generation, buffers[i] + res, lengths[i] - res, offsets[i] + res)) {
+                success = false;
+            }
+        }
+
+        if (success) {
+            onExtent(i, buffers[i]);
+        }
+
+        finished[i] = true;
+        releaseBuffer(i);
+
+    };
+
+    while (next < offsets.size() || inflight > 0) {
+
+        // 队列没满就一直往里填，然后一次性提交
+        int queued = 0;
+        while (success && next < offsets.size() && inflight < IO_URING_QUEUE_DEPTH) {
+
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            if (sqe == nullptr) {
+                break;
+            }
+
+            if (lengths[next] <= IO_URING_SLOT_SIZE && !threadRing.freeSlots.empty()) {
+                int slot = threadRing.freeSlots.back();
+                threadRing.freeSlots.pop_back();
+                slots[next] = slot;
+                buffers[next] = threadRing.arena + slot * IO_URING_SLOT_SIZE;
+                if (threadRing.registered) {
+                    io_uring_prep_read_fixed(sqe, fd, buffers[next], lengths[next], offsets[next], slot);
+                } else {
+                    io_uring_prep_read(sqe, fd, buffers[next], lengths[next], offsets[next]);
+                }
+            } else {
+                buffers[next] = (uint8_t *) malloc(lengths[next]);
+                io_uring_prep_read(sqe, fd, buffers[next], lengths[next], offsets[next]);
+            }
+            io_uring_sqe_set_data(sqe, (void *) (uintptr_t) next);
+
+            next++;
+            inflight++;
+            queued++;
+
+        }
+
+        if (queued > 0) {
+            io_uring_submit(ring);
+        }
+
+        if (inflight == 0) {
+            break;
+        }
+
+        // 收割一个完成事件就解析一个，其余的 extent 继续在内核里读
+        struct io_uring_cqe *cqe = nullptr;
+        int ret = io_uring_wait_cqe(ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            printf("io_uring wait fail, group %d, ret %d\n", groupId, ret);
+            broken = true;
+            break;
+        }
+
+        complete(cqe);
+
+    }
+
+    if (broken) {
+
+        // 还在内核里的请求先取消掉再收割完，它们的 buffer 和槽位才能安全地放回去
+        for (size_t i = 0; i < next; ++i) {
+            if (finished[i] || buffers[i] == nullptr) {
+                continue;
+            }
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            if (sqe == nullptr) {
+                break;
+            }
+            io_uring_prep_cancel(sqe, (void *) (uintptr_t) i, 0);
+            io_uring_sqe_set_data(sqe, (void *) cancelTag);
+            cancelling++;
+        }
+        io_uring_submit(ring);
+
+        while (inflight > 0 || cancelling > 0) {
+            struct io_uring_cqe *cqe = nullptr;
+            int ret = io_uring_wait_cqe(ring, &cqe);
+            if (ret == -EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                break;
+            }
+            complete(cqe);
+        }
+
+        // 还是收不回来的话 ring 已经不可靠了：关掉 ring（内核会取消剩下的请求），这个线程之后都走同步 pread
+        if (inflight > 0 || cancelling > 0) {
+            io_uring_queue_exit(ring);
+            threadRing.ready = false;
+            for (size_t i = 0; i < next; ++i) {
+                if (buffers[i] != nullptr) {
+                    releaseBuffer(i);
+                }
+            }
+        }
+
+        // 没读到的 extent 用 pread 补上
+        if (success) {
+            vector<size_t> restOffsets, restLengths;
+            vector<int> restIndexes;
+            for (size_t i = 0; i < offsets.size(); ++i) {
+                if (!finished[i]) {
+                    restOffsets.push_back(offsets[i]);
+                    restLengths.push_back(lengths[i]);
+                    restIndexes.push_back(i);
+                }
+            }
+            success = syncReadExtents(groupId, generation, restOffsets, restLengths,
+                                      [&onExtent, &restIndexes](int i, const uint8_t *data) {
+                                          onExtent(restIndexes[i], data);
+                                      });
+        }
+
+    }
+
+    return success;
+
+}
+
+#endif
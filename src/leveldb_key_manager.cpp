@@ -3,47 +3,211 @@
 #include <iostream>
 #include <boost/bind.hpp>
 #include "constant.h"
+#include "value_cache.h"
+#include "util.h"
+#include <boost/filesystem.hpp>
 
 // LevelDBKeyManager* LevelDBKeyManager::instance = nullptr;
 // std::mutex LevelDBKeyManager::instance_mutex;
 
 LevelDBKeyManager::LevelDBKeyManager(const char *lsm_dir) {
-    lruList = new LruList<string, string *>(LEVELDB_LRU_CAPACITY);
-    specialKeys = {PIVOTS_KEY};
+    locationCache = new LocationCache((size_t) ConfigManager::getInstance().getLocationCacheSize() * 1024 * 1024);
     // init thread pool
     pool.size_controller().resize(POOL_THREADS_NUM);
     // init db
     leveldb::Options options;
     options.create_if_missing = true;
-    options.compression = leveldb::CompressionType::kNoCompression;
+    // lsm 里只有 key 和很短的 position，默认不压缩，key.useCompression 打开时用 leveldb 自带的 snappy
+    options.compression = ConfigManager::getInstance().dbNoCompress() ? leveldb::CompressionType::kNoCompression
+                                                                        : leveldb::CompressionType::kSnappyCompression;
     leveldb::Status status = leveldb::DB::Open(options, lsm_dir, &_lsm);
     // report error if fails to open leveldb
     if (!status.ok()) {
         fprintf(stderr, "Error on DB open %s\n", status.ToString().c_str());
         assert(status.ok());
     }
+    // migrate 和各个 init 都要跳过这些元数据 key，必须最先设好
+    specialKeys = {PIVOTS_KEY, POSITION_FORMAT_KEY, REBALANCE_KEY, GROUP_NUM_KEY, CHECKPOINT_KEY,
+                   INITIAL_SAMPLES_KEY, KEY_FORMAT_KEY};
+    // group 的个数只从 GROUP_NUM_KEY 和 PIVOTS_KEY 读，不用遍历 lsm，先确定下来才知道有哪些 group 统计的 key
+    initGroupNum();
+    // 冷文件的统计也按它的 groupId 存
+    for (int i = 0; i < 2 * ConfigManager::getInstance().getGroupNum(); ++i) {
+        specialKeys.insert(groupStatsKey(i));
+    }
+    migratePositionFormat();
+    initKeyFormat();
+}
+
+// key 的格式以 lsm 里记录的为准；没有记录时，lsm 里有 pivots 或者数据、或者 value 目录里有非空的文件（wal、initial group）
+// 的是之前的数据库，key 都补齐到了 KEY_LENGTH，继续按补齐的格式用；都没有的是新的数据库，key 按原来的长度存
+void LevelDBKeyManager::initKeyFormat() {
+
+    string format;
+    if (!_lsm->Get(leveldb::ReadOptions(), leveldb::Slice(KEY_FORMAT_KEY), &format).ok()) {
+
+        bool padded = _lsm->Get(leveldb::ReadOptions(), leveldb::Slice(PIVOTS_KEY), &format).ok();
+
+        leveldb::Iterator *it = _lsm->NewIterator(leveldb::ReadOptions());
+        for (it->SeekToFirst(); !padded && it->Valid(); it->Next()) {
+            padded = specialKeys.find(it->key().ToString()) == specialKeys.end();
+        }
+        delete it;
+
+        boost::filesystem::path valDir(ConfigManager::getInstance().getVALDir());
+        if (!padded && boost::filesystem::exists(valDir)) {
+            boost::filesystem::directory_iterator itEnd;
+            for (boost::filesystem::directory_iterator fileIt(valDir); !padded && fileIt != itEnd; ++fileIt) {
+                padded = boost::filesystem::is_regular_file(fileIt->path()) &&
+                         boost::filesystem::file_size(fileIt->path()) > 0;
+            }
+        }
+
+        format = padded ? KEY_FORMAT_PADDED : KEY_FORMAT_VARIABLE;
+        leveldb::WriteOptions wopt;
+        wopt.sync = true;
+        _lsm->Put(wopt, leveldb::Slice(KEY_FORMAT_KEY), leveldb::Slice(format));
+
+    }
+
+    if (format == KEY_FORMAT_PADDED) {
+        printf("keys are padded to %d bytes in this db\n", KEY_LENGTH);
+        ConfigManager::getInstance().setPaddedKeys(true);
+    }
+
+}
+
+// group 个数以 lsm 里记录的为准；有 pivots 却没有记录的是之前的数据库，group 个数由 pivots 推出来；都没有的是新的数据库，用配置的值
+void LevelDBKeyManager::initGroupNum() {
+
+    ConfigManager &configManager = ConfigManager::getInstance();
+
+    string value;
+    uint32_t groupNum = configManager.getGroupNum();
+    if (_lsm->Get(leveldb::ReadOptions(), leveldb::Slice(GROUP_NUM_KEY), &value).ok()) {
+        groupNum = stoul(value);
+    } else {
+        if (_lsm->Get(leveldb::ReadOptions(), leveldb::Slice(PIVOTS_KEY), &value).ok()) {
+            groupNum = split(value, "|").size() + 1;
+        }
+        leveldb::WriteOptions wopt;
+        wopt.sync = true;
+        _lsm->Put(wopt, leveldb::Slice(GROUP_NUM_KEY), leveldb::Slice(to_string(groupNum)));
+    }
+
+    if (groupNum != configManager.getGroupNum()) {
+        printf("db has %u groups, misc.groupNum = %u is ignored\n", groupNum, configManager.getGroupNum());
+        configManager.setGroupNum(groupNum);
+    }
+
+}
+
+string LevelDBKeyManager::groupStatsKey(int groupId) {
+    return GROUP_STATS_KEY_PREFIX + to_string(groupId);
+}
+
+void LevelDBKeyManager::loadGroupStats(ValueLog *valueLog) {
+    string stats;
+    for (int i = 0; i < 2 * ConfigManager::getInstance().getGroupNum(); ++i) {
+        if (_lsm->Get(leveldb::ReadOptions(), leveldb::Slice(groupStatsKey(i)), &stats).ok()) {
+            valueLog->setGroupStats(i, stats);
+        }
+    }
+}
+
+// 调用方持有 mutex
+void LevelDBKeyManager::putGroupStats(leveldb::WriteBatch &batch, const set<int> &groups) {
+    ValueLog *valueLog = ValueLog::getInstance();
+    for (int groupId: groups) {
+        if (groupId == INITIAL_GROUP_ID) {
+            continue;
+        }
+        batch.Put(leveldb::Slice(groupStatsKey(groupId)), leveldb::Slice(valueLog->getGroupStats(groupId)));
+    }
+}
+
+// 把旧的 "group,offset,length" 文本 position 全部改写为二进制格式，只会在第一次打开旧数据时真正执行
+void LevelDBKeyManager::migratePositionFormat() {
+
+    string format;
+    if (_lsm->Get(leveldb::ReadOptions(), leveldb::Slice(POSITION_FORMAT_KEY), &format).ok()) {
+        return;
+    }
+
+    leveldb::WriteOptions wopt;
+    wopt.sync = false;
+
+    leveldb::Iterator *it = _lsm->NewIterator(leveldb::ReadOptions());
+
+    leveldb::WriteBatch batch;
+    size_t batchCount = 0;
+    size_t migrated = 0;
+    ValueLayout valueLayout;
+
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        string key = it->key().ToString();
+        if (specialKeys.find(key) != specialKeys.end()) {
+            continue;
+        }
+        if (!ValueLayout::isLegacyPosition(it->value().data(), it->value().size())) {
+            continue;
+        }
+        // 解析不了的 position 原样留着，不能把上一条的 position 写进去
+        if (!valueLayout.deserializePosition(it->value().data(), it->value().size())) {
+            printf("invalid position of key %s, skip migrating it\n", key.c_str());
+            continue;
+        }
+        batch.Put(leveldb::Slice(key), leveldb::Slice(valueLayout.serializePosition()));
+        migrated++;
+        // 分批写，避免一个 WriteBatch 过大
+        if (++batchCount == POSITION_MIGRATE_BATCH_SIZE) {
+            _lsm->Write(wopt, &batch);
+            batch.Clear();
+            batchCount = 0;
+        }
+    }
+
+    delete it;
+
+    batch.Put(leveldb::Slice(POSITION_FORMAT_KEY), leveldb::Slice(string(1, POSITION_FORMAT_VERSION)));
+    _lsm->Write(wopt, &batch);
+
+    if (migrated > 0) {
+        printf("migrate %lu positions to binary format\n", migrated);
+    }
+
 }
 
 LevelDBKeyManager::~LevelDBKeyManager() {
-    delete lruList;
+    delete locationCache;
     delete _lsm;
 //    printf("destructor LevelDBKeyManager\n");
 }
 
 bool LevelDBKeyManager::put(ValueLayout &valueLayout) {
 
-    auto *positionInfo = new string(valueLayout.serializePosition());
-
     leveldb::WriteOptions wopt;
     wopt.sync = false;
 
     lock_guard<recursive_mutex> lockGuard(mutex);
 
+    leveldb::WriteBatch batch;
+
+    PositionInfo old = get(valueLayout.getValueInfo().key).getPositionInfo();
+    if (old.valid) {
+        ValueLog::getInstance()->addDeadBytes(old.groupId, old.generation, old.length);
+        putGroupStats(batch, {old.groupId});
+    }
+
 //    printf("put position: %s\n", valueLayout.serializePosition().c_str());
 
-    lruList->put(valueLayout.getValueInfo().key, positionInfo);
+    batch.Put(leveldb::Slice(valueLayout.getValueInfo().key), leveldb::Slice(valueLayout.serializePosition()));
 
-    bool ret = _lsm->Put(wopt, leveldb::Slice(valueLayout.getValueInfo().key), leveldb::Slice(*positionInfo)).ok();
+    bool ret = _lsm->Write(wopt, &batch).ok();
+
+    // 先写 lsm 再更新缓存，这样并发未命中的 get 不会把旧的 position / value 填回缓存
+    locationCache->put(valueLayout.getValueInfo().key, valueLayout.getPositionInfo());
+    ValueCache::getInstance()->update(valueLayout.getValueInfo().key, valueLayout.getValueInfo().value);
 
     return ret;
 
@@ -66,41 +230,141 @@ bool LevelDBKeyManager::batchPut(vector<ValueLayout> &valueLayouts) {
 
     lock_guard<recursive_mutex> lockGuard(mutex);
 
+    // flush 覆盖掉的旧 value 变成了垃圾，记到旧 position 所在的 group 上，后台 gc 据此挑选 group
+    // 统计和 position 在同一个 WriteBatch 里写下去，崩溃后两者也是一致的
+    ValueLog *valueLog = ValueLog::getInstance();
+    set<int> groups;
     for (auto &valueLayout: valueLayouts) {
-        auto *positionInfo = new string(valueLayout.serializePosition());
-        lruList->put(valueLayout.getValueInfo().key, positionInfo);
+        PositionInfo old = get(valueLayout.getValueInfo().key).getPositionInfo();
+        if (old.valid) {
+            valueLog->addDeadBytes(old.groupId, old.generation, old.length);
+            groups.insert(old.groupId);
+        }
     }
+    putGroupStats(batch, groups);
 
     bool ret = _lsm->Write(wopt, &batch).ok();
 
+    // 先写 lsm 再更新缓存，这样并发未命中的 get 不会把旧的 position / value 填回缓存
+    // flush（Group::batchPut）写完文件后经过这里发布新的 position，value 缓存也在这里刷新
+    ValueCache *valueCache = ValueCache::getInstance();
+    for (auto &valueLayout: valueLayouts) {
+        locationCache->put(valueLayout.getValueInfo().key, valueLayout.getPositionInfo());
+        valueCache->update(valueLayout.getValueInfo().key, valueLayout.getValueInfo().value);
+    }
+
     return ret;
 
 }
 
-ValueLayout LevelDBKeyManager::get(const string &key, bool needLock) {
+// gc 搬运期间 flush、删除都在继续，只有 position 还是 oldPositions[i] 的 key 才改成新的位置；
+// 已经被覆盖或删除的 key 搬过去的那一份直接算作新一代里的垃圾
+bool LevelDBKeyManager::gcBatchPut(vector<PositionInfo> &oldPositions, vector<ValueLayout> &valueLayouts,
+                                   bool oldBecomesDead) {
 
-    unique_lock<recursive_mutex> uniqueLock(mutex, defer_lock);
-    if (needLock) {
-        uniqueLock.lock();
+    if (valueLayouts.empty())
+        return true;
+
+    leveldb::WriteOptions wopt;
+    wopt.sync = false;
+
+    lock_guard<recursive_mutex> lockGuard(mutex);
+
+    ValueLog *valueLog = ValueLog::getInstance();
+    leveldb::WriteBatch batch;
+    vector<bool> moved(valueLayouts.size(), false);
+    set<int> groups;
+
+    for (int i = 0; i < valueLayouts.size(); ++i) {
+        const string &key = valueLayouts[i].getValueInfo().key;
+        const PositionInfo &old = oldPositions[i];
+        PositionInfo current = get(key).getPositionInfo();
+        if (current.valid && current.groupId == old.groupId && current.generation == old.generation &&
+            current.offset == old.offset && current.length == old.length &&
+            current.inBlockOffset == old.inBlockOffset) {
+            batch.Put(leveldb::Slice(key), leveldb::Slice(valueLayouts[i].serializePosition()));
+            moved[i] = true;
+            if (oldBecomesDead) {
+                valueLog->addDeadBytes(old.groupId, old.generation, old.length);
+                groups.insert(old.groupId);
+            }
+        } else {
+            const PositionInfo &copy = valueLayouts[i].getPositionInfo();
+            valueLog->addDeadBytes(copy.groupId, copy.generation, copy.length);
+            groups.insert(copy.groupId);
+        }
     }
+    putGroupStats(batch, groups);
 
-    string *ptr = lruList->get(key);
-    string positionStr;
-    ValueLayout valueLayout;
+    bool ret = _lsm->Write(wopt, &batch).ok();
 
-    if (ptr != nullptr) {
-        positionStr = *ptr;
-//        printf("positionStr = %s, from lru\n", positionStr.c_str());
-        valueLayout.deserializePosition(positionStr);
-    } else {
-        leveldb::Status status = _lsm->Get(leveldb::ReadOptions(), leveldb::Slice(key), &positionStr);
-        if (status.ok()) {
-//            printf("positionStr = %s\n", positionStr.c_str());
-            valueLayout.deserializePosition(positionStr);
-            lruList->put(key, new string(positionStr));
+    // value 没有变，只需要更新 position 缓存
+    for (int i = 0; i < valueLayouts.size(); ++i) {
+        if (moved[i]) {
+            locationCache->put(valueLayouts[i].getValueInfo().key, valueLayouts[i].getPositionInfo());
         }
     }
 
+    return ret;
+
+}
+
+bool LevelDBKeyManager::gcBatchDelete(vector<string> &keys, vector<PositionInfo> &oldPositions) {
+
+    if (keys.empty())
+        return true;
+
+    leveldb::WriteOptions wopt;
+    wopt.sync = false;
+
+    lock_guard<recursive_mutex> lockGuard(mutex);
+
+    ValueLog *valueLog = ValueLog::getInstance();
+    leveldb::WriteBatch batch;
+    set<int> groups;
+
+    for (int i = 0; i < keys.size(); ++i) {
+        const PositionInfo &old = oldPositions[i];
+        PositionInfo current = get(keys[i]).getPositionInfo();
+        if (current.valid && current.groupId == old.groupId && current.generation == old.generation &&
+            current.offset == old.offset && current.length == old.length &&
+            current.inBlockOffset == old.inBlockOffset) {
+            batch.Delete(leveldb::Slice(keys[i]));
+            valueLog->addDeadBytes(old.groupId, old.generation, old.length);
+            groups.insert(old.groupId);
+        }
+    }
+    putGroupStats(batch, groups);
+
+    bool ret = _lsm->Write(wopt, &batch).ok();
+
+    for (auto &key: keys) {
+        locationCache->erase(key);
+        ValueCache::getInstance()->erase(key);
+    }
+
+    return ret;
+
+}
+
+ValueLayout LevelDBKeyManager::get(const string &key) {
+
+    ValueLayout valueLayout;
+    PositionInfo positionInfo;
+    uint64_t generation;
+
+    if (locationCache->get(key, positionInfo, generation)) {
+        valueLayout.setPositionInfo(positionInfo);
+        return valueLayout;
+    }
+
+    string positionStr;
+    leveldb::Status status = _lsm->Get(leveldb::ReadOptions(), leveldb::Slice(key), &positionStr);
+    if (status.ok() && valueLayout.deserializePosition(positionStr)) {
+//        printf("positionStr = %s\n", positionStr.c_str());
+        locationCache->fill(key, valueLayout.getPositionInfo(), generation);
+    }
+
     return valueLayout;
 
 }
@@ -126,7 +390,7 @@ void LevelDBKeyManager::getKeys(string &startingKey, int num, vector<string> &ke
         }
         keys.push_back(key);
         // valueLocation
-        valueLocation.deserializePosition(it->value().ToString());
+        valueLocation.deserializePosition(it->value().data(), it->value().size());
         valueLocations.push_back(valueLocation);
     }
 
@@ -160,7 +424,7 @@ void LevelDBKeyManager::getKeys(const string &startingKey, const string &endingK
             }
             keys.push_back(key);
             // valueLocation
-            valueLocation.deserializePosition(it->value().ToString());
+            valueLocation.deserializePosition(it->value().data(), it->value().size());
             valueLocations.push_back(valueLocation);
             // prev
             it->Prev();
@@ -201,7 +465,7 @@ void LevelDBKeyManager::getKeys(const string &startingKey, const string &endingK
         keys.push_back(key);
 
         // valueLocation
-        valueLocation.deserializePosition(it->value().ToString());
+        valueLocation.deserializePosition(it->value().data(), it->value().size());
         valueLocations.push_back(valueLocation);
 
         it->Next();
@@ -212,6 +476,58 @@ void LevelDBKeyManager::getKeys(const string &startingKey, const string &endingK
 
 }
 
+const leveldb::Snapshot *LevelDBKeyManager::getSnapshot() {
+    return _lsm->GetSnapshot();
+}
+
+void LevelDBKeyManager::releaseSnapshot(const leveldb::Snapshot *snapshot) {
+    _lsm->ReleaseSnapshot(snapshot);
+}
+
+void LevelDBKeyManager::getKeys(const leveldb::Snapshot *snapshot, const string &startingKey, bool includeStart,
+                                const string &endingKey, int num, vector<string> &keys,
+                                vector<ValueLayout> &valueLocations) {
+
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot;
+
+    leveldb::Iterator *it = _lsm->NewIterator(options);
+
+    if (startingKey == INF_LOWER_BOUND) {
+        it->SeekToFirst();
+    } else {
+        it->Seek(leveldb::Slice(startingKey));
+        if (!includeStart && it->Valid() && it->key().ToString() == startingKey) {
+            it->Next();
+        }
+    }
+
+    string key;
+    ValueLayout valueLocation;
+
+    for (int i = 0; i < num && it->Valid(); it->Next()) {
+
+        key = it->key().ToString();
+
+        if (specialKeys.find(key) != specialKeys.end()) {
+            continue;
+        }
+
+        if (endingKey != INF_UPPER_BOUND && key > endingKey) {
+            break;
+        }
+
+        keys.push_back(key);
+        valueLocation.deserializePosition(it->value().data(), it->value().size());
+        valueLocations.push_back(valueLocation);
+        i++;
+
+    }
+
+    delete it;
+
+}
+
 bool LevelDBKeyManager::deleteKey(const string &key) {
 
     leveldb::WriteOptions wopt;
@@ -219,16 +535,29 @@ bool LevelDBKeyManager::deleteKey(const string &key) {
 
     lock_guard<recursive_mutex> lockGuard(mutex);
 
-    lruList->del(key);
+    leveldb::WriteBatch batch;
 
-    return _lsm->Delete(wopt, leveldb::Slice(key)).ok();
+    PositionInfo old = get(key).getPositionInfo();
+    if (old.valid) {
+        ValueLog::getInstance()->addDeadBytes(old.groupId, old.generation, old.length);
+        putGroupStats(batch, {old.groupId});
+    }
+
+    batch.Delete(leveldb::Slice(key));
+
+    bool ret = _lsm->Write(wopt, &batch).ok();
+
+    locationCache->erase(key);
+    ValueCache::getInstance()->erase(key);
+
+    return ret;
 
 }
 
-bool LevelDBKeyManager::writeMeta(const string &key, const string &value) {
+bool LevelDBKeyManager::writeMeta(const string &key, const string &value, bool sync) {
 
     leveldb::WriteOptions wopt;
-    wopt.sync = false;
+    wopt.sync = sync;
 
     lock_guard<recursive_mutex> lockGuard(mutex);
 
@@ -238,6 +567,47 @@ bool LevelDBKeyManager::writeMeta(const string &key, const string &value) {
 
 }
 
+bool LevelDBKeyManager::sync() {
+
+    leveldb::WriteOptions wopt;
+    wopt.sync = true;
+
+    lock_guard<recursive_mutex> lockGuard(mutex);
+
+    leveldb::WriteBatch batch;
+
+    return _lsm->Write(wopt, &batch).ok();
+
+}
+
+bool LevelDBKeyManager::commitPivots(const string &pivotsInfo) {
+
+    leveldb::WriteOptions wopt;
+    wopt.sync = true;
+
+    lock_guard<recursive_mutex> lockGuard(mutex);
+
+    leveldb::WriteBatch batch;
+    batch.Put(leveldb::Slice(PIVOTS_KEY), leveldb::Slice(pivotsInfo));
+    batch.Delete(leveldb::Slice(REBALANCE_KEY));
+
+    return _lsm->Write(wopt, &batch).ok();
+
+}
+
+// gc 在删除旧的各代文件之前调用，同步写会把之前搬运时写的 position 一起落盘
+bool LevelDBKeyManager::writeGroupStats(int groupId) {
+
+    leveldb::WriteOptions wopt;
+    wopt.sync = true;
+
+    lock_guard<recursive_mutex> lockGuard(mutex);
+
+    return _lsm->Put(wopt, leveldb::Slice(groupStatsKey(groupId)),
+                     leveldb::Slice(ValueLog::getInstance()->getGroupStats(groupId))).ok();
+
+}
+
 bool LevelDBKeyManager::getMeta(const string &key, string &value) {
 
     lock_guard<recursive_mutex> lockGuard(mutex);
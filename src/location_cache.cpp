@@ -0,0 +1,127 @@
+#include "location_cache.h"
+
+// 每个 entry 大致占用的内存：entry 本身加上 unordered_map 的节点（key、下标、next 指针、hash）和桶
+// 超过 string 内部缓冲区的长 key 还要再分配两份，没有算进来
+static const size_t LOCATION_CACHE_ENTRY_BYTES = 2 * sizeof(string) + 48 + sizeof(PositionInfo);
+
+LocationCache::LocationCache(size_t capacityBytes) {
+    size_t shardCapacity = capacityBytes / LOCATION_CACHE_ENTRY_BYTES / LOCATION_CACHE_SHARD_NUM;
+    if (shardCapacity == 0) {
+        shardCapacity = 1;
+    }
+    for (int i = 0; i < LOCATION_CACHE_SHARD_NUM; ++i) {
+        auto *shard = new Shard();
+        shard->capacity = shardCapacity;
+        shard->index.reserve(shardCapacity);
+        shards.push_back(shard);
+    }
+}
+
+LocationCache::~LocationCache() {
+    for (auto &shard: shards) {
+        delete shard;
+    }
+}
+
+LocationCache::Shard *LocationCache::getShard(const string &key) {
+    // unordered_map 用的是 hash 的低位，这里用高位选 shard，免得 shard 内的桶分布不均
+    size_t h = hash<string>()(key);
+    return shards[(h >> 32) % LOCATION_CACHE_SHARD_NUM];
+}
+
+void LocationCache::insert(Shard *shard, const string &key, const PositionInfo &position) {
+
+    auto it = shard->index.find(key);
+    if (it != shard->index.end()) {
+        Entry &entry = shard->entries[it->second];
+        entry.position = position;
+        entry.referenced = true;
+        return;
+    }
+
+    if (shard->entries.size() < shard->capacity) {
+        shard->index[key] = shard->entries.size();
+        shard->entries.push_back({key, position, false});
+        return;
+    }
+
+    // CLOCK：跳过最近被访问过的 entry，淘汰第一个访问位为 0 的
+    while (shard->entries[shard->hand].referenced) {
+        shard->entries[shard->hand].referenced = false;
+        shard->hand = (shard->hand + 1) % shard->entries.size();
+    }
+
+    Entry &victim = shard->entries[shard->hand];
+    shard->index.erase(victim.key);
+    victim = {key, position, false};
+    shard->index[key] = shard->hand;
+    shard->hand = (shard->hand + 1) % shard->entries.size();
+
+}
+
+bool LocationCache::get(const string &key, PositionInfo &position, uint64_t &generation) {
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    auto it = shard->index.find(key);
+    if (it == shard->index.end()) {
+        generation = shard->generation;
+        return false;
+    }
+
+    Entry &entry = shard->entries[it->second];
+    entry.referenced = true;
+    position = entry.position;
+    return true;
+
+}
+
+void LocationCache::fill(const string &key, const PositionInfo &position, uint64_t generation) {
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    if (shard->generation != generation) {
+        return;
+    }
+
+    insert(shard, key, position);
+
+}
+
+void LocationCache::put(const string &key, const PositionInfo &position) {
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    shard->generation++;
+    insert(shard, key, position);
+
+}
+
+void LocationCache::erase(const string &key) {
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    shard->generation++;
+
+    auto it = shard->index.find(key);
+    if (it == shard->index.end()) {
+        return;
+    }
+
+    // 用最后一个 entry 填上被删掉的位置
+    size_t idx = it->second;
+    shard->index.erase(it);
+    if (idx != shard->entries.size() - 1) {
+        shard->entries[idx] = shard->entries.back();
+        shard->index[shard->entries[idx].key] = idx;
+    }
+    shard->entries.pop_back();
+    if (shard->hand >= shard->entries.size()) {
+        shard->hand = 0;
+    }
+
+}
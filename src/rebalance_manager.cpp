@@ -0,0 +1,377 @@
+#include "rebalance_manager.h"
+#include "buffer_manager.h"
+#include "gc_manager.h"
+#include "file_manager.h"
+#include "value_log.h"
+#include "leveldb_key_manager.h"
+#include "util.h"
+#include "configManager.h"
+#include "constant.h"
+#include <chrono>
+#include <algorithm>
+
+RebalanceManager::RebalanceManager() {
+    groupNum = (int) ConfigManager::getInstance().getGroupNum();
+    writeRates.resize(groupNum);
+}
+
+void RebalanceManager::sample(const vector<size_t> &written) {
+
+    int64_t now = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+
+    if (lastSampleTime >= 0 && now > lastSampleTime) {
+        double seconds = (double) (now - lastSampleTime) / 1000;
+        for (int i = 0; i < groupNum; ++i) {
+            double rate = (double) (written[i] - lastWrittenBytes[i]) / seconds;
+            writeRates[i] = writeRates[i] / 2 + rate / 2;
+        }
+    }
+
+    lastWrittenBytes = written;
+    lastSampleTime = now;
+
+}
+
+bool RebalanceManager::rebalance() {
+
+    if (!BufferManager::getInstance()->pivotsGenerated()) {
+        return false;
+    }
+
+    vector<size_t> live, written;
+    ValueLog::getInstance()->getGroupUsage(live, written);
+
+    int groupId = -1;
+    int neighbour = -1;
+    double fraction = 0;
+    {
+        lock_guard<mutex> lockGuard(m);
+
+        sample(written);
+
+        // 负载 = live 字节数 + 最近 REBALANCE_HOT_WINDOW 秒按当前速度会写入的字节数
+        vector<double> loads(groupNum);
+        double total = 0;
+        for (int i = 0; i < groupNum; ++i) {
+            loads[i] = (double) live[i] + writeRates[i] * REBALANCE_HOT_WINDOW;
+            total += loads[i];
+        }
+
+        // 从负载最高的开始找，邻居都很重的 group 先跳过，等它的邻居把负载往外挪了再说，否则每次只能挪很小的一段
+        vector<int> order(groupNum);
+        for (int i = 0; i < groupNum; ++i) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&loads](int a, int b) { return loads[a] > loads[b]; });
+
+        for (int g: order) {
+            if (loads[g] < REBALANCE_SPLIT_FACTOR * total / groupNum) {
+                break;
+            }
+            if (live[g] < REBALANCE_MIN_GROUP_SIZE) {
+                continue;
+            }
+            // 挪给负载较小的邻居，挪完两边的负载差不多持平
+            int n;
+            if (g == 0) {
+                n = 1;
+            } else if (g == groupNum - 1) {
+                n = groupNum - 2;
+            } else {
+                n = loads[g - 1] <= loads[g + 1] ? g - 1 : g + 1;
+            }
+            if (loads[g] >= REBALANCE_SPLIT_FACTOR * loads[n]) {
+                groupId = g;
+                neighbour = n;
+                break;
+            }
+        }
+
+        if (groupId < 0) {
+            return false;
+        }
+
+        fraction = (loads[groupId] - loads[neighbour]) / 2 / loads[groupId];
+    }
+
+    string pivot;
+    if (!findPivot(groupId, neighbour > groupId, fraction, pivot)) {
+        return false;
+    }
+
+    if (!moveBoundary(min(groupId, neighbour), pivot)) {
+        return false;
+    }
+
+    // 写入速度跟着 key range 一起挪过去，否则下一轮还会认为这个 group 很热
+    lock_guard<mutex> lockGuard(m);
+    writeRates[neighbour] += writeRates[groupId] * fraction;
+    writeRates[groupId] *= 1 - fraction;
+
+    return true;
+
+}
+
+bool RebalanceManager::findPivot(int groupId, bool upper, double fraction, string &pivot) {
+
+    LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+    vector<string> bound = BufferManager::getInstance()->getGroupBound(groupId);
+
+    // 只看 position，不读 value，扫两遍：第一遍算总字节数，第二遍找到累计字节数达到目标的 key
+    const leveldb::Snapshot *snapshot = levelDbKeyManager->getSnapshot();
+
+    size_t totalBytes = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+
+        size_t target = upper ? (size_t) (totalBytes * (1 - fraction)) : (size_t) (totalBytes * fraction);
+        size_t accumulated = 0;
+        string fromKey = bound[0];
+
+        while (true) {
+
+            vector<string> keys;
+            vector<ValueLayout> layouts;
+            levelDbKeyManager->getKeys(snapshot, fromKey, false, bound[1], GC_SCAN_KEY_NUM, keys, layouts);
+            if (keys.empty()) {
+                break;
+            }
+            fromKey = keys.back();
+
+            for (int i = 0; i < keys.size(); ++i) {
+                accumulated += layouts[i].getPositionInfo().length;
+                if (pass == 1 && pivot.empty() && accumulated >= target) {
+                    pivot = keys[i];
+                }
+            }
+
+        }
+
+        totalBytes = accumulated;
+
+        // 第二遍结束时 fromKey 是 group 里最大的 key，pivot 取到它的话有一边是空的
+        if (pass == 1 && pivot == fromKey) {
+            pivot.clear();
+        }
+
+    }
+
+    levelDbKeyManager->releaseSnapshot(snapshot);
+
+    return !pivot.empty();
+
+}
+
+// 调用方持有两个 group 的 gc 锁，gc 不会在这期间删掉 layouts 指向的旧文件，也不会切换 to 的当前代
+bool RebalanceManager::moveKeys(int from, int to, const vector<string> &keys, const vector<ValueLayout> &layouts,
+                                size_t &movedSize) {
+
+    LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+    ValueLog *valueLog = ValueLog::getInstance();
+    FileManager *fileManager = FileManager::getInstance();
+
+    bool success = true;
+
+    // 热文件里的挪到 to 的热文件，冷文件里的挪到 to 的冷文件
+    for (int source: {from, fileManager->getColdGroupId(from)}) {
+
+        int target = source == from ? to : fileManager->getColdGroupId(to);
+        size_t targetSize = 0;
+
+        size_t begin = 0;
+        while (begin < keys.size()) {
+
+            vector<string> chunkKeys;
+            vector<ValueLayout> chunkLayouts;
+            size_t chunkSize = 0;
+            while (begin < keys.size() &&
+                   (chunkLayouts.empty() || chunkSize + layouts[begin].getPositionInfo().length <= GC_CHUNK_SIZE)) {
+                // 已经挪过去的（上一轮搬过的、重启前没做完的 rebalance 搬过的）不用再挪
+                if (layouts[begin].getPositionInfo().groupId == source) {
+                    chunkSize += layouts[begin].getPositionInfo().length;
+                    chunkKeys.push_back(keys[begin]);
+                    chunkLayouts.push_back(layouts[begin]);
+                }
+                begin++;
+            }
+            if (chunkLayouts.empty()) {
+                continue;
+            }
+
+            vector<PositionInfo> oldPositions;
+            for (auto &layout: chunkLayouts) {
+                oldPositions.push_back(layout.getPositionInfo());
+            }
+
+            fileManager->operateFileSharedMutex(source, LOCK);
+            bool read = valueLog->assignValueInfo(chunkKeys, chunkLayouts, true);
+            fileManager->operateFileSharedMutex(source, UNLOCK);
+            if (!read) {
+                success = false;
+                continue;
+            }
+            vector<string> droppedKeys;
+            vector<PositionInfo> droppedPositions;
+            valueLog->dropCorrupted(chunkKeys, chunkLayouts, oldPositions, droppedKeys, droppedPositions);
+            // 坏掉的 value 搬不走，key 留在 lsm 里既读不出来，又落在了别的 group 的范围里
+            levelDbKeyManager->gcBatchDelete(droppedKeys, droppedPositions);
+            if (chunkLayouts.empty()) {
+                continue;
+            }
+
+            targetSize += valueLog->groupRewrite(chunkLayouts, target);
+
+            // 和 gc 一样按 position 是否变过有条件地更新，搬的过程中又被写入的 key 以新写入的为准
+            // 旧的 value 还留在 source 的文件里，记为 source 的垃圾，下次 gc 时回收
+            levelDbKeyManager->gcBatchPut(oldPositions, chunkLayouts, true);
+
+        }
+
+        // 放掉 gc 锁之后 source 的 gc 就可能删掉旧的 value，在那之前先把挪过去的落盘
+        if (targetSize > 0) {
+            fileManager->syncFile(target);
+        }
+        movedSize += targetSize;
+
+    }
+
+    return success;
+
+}
+
+bool RebalanceManager::moveBoundary(int boundary, const string &pivot) {
+
+    BufferManager *bufferManager = BufferManager::getInstance();
+    GcManager *gcManager = GcManager::getInstance();
+    LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
+
+    int left = boundary;
+    int right = boundary + 1;
+
+    // 同一时间只挪一个 pivot，挪的过程中这两个 group 的 pivot 只会被自己改
+    lock_guard<mutex> moveLock(moveMutex);
+
+    // 加锁顺序：两个 group 的 gc 锁 -> 两个 group 的 buffer（按 group 的顺序）-> 文件 -> lsm，和 gc 一致
+    string lowerBound, oldPivot, upperBound;
+    {
+        lock_guard<mutex> leftGcLock(gcManager->getGroupGcMutex(left));
+        lock_guard<mutex> rightGcLock(gcManager->getGroupGcMutex(right));
+        unique_lock<mutex> leftLock = bufferManager->lockGroup(left, false);
+        unique_lock<mutex> rightLock = bufferManager->lockGroup(right, false);
+        lowerBound = bufferManager->getGroupBound(left)[0];
+        oldPivot = bufferManager->getGroupBound(left)[1];
+        upperBound = bufferManager->getGroupBound(right)[1];
+    }
+
+    if ((lowerBound != INF_LOWER_BOUND && pivot <= lowerBound) ||
+        (upperBound != INF_UPPER_BOUND && pivot >= upperBound)) {
+        printf("invalid pivot for boundary %d\n", boundary);
+        return false;
+    }
+
+    if (pivot == oldPivot) {
+        return true;
+    }
+
+    // 先记下要做的事，中途 crash 的话重启后重新做一遍
+    levelDbKeyManager->writeMeta(REBALANCE_KEY, to_string(boundary) + "|" + pivot, true);
+    {
+        lock_guard<mutex> lockGuard(m);
+        unfinishedBoundaries.insert(boundary);
+    }
+
+    // pivot 往左挪时 (pivot, oldPivot] 从 left 挪到 right，往右挪时 (oldPivot, pivot] 从 right 挪到 left
+    bool leftward = pivot < oldPivot;
+    int from = leftward ? left : right;
+    int to = leftward ? right : left;
+    string fromKey = leftward ? pivot : oldPivot;
+    string toKey = leftward ? oldPivot : pivot;
+
+    size_t movedSize = 0;
+
+    // 1. 不持有 buffer 锁，按 key 的顺序一批一批地把这段 key range 在 from 里的 value 搬到 to，前台读写照常进行
+    //    每批只持有两个 group 的 gc 锁，position 在锁内从 lsm 里现取，搬完之后又 flush 到 from 里的留给第 2 步
+    string scanKey = fromKey;
+    while (true) {
+
+        lock_guard<mutex> leftGcLock(gcManager->getGroupGcMutex(left));
+        lock_guard<mutex> rightGcLock(gcManager->getGroupGcMutex(right));
+
+        vector<string> keys;
+        vector<ValueLayout> layouts;
+        levelDbKeyManager->getKeys(nullptr, scanKey, false, toKey, GC_SCAN_KEY_NUM, keys, layouts);
+        if (keys.empty()) {
+            break;
+        }
+        scanKey = keys.back();
+
+        // 读失败的 key 还在 from 里，不换 pivot；REBALANCE_KEY 留着，boundary 一直算没挪完，gc 不会删两边的旧文件
+        if (!moveKeys(from, to, keys, layouts, movedSize)) {
+            printf("rebalance: read group %d fail, boundary %d not moved\n", from, boundary);
+            return false;
+        }
+
+    }
+
+    // 2. 锁住两个 group 的 buffer（等正在进行的 flush 结束），补搬第 1 步之后 flush 到 from 里的，然后换 pivot
+    //    buffer 锁一直持有到新的 pivots 生效，buffer 里的由 setPivot 挪过去
+    lock_guard<mutex> leftGcLock(gcManager->getGroupGcMutex(left));
+    lock_guard<mutex> rightGcLock(gcManager->getGroupGcMutex(right));
+    unique_lock<mutex> leftLock = bufferManager->lockGroup(left);
+    unique_lock<mutex> rightLock = bufferManager->lockGroup(right);
+
+    scanKey = fromKey;
+    while (true) {
+
+        vector<string> keys;
+        vector<ValueLayout> layouts;
+        levelDbKeyManager->getKeys(nullptr, scanKey, false, toKey, GC_SCAN_KEY_NUM, keys, layouts);
+        if (keys.empty()) {
+            break;
+        }
+        scanKey = keys.back();
+
+        if (!moveKeys(from, to, keys, layouts, movedSize)) {
+            printf("rebalance: read group %d fail, boundary %d not moved\n", from, boundary);
+            return false;
+        }
+
+    }
+
+    // 新的 pivots 在内存里生效和持久化都在 buffer 锁内完成
+    string pivotsInfo = bufferManager->setPivot(boundary, pivot);
+    levelDbKeyManager->commitPivots(pivotsInfo);
+    {
+        lock_guard<mutex> lockGuard(m);
+        unfinishedBoundaries.erase(boundary);
+    }
+
+    printf("rebalance: boundary %d moved, group %d -> group %d, %zu bytes\n", boundary, from, to, movedSize);
+
+    return true;
+
+}
+
+bool RebalanceManager::isMoving(int groupId) {
+    lock_guard<mutex> lockGuard(m);
+    return unfinishedBoundaries.count(groupId - 1) > 0 || unfinishedBoundaries.count(groupId) > 0;
+}
+
+void RebalanceManager::recover() {
+
+    string info;
+    if (!LevelDBKeyManager::getInstance()->getMeta(REBALANCE_KEY, info)) {
+        return;
+    }
+
+    // 只在第一个 "|" 处切开，后面整个都是 pivot
+    size_t pos = info.find('|');
+    if (pos == string::npos || pos == 0) {
+        printf("invalid rebalance record %s\n", info.c_str());
+        return;
+    }
+
+    printf("redo rebalance of boundary %s\n", info.substr(0, pos).c_str());
+    moveBoundary(stoi(info.substr(0, pos)), info.substr(pos + 1));
+
+}
@@ -8,6 +8,11 @@
 #include "gc_manager.h"
 #include "thread_pool_manager.h"
 #include "statistics_manager.h"
+#include "value_cache.h"
+#include "block_cache.h"
+#include "rebalance_manager.h"
+#include "hotness_sketch.h"
+#include "write_ahead_log.h"
 
 dfdb::Server * dfdb::Server::_instance = nullptr;
 std::mutex dfdb::Server::_instance_mutex;
@@ -15,40 +20,55 @@ std::mutex dfdb::Server::_instance_mutex;
 namespace dfdb{
 bool Server::put(const string &key, const string &value) {
 
-    string _key = validateKey(key);
-    if (_key == INVALID_KEY) {
+    if (!validateKey(key)) {
+        return false;
+    }
+    string padded;
+    const string &_key = storedKey(key, padded);
+
+    // valueSize 和记录格式的版本共用记录头部的 4B
+    if (value.size() > MAX_VALUE_SIZE) {
+        printf("max value size is %u, your value size is %zu\n", MAX_VALUE_SIZE, value.size());
         return false;
     }
 
 //    lruList->put(_key, new string(value));
 
+    // 记下更新的频率，gc 时据此决定 value 留在热文件里还是降级到冷文件
+    if (ConfigManager::getInstance().getHotnessLevel() > 1) {
+        HotnessSketch::getInstance()->record(_key);
+    }
+
     BufferManager *bufferManager = BufferManager::getInstance();
+    WriteAheadLog *wal = WriteAheadLog::getInstance();
 
-    // 先给 buffer 上锁
-    bufferManager->mutex.lock();
+    // 先放到 buffer 里，同时在 buffer 锁内记 wal，出了锁再等 wal 写下去
+    uint64_t lsn;
+    int flushGroupId = bufferManager->put(_key, value, lsn);
+    wal->commit(lsn);
 
-    // 先放到 buffer 里
-    int flushGroupId = bufferManager->put(_key, value);
+    // wal 的段太多了，把还占着最老的段的 group 落盘
+    uint64_t bound;
+    if (wal->takeFlushRequest(bound)) {
+        bufferManager->flushBefore(bound);
+    }
 
     if (flushGroupId == -1) {
-        bufferManager->mutex.unlock();
         return true;
     }
 
-    bool ret = bufferManager->flush(flushGroupId);
-
-    bufferManager->mutex.unlock();
-
-    return ret;
+    // buffer 满了就交给后台落盘，这里不能持有 buffer 的锁，否则等待上一次 flush 时会死锁
+    return bufferManager->flush(flushGroupId);
 
 }
 
 bool Server::get(const string &key, string &value) {
 
-    string _key = validateKey(key);
-    if (_key == INVALID_KEY) {
+    if (!validateKey(key)) {
         return false;
     }
+    string padded;
+    const string &_key = storedKey(key, padded);
 
 //    string *p = lruList->get(_key);
 //    if (p != nullptr) {
@@ -71,7 +91,14 @@ bool Server::get(const string &key, string &value) {
         return true;
     }
 
-    // 如果 buffer 里没有，那么到 lsm 里找 kv 的 position
+    // buffer 里没有的话，再看 value 缓存，缓存里只有已经落盘的 value
+    ValueCache *valueCache = ValueCache::getInstance();
+    uint64_t generation;
+    if (valueCache->get(_key, value, generation)) {
+        return true;
+    }
+
+    // 如果缓存里也没有，那么到 lsm 里找 kv 的 position
     ValueLayout layout;
     int groupId;
     while (true) {
@@ -80,13 +107,13 @@ bool Server::get(const string &key, string &value) {
             return false;
         }
         groupId = layout.getPositionInfo().groupId;
-        fileManager->operateFileMutex(groupId, LOCK);
+        fileManager->operateFileSharedMutex(groupId, LOCK);
         // 在上锁之后，再 get 一次 layout，看是否相同
         ValueLayout temp = levelDbKeyManager->get(_key);
         if (temp.layoutCompare(layout)) {
             break;
         } else {
-            fileManager->operateFileMutex(groupId, UNLOCK);
+            fileManager->operateFileSharedMutex(groupId, UNLOCK);
         }
     }
 
@@ -95,7 +122,7 @@ bool Server::get(const string &key, string &value) {
     // 根据 position 到 disk 里找 value
     valueLog->assignValueInfo(_key, layout);
 
-    fileManager->operateFileMutex(groupId, UNLOCK);
+    fileManager->operateFileSharedMutex(groupId, UNLOCK);
 
     if (!layout.getValueInfo().valid) {
         return false;
@@ -103,7 +130,7 @@ bool Server::get(const string &key, string &value) {
 
     value = layout.getValueInfo().value;
 
-//    lruList->put(_key, new string(value));
+    valueCache->fill(_key, value, generation);
 
 //    printf("get from disk\n");
     return true;
@@ -115,66 +142,144 @@ void Server::getRange(const string &startingKey, int numKeys, vector<string> &ke
 
 //    printf("startingKey = %s, numKeys = %d\n", startingKey.c_str(), numKeys);
 
-    string _startingKey = validateKey(startingKey);
-    if (_startingKey == INVALID_KEY) {
+    if (!validateKey(startingKey)) {
         return;
     }
+    string padded;
+    const string &_startingKey = storedKey(startingKey, padded);
+    bool paddedKeys = ConfigManager::getInstance().paddedKeys();
 
     BufferManager *bufferManager = BufferManager::getInstance();
 
     // 如果连分组都还没生成，那么直接到 initialBuffer 里 getRange
+    // 查询期间 pivots 可能刚好生成，这时 initialGetRange 返回 false，走下面按 group 查的流程
     if (!bufferManager->pivotsGenerated()) {
         printf("initialGetRange\n");
-        bufferManager->initialGetRange(_startingKey, numKeys, keys, values);
-        return;
+        if (bufferManager->initialGetRange(_startingKey, numKeys, keys, values)) {
+            if (paddedKeys) {
+                for (auto &key: keys) {
+                    key = trim(key);
+                }
+            }
+            return;
+        }
     }
 
     StatisticsManager *statisticsManager = StatisticsManager::getInstance();
 
     int randomNumber = statisticsManager->startTimer();
 
-    // 把 buffer 全部落盘
-    bufferManager->flushAll();
-
     LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
     ValueLog *valueLog = ValueLog::getInstance();
     FileManager *fileManager = FileManager::getInstance();
 
-    // 先把所有 group 都锁住，因为不知道 range 里的 key 会涉及哪些 group
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        fileManager->operateFileMutex(i, LOCK);
-    }
+    // 不再把 buffer 全部落盘、也不再锁住所有 group，而是从 startingKey 所在的 group 开始按 key 的顺序逐个 group 处理：
+    // 在 group 的 buffer 锁内拷贝 buffer、拿 lsm 快照，并拿到该 group 文件的共享锁，然后立刻释放 buffer 锁，
+    // buffer 和快照在同一时刻拿到，flush 只会在释放 buffer 锁之后才清空 immutable buffer，所以不会漏掉也不会读到更新的数据；
+    // 文件的共享锁一直持有到 value 读完，期间只挡住对这些 group 的 gc，写入和 flush 都不受影响
+    // 各个 group 的 key range 互不相交，每个 group 内部是一致的视图
+    // rebalance 会改动相邻 group 之间的 pivot，查询期间 pivots 变了的话前后的 group 可能对不上，放掉锁重新查一遍
+    vector<int> lockedGroups;
 
-    // 从 lsm 中得到所有的 key 及其 location
-    vector<ValueLayout> valueLayouts;
-    levelDbKeyManager->getKeys(_startingKey, numKeys, keys, valueLayouts);
+    // 需要到 value log 里读的 key，以及它们的 value 应该放到结果的哪个位置
+    vector<string> diskKeys;
+    vector<ValueLayout> diskLayouts;
+    vector<int> diskSlots;
 
-//    printf("first = %s, last = %s\n", keys[0].c_str(), keys[keys.size() - 1].c_str());
+    int groupNum = (int) ConfigManager::getInstance().getGroupNum();
 
-    // 看这些 key 涉及到哪些 group，未涉及的 group 可以解锁了
-    unordered_set<int> involvingGroups;
-    for (int i = 0; i < keys.size(); ++i) {
-        involvingGroups.insert(valueLayouts[i].getPositionInfo().groupId);
-    }
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        if (involvingGroups.find(i) == involvingGroups.end()) {
-            fileManager->operateFileMutex(i, UNLOCK);
+    while (true) {
+
+        uint64_t pivotsVersion = bufferManager->getPivotsVersion();
+
+        for (int g = bufferManager->getBelongingGroup(_startingKey); g < groupNum && keys.size() < numKeys; ++g) {
+
+            int remaining = numKeys - keys.size();
+
+            map<string, string> bufferEntries;
+            const leveldb::Snapshot *snapshot;
+            vector<string> bound;
+            bool firstGroup = lockedGroups.empty();
+            string fromKey;
+            {
+                unique_lock<mutex> groupLock = bufferManager->lockGroup(g, false);
+                // 第一个 group 从 startingKey 开始（包含），之后的 group 从上一个 pivot 开始（不包含）
+                // 持有 group 的锁时它的两个 pivot 都不会变
+                bound = bufferManager->getGroupBound(g);
+                fromKey = firstGroup ? _startingKey : bound[0];
+                bufferManager->copyGroupBuffer(g, fromKey, bufferEntries);
+                snapshot = levelDbKeyManager->getSnapshot();
+                // 快照里这个 group 的 position 可能在热文件里，也可能在冷文件里
+                fileManager->operateFileSharedMutex(g, LOCK);
+                fileManager->operateFileSharedMutex(fileManager->getColdGroupId(g), LOCK);
+            }
+            lockedGroups.push_back(g);
+
+            vector<string> lsmKeys;
+            vector<ValueLayout> lsmLayouts;
+            levelDbKeyManager->getKeys(snapshot, fromKey, firstGroup, bound[1], remaining, lsmKeys, lsmLayouts);
+            levelDbKeyManager->releaseSnapshot(snapshot);
+
+            // 归并 buffer 和快照，同一个 key 以 buffer 为准
+            auto bufferIt = bufferEntries.begin();
+            int lsmIdx = 0;
+            while (keys.size() < numKeys && (bufferIt != bufferEntries.end() || lsmIdx < lsmKeys.size())) {
+                bool fromBuffer = lsmIdx == lsmKeys.size() ||
+                                  (bufferIt != bufferEntries.end() && bufferIt->first <= lsmKeys[lsmIdx]);
+                if (fromBuffer) {
+                    if (lsmIdx < lsmKeys.size() && bufferIt->first == lsmKeys[lsmIdx]) {
+                        lsmIdx++;
+                    }
+                    keys.push_back(bufferIt->first);
+                    values.push_back(bufferIt->second);
+                    bufferIt++;
+                } else {
+                    diskKeys.push_back(lsmKeys[lsmIdx]);
+                    diskLayouts.push_back(lsmLayouts[lsmIdx]);
+                    diskSlots.push_back(keys.size());
+                    keys.push_back(lsmKeys[lsmIdx]);
+                    values.emplace_back();
+                    lsmIdx++;
+                }
+            }
+
+        }
+
+        // pivots 没变过，快照里的 position 都在已经锁住的 group 里
+        if (bufferManager->getPivotsVersion() == pivotsVersion) {
+            break;
         }
+
+        for (int g: lockedGroups) {
+            fileManager->operateFileSharedMutex(g, UNLOCK);
+            fileManager->operateFileSharedMutex(fileManager->getColdGroupId(g), UNLOCK);
+        }
+        lockedGroups.clear();
+        diskKeys.clear();
+        diskLayouts.clear();
+        diskSlots.clear();
+        keys.clear();
+        values.clear();
+
     }
 
-    // 现在要去 group 内找这些 position 处的 value
-    valueLog->assignValueInfo(keys, valueLayouts);
+    // 现在要去 group 内找这些 position 处的 value，diskLayouts 按 key 排序，同一个 group 的是连在一起的
+    valueLog->assignValueInfo(diskKeys, diskLayouts);
 
-    // 把 values 提出来即可，此外还要把 key 给变回来（插入的时候是 validate 了的）
-    for (int i = 0; i < valueLayouts.size(); ++i) {
-        keys[i] = trim(keys[i]);
-        values.push_back(valueLayouts[i].getValueInfo().value);
+    for (int i = 0; i < diskLayouts.size(); ++i) {
+        values[diskSlots[i]] = diskLayouts[i].getValueInfo().value;
     }
 
     // 可以解锁 group 了
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        if (involvingGroups.find(i) != involvingGroups.end()) {
-            fileManager->operateFileMutex(i, UNLOCK);
+    for (int g: lockedGroups) {
+        fileManager->operateFileSharedMutex(g, UNLOCK);
+        fileManager->operateFileSharedMutex(fileManager->getColdGroupId(g), UNLOCK);
+    }
+
+    // 旧的数据库里要把 key 给变回来（插入的时候是补齐了的）
+    if (paddedKeys) {
+        for (auto &key: keys) {
+            key = trim(key);
         }
     }
 
@@ -187,23 +292,15 @@ void Server::getRange(const string &startingKey, int numKeys, vector<string> &ke
 
 }
 
-// gc 使用
+// 读出某个 group 的全部数据，[startingKey, endingKey] 是这个 group 的范围，调用方已经按 group 锁 -> 文件锁 -> lsm 锁的顺序拿好了锁
+// gc 不再使用，它会把整个 group 读进内存，gc 改成了按 chunk 流式地读
 void Server::getRange(const std::string &startingKey, const std::string &endingKey, std::vector<std::string> &keys,
                       std::vector<std::string> &values) {
 
-    BufferManager *bufferManager = BufferManager::getInstance();
-
-    // 把 buffer 全部落盘
-    bufferManager->flushAll();
+    // 这里不需要把 buffer 落盘：gc 只重写 lsm 中可见的数据，buffer 里更新的数据之后 flush 时会追加到重写后的文件中
 
     LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
     ValueLog *valueLog = ValueLog::getInstance();
-    FileManager *fileManager = FileManager::getInstance();
-
-    // 先把所有 group 都锁住，因为不知道 range 里的 key 会涉及哪些 group
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        fileManager->operateFileMutex(i, LOCK);
-    }
 
     // 从 lsm 中得到所有的 key 及其 location
     vector<ValueLayout> valueLayouts;
@@ -211,18 +308,7 @@ void Server::getRange(const std::string &startingKey, const std::string &endingK
 
 //    printf("first = %s, last = %s\n", keys[0].c_str(), keys[keys.size() - 1].c_str());
 
-    // 看这些 key 涉及到哪些 group，未涉及的 group 可以解锁了
-    unordered_set<int> involvingGroups;
-    for (int i = 0; i < keys.size(); ++i) {
-        involvingGroups.insert(valueLayouts[i].getPositionInfo().groupId);
-    }
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        if (involvingGroups.find(i) == involvingGroups.end()) {
-            fileManager->operateFileMutex(i, UNLOCK);
-        }
-    }
-
-    // 现在要去 group 内找这些 position 处的 value
+    // 现在要去 group 内找这些 position 处的 value，range 内的 key 都属于同一个 group，不需要再锁别的 group
     valueLog->assignValueInfo(keys, valueLayouts, true);
 
     // 把 values 提出来即可，注意这里不要把 key 给变回来
@@ -230,13 +316,6 @@ void Server::getRange(const std::string &startingKey, const std::string &endingK
         values.push_back(valueLayouts[i].getValueInfo().value);
     }
 
-    // 可以解锁 group 了
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        if (involvingGroups.find(i) != involvingGroups.end()) {
-            fileManager->operateFileMutex(i, UNLOCK);
-        }
-    }
-
 //    printf("get range res:\n");
 //    for (int i = 0; i < values.size(); ++i) {
 //        printf("key = %s, value = %s\n", keys[i].c_str(), values[i].c_str());
@@ -246,16 +325,17 @@ void Server::getRange(const std::string &startingKey, const std::string &endingK
 
 bool Server::del(const string &key) {
 
-    string _key = validateKey(key);
-    if (_key == INVALID_KEY) {
+    if (!validateKey(key)) {
         return false;
     }
+    string padded;
+    const string &_key = storedKey(key, padded);
 
     BufferManager *bufferManager = BufferManager::getInstance();
-    bufferManager->del(_key);
+    uint64_t lsn;
+    bool ret = bufferManager->del(_key, lsn);
 
-    LevelDBKeyManager *levelDbKeyManager = LevelDBKeyManager::getInstance();
-    bool ret = levelDbKeyManager->deleteKey(_key);
+    WriteAheadLog::getInstance()->commit(lsn);
 
     return ret;
 
@@ -266,12 +346,29 @@ Server::Server(const char* config) {
     // 先构造后析构，注意顺序不能乱
     ConfigManager::getInstance().setConfigPath(config);
     StatisticsManager::getInstance();
-    // ThreadPoolManager::getInstance();
+    // BufferManager 析构时的 flush 会更新 value 缓存，因此缓存要比它先构造
+    ValueCache::getInstance();
+    // 读压缩块的各个线程都会用到块缓存，它要比 gc 和 ValueLog 后析构
+    BlockCache::getInstance();
+    // group 的个数记录在 lsm 里，其余模块按它来分配各个 group 的状态，所以 lsm 要最先打开
+    LevelDBKeyManager::getInstance();
     FileManager::getInstance();
     ValueLog::getInstance();
+    // BufferManager 析构时落盘之后才能删掉 wal，因此 wal 要比它先构造
+    WriteAheadLog::getInstance();
     BufferManager::getInstance();
-    LevelDBKeyManager::getInstance();
+    // 后台 gc 线程会用到线程池、热度统计和 rebalance，它们要比 gc 先构造、后析构，否则退出时 gc 可能用到已经析构的对象
+    ThreadPoolManager::getInstance();
+    HotnessSketch::getInstance();
+    RebalanceManager::getInstance();
     GcManager::getInstance();
+    // 上次没做完的 rebalance 要在 gc 开始之前做完
+    RebalanceManager::getInstance()->recover();
+    // 重放上次没落盘的写入，之后才开始接受新的写入
+    WriteAheadLog::getInstance()->recover();
+    if (ConfigManager::getInstance().backgroundGC()) {
+        GcManager::getInstance()->start();
+    }
 }
 
 void Server::test() {
@@ -62,6 +62,22 @@ void StatisticsManager::addCount(int type, size_t amount) {
     }
 }
 
+void StatisticsManager::addValueCacheAccess(bool hit) {
+    if (hit) {
+        valueCacheHits.fetch_add(1, memory_order_relaxed);
+    } else {
+        valueCacheMisses.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void StatisticsManager::addBlockCacheAccess(bool hit) {
+    if (hit) {
+        blockCacheHits.fetch_add(1, memory_order_relaxed);
+    } else {
+        blockCacheMisses.fetch_add(1, memory_order_relaxed);
+    }
+}
+
 void StatisticsManager::printStatistics() {
 
     printf("===================== print statistics =====================\n");
@@ -136,6 +152,22 @@ void StatisticsManager::printStatistics() {
     }
     printf("gcWriteBytesStr(KB) = %s\n", gcWriteBytesStr.c_str());
 
+    printf("=============== value cache =====================\n");
+
+    // 5.
+    size_t hits = valueCacheHits.load();
+    size_t misses = valueCacheMisses.load();
+    printf("valueCacheHits = %lu, valueCacheMisses = %lu\n", hits, misses);
+    printf("valueCacheHitRatio = %f\n", hits + misses == 0 ? 0.0 : hits * 1.0 / (hits + misses));
+
+    // 6.
+    size_t blockHits = blockCacheHits.load();
+    size_t blockMisses = blockCacheMisses.load();
+    if (blockHits + blockMisses > 0) {
+        printf("blockCacheHits = %lu, blockCacheMisses = %lu\n", blockHits, blockMisses);
+        printf("blockCacheHitRatio = %f\n", blockHits * 1.0 / (blockHits + blockMisses));
+    }
+
     printf("===================== print statistics end =====================\n");
 
 }
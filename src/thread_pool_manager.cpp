@@ -1,6 +1,9 @@
 #include "thread_pool_manager.h"
 #include "constant.h"
+#include "configManager.h"
 
 ThreadPoolManager::ThreadPoolManager() {
     _flushThreadPool.size_controller().resize(POOL_THREADS_NUM);
+    _rangeScanThreadPool.size_controller().resize(ConfigManager::getInstance().getNumRangeScanThread());
+    _gcThreadPool.size_controller().resize(ConfigManager::getInstance().getNumGCThread());
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "util.h"
+#include "configManager.h"
 #include <algorithm>
 #include <cctype>
 
@@ -20,29 +21,43 @@ vector<string> split(const string &s, const string &delimiter) {
     return res;
 }
 
-// key 的最大长度为 24B，且不能存在空格
-string validateKey(const string &key) {
+// 新的数据库里 key 最长 MAX_KEY_SIZE，可以有空格；key 补齐到 KEY_LENGTH 的旧数据库里最长 KEY_LENGTH，且不能有空格
+// 内部使用的特殊 key 不再因为长度不同而和用户的 key 区分开，用户的 key 不能和它们冲突
+bool validateKey(const string &key) {
 
-    if (key.size() > KEY_LENGTH) {
-        printf("max key length is %d, your key is %s\n", KEY_LENGTH, key.c_str());
-        return INVALID_KEY;
-    }
+    bool padded = ConfigManager::getInstance().paddedKeys();
 
-    for (int i = 0; i < key.size(); ++i) {
-        if (key[i] == ' ') {
-            printf("blank exist in the key, invalid, your key is %s\n", key.c_str());
-            return INVALID_KEY;
-        }
+    if (key.size() > (padded ? KEY_LENGTH : MAX_KEY_SIZE)) {
+        printf("max key length is %zu, your key has %zu bytes\n", padded ? KEY_LENGTH : MAX_KEY_SIZE, key.size());
+        return false;
     }
 
-    string res = key;
+    if (padded && key.find(' ') != string::npos) {
+        printf("blank exist in the key, invalid, your key is %s\n", key.c_str());
+        return false;
+    }
 
-    while (res.size() < KEY_LENGTH) {
-        res += " ";
+    if (!padded && (key.compare(0, RESERVED_KEY_PREFIX.size(), RESERVED_KEY_PREFIX) == 0 || key == INF_UPPER_BOUND)) {
+        printf("key %s is reserved\n", key.c_str());
+        return false;
     }
 
+    return true;
+
+}
+
+string padKey(const string &key) {
+    string res = key;
+    res.resize(KEY_LENGTH, ' ');
     return res;
+}
 
+const string &storedKey(const string &key, string &padded) {
+    if (!ConfigManager::getInstance().paddedKeys()) {
+        return key;
+    }
+    padded = padKey(key);
+    return padded;
 }
 
 string randStr(const int len) {
@@ -56,13 +71,7 @@ string randStr(const int len) {
 }
 
 string trim(const string &str) {
-    string temp;
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] != ' ') {
-            temp += str[i];
-        }
-    }
-    return temp;
+    return str.substr(0, str.find_last_not_of(' ') + 1);
 }
 
 
@@ -0,0 +1,249 @@
+#include "value_cache.h"
+#include "constant.h"
+#include "statistics_manager.h"
+
+// 每个 entry 除了 key 和 value 本身之外大致占用的内存：list 节点、两个 string 头、unordered_map 节点及其中的 key
+static const size_t VALUE_CACHE_ENTRY_OVERHEAD = 160;
+
+ValueCache::ValueCache(size_t capacityBytes) {
+
+    enabled = capacityBytes > 0;
+    if (!enabled) {
+        return;
+    }
+
+    size_t shardBudget = capacityBytes / VALUE_CACHE_SHARD_NUM;
+
+    // sketch 的宽度按 shard 里大约能放下多少个 1KB 的 value 来定，取 2 的幂
+    size_t sketchWidth = 64;
+    while (sketchWidth < shardBudget / 1024) {
+        sketchWidth <<= 1;
+    }
+
+    for (int i = 0; i < VALUE_CACHE_SHARD_NUM; ++i) {
+        auto *shard = new Shard();
+        shard->budgets[WINDOW] = shardBudget / 100;
+        shard->budgets[PROTECTED] = (shardBudget - shard->budgets[WINDOW]) * 4 / 5;
+        shard->budgets[PROBATION] = shardBudget - shard->budgets[WINDOW] - shard->budgets[PROTECTED];
+        shard->sketch.resize(4 * sketchWidth);
+        shard->sketchMask = sketchWidth - 1;
+        shards.push_back(shard);
+    }
+
+}
+
+ValueCache::~ValueCache() {
+    for (auto &shard: shards) {
+        delete shard;
+    }
+}
+
+ValueCache::Shard *ValueCache::getShard(const string &key) {
+    size_t h = hash<string>()(key);
+    return shards[(h >> 32) % VALUE_CACHE_SHARD_NUM];
+}
+
+size_t ValueCache::charge(const Entry &entry) {
+    return entry.key.size() + entry.value.size() + VALUE_CACHE_ENTRY_OVERHEAD;
+}
+
+void ValueCache::recordAccess(Shard *shard, const string &key) {
+
+    size_t h = hash<string>()(key);
+    size_t width = shard->sketchMask + 1;
+
+    for (int i = 0; i < 4; ++i) {
+        size_t idx = i * width + ((h >> (i * 8)) & shard->sketchMask);
+        if (shard->sketch[idx] < 15) {
+            shard->sketch[idx]++;
+        }
+    }
+
+    // 定期衰减，让过去的热点慢慢失去优势
+    if (++shard->samples >= 10 * width) {
+        for (auto &counter: shard->sketch) {
+            counter >>= 1;
+        }
+        shard->samples /= 2;
+    }
+
+}
+
+int ValueCache::frequency(Shard *shard, const string &key) {
+
+    size_t h = hash<string>()(key);
+    size_t width = shard->sketchMask + 1;
+
+    int freq = 15;
+    for (int i = 0; i < 4; ++i) {
+        size_t idx = i * width + ((h >> (i * 8)) & shard->sketchMask);
+        freq = min(freq, (int) shard->sketch[idx]);
+    }
+
+    return freq;
+
+}
+
+// 把 entry 移到 segment 的头部（最近使用的一端）
+void ValueCache::moveTo(Shard *shard, list<Entry>::iterator it, Segment segment) {
+    size_t size = charge(*it);
+    shard->bytes[it->segment] -= size;
+    shard->lists[segment].splice(shard->lists[segment].begin(), shard->lists[it->segment], it);
+    it->segment = segment;
+    shard->bytes[segment] += size;
+}
+
+void ValueCache::remove(Shard *shard, list<Entry>::iterator it) {
+    shard->bytes[it->segment] -= charge(*it);
+    shard->index.erase(it->key);
+    shard->lists[it->segment].erase(it);
+}
+
+void ValueCache::onHit(Shard *shard, list<Entry>::iterator it) {
+
+    if (it->segment != PROBATION) {
+        moveTo(shard, it, it->segment);
+        return;
+    }
+
+    // probation 中再次被访问的晋升到 protected，protected 超了就把最久没用的降回 probation
+    moveTo(shard, it, PROTECTED);
+    while (shard->bytes[PROTECTED] > shard->budgets[PROTECTED] && shard->lists[PROTECTED].size() > 1) {
+        moveTo(shard, prev(shard->lists[PROTECTED].end()), PROBATION);
+    }
+
+}
+
+// window 超出预算时，把 window 尾部的 entry 作为候选放进 main，main 放不下时候选和 probation 尾部的 entry 比频率
+void ValueCache::evictWindow(Shard *shard) {
+
+    size_t mainBudget = shard->budgets[PROBATION] + shard->budgets[PROTECTED];
+
+    while (shard->bytes[WINDOW] > shard->budgets[WINDOW] && !shard->lists[WINDOW].empty()) {
+
+        auto candidate = prev(shard->lists[WINDOW].end());
+        moveTo(shard, candidate, PROBATION);
+
+        while (shard->bytes[PROBATION] + shard->bytes[PROTECTED] > mainBudget) {
+            auto victim = prev(shard->lists[PROBATION].end());
+            // probation 里只剩候选，说明候选本身比 probation 的预算还大，不收
+            if (victim == candidate) {
+                remove(shard, candidate);
+                break;
+            }
+            if (frequency(shard, candidate->key) > frequency(shard, victim->key)) {
+                remove(shard, victim);
+            } else {
+                remove(shard, candidate);
+                break;
+            }
+        }
+
+    }
+
+}
+
+// update 把 value 变大之后可能超出预算，从各段的尾部淘汰
+void ValueCache::evictOverBudget(Shard *shard) {
+    evictWindow(shard);
+    size_t mainBudget = shard->budgets[PROBATION] + shard->budgets[PROTECTED];
+    while (shard->bytes[PROBATION] + shard->bytes[PROTECTED] > mainBudget) {
+        Segment segment = shard->lists[PROBATION].empty() ? PROTECTED : PROBATION;
+        remove(shard, prev(shard->lists[segment].end()));
+    }
+}
+
+bool ValueCache::get(const string &key, string &value, uint64_t &generation) {
+
+    if (!enabled) {
+        generation = 0;
+        return false;
+    }
+
+    Shard *shard = getShard(key);
+    bool hit;
+
+    {
+        lock_guard<mutex> lockGuard(shard->m);
+
+        recordAccess(shard, key);
+
+        auto it = shard->index.find(key);
+        hit = it != shard->index.end();
+        if (hit) {
+            onHit(shard, it->second);
+            value = it->second->value;
+        } else {
+            generation = shard->generation;
+        }
+    }
+
+    StatisticsManager::getInstance()->addValueCacheAccess(hit);
+
+    return hit;
+
+}
+
+void ValueCache::fill(const string &key, const string &value, uint64_t generation) {
+
+    if (!enabled) {
+        return;
+    }
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    if (shard->generation != generation || shard->index.find(key) != shard->index.end()) {
+        return;
+    }
+
+    shard->lists[WINDOW].push_front({key, value, WINDOW});
+    shard->bytes[WINDOW] += charge(shard->lists[WINDOW].front());
+    shard->index[key] = shard->lists[WINDOW].begin();
+
+    evictWindow(shard);
+
+}
+
+void ValueCache::update(const string &key, const string &value) {
+
+    if (!enabled) {
+        return;
+    }
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    shard->generation++;
+
+    auto it = shard->index.find(key);
+    if (it == shard->index.end()) {
+        return;
+    }
+
+    auto entry = it->second;
+    shard->bytes[entry->segment] -= charge(*entry);
+    entry->value = value;
+    shard->bytes[entry->segment] += charge(*entry);
+
+    evictOverBudget(shard);
+
+}
+
+void ValueCache::erase(const string &key) {
+
+    if (!enabled) {
+        return;
+    }
+
+    Shard *shard = getShard(key);
+    lock_guard<mutex> lockGuard(shard->m);
+
+    shard->generation++;
+
+    auto it = shard->index.find(key);
+    if (it != shard->index.end()) {
+        remove(shard, it->second);
+    }
+
+}
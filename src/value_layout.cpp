@@ -1,5 +1,6 @@
 #include "value_layout.h"
 #include "util.h"
+#include "constant.h"
 
 ValueLayout::ValueLayout() {
     valueInfo.valid = false;
@@ -13,26 +14,132 @@ void ValueLayout::setValueInfo(uint32_t valueSize, const string &key, const stri
     valueInfo.valid = true;
 }
 
-void ValueLayout::setPositionInfo(int groupId, size_t offset, size_t length) {
+void ValueLayout::setPositionInfo(int groupId, size_t offset, size_t length, uint32_t generation,
+                                  uint32_t blockLength, uint32_t inBlockOffset) {
     positionInfo.groupId = groupId;
+    positionInfo.generation = generation;
     positionInfo.offset = offset;
     positionInfo.length = length;
+    positionInfo.blockLength = blockLength;
+    positionInfo.inBlockOffset = inBlockOffset;
+    positionInfo.valid = true;
+}
+
+void ValueLayout::setPositionInfo(const PositionInfo &position) {
+    positionInfo = position;
     positionInfo.valid = true;
 }
 
 std::string ValueLayout::serializePosition() {
-    return std::to_string(positionInfo.groupId) + "," +
-           std::to_string(positionInfo.offset) + "," + std::to_string(positionInfo.length);
+
+    // 第 0 代文件里的 position 仍然用原来的格式，之后的代在末尾多存 4B 的 generation，压缩块里的再多存块长度和块内偏移
+    bool inBlock = positionInfo.blockLength > 0;
+    bool withGeneration = inBlock || positionInfo.generation > 0;
+
+    string str(inBlock ? POSITION_BLOCK_ENCODED_SIZE :
+               withGeneration ? POSITION_GEN_ENCODED_SIZE : POSITION_ENCODED_SIZE, '\0');
+    auto *ptr = (uint8_t *) &str[0];
+
+    *ptr++ = inBlock ? POSITION_FORMAT_BLOCK_VERSION :
+             withGeneration ? POSITION_FORMAT_GEN_VERSION : POSITION_FORMAT_VERSION;
+
+    auto groupId = (uint32_t) positionInfo.groupId;
+    for (int i = 0; i < 4; ++i) {
+        *ptr++ = (groupId >> (8 * i)) & 0xff;
+    }
+
+    uint64_t offset = positionInfo.offset;
+    for (int i = 0; i < 5; ++i) {
+        *ptr++ = (offset >> (8 * i)) & 0xff;
+    }
+
+    auto length = (uint32_t) positionInfo.length;
+    for (int i = 0; i < 4; ++i) {
+        *ptr++ = (length >> (8 * i)) & 0xff;
+    }
+
+    if (withGeneration) {
+        for (int i = 0; i < 4; ++i) {
+            *ptr++ = (positionInfo.generation >> (8 * i)) & 0xff;
+        }
+    }
+
+    if (inBlock) {
+        for (int i = 0; i < 4; ++i) {
+            *ptr++ = (positionInfo.blockLength >> (8 * i)) & 0xff;
+        }
+        for (int i = 0; i < 4; ++i) {
+            *ptr++ = (positionInfo.inBlockOffset >> (8 * i)) & 0xff;
+        }
+    }
+
+    return str;
+
 }
 
-bool ValueLayout::deserializePosition(const string &str) {
-    vector<string> v = split(str, ",");
-    char *useless;
-//    printf("v[0]=%s\n", v[0].c_str());
-//    printf("v[1]=%s\n", v[1].c_str());
-//    printf("v[2]=%s\n", v[2].c_str());
-    setPositionInfo(atoi(v[0].c_str()), strtoul(v[1].c_str(), &useless, 10), strtoul(v[2].c_str(), &useless, 10));
+bool ValueLayout::isLegacyPosition(const char *data, size_t size) {
+    return !(size == POSITION_ENCODED_SIZE && data[0] == POSITION_FORMAT_VERSION) &&
+           !(size == POSITION_GEN_ENCODED_SIZE && data[0] == POSITION_FORMAT_GEN_VERSION) &&
+           !(size == POSITION_BLOCK_ENCODED_SIZE && data[0] == POSITION_FORMAT_BLOCK_VERSION);
+}
+
+bool ValueLayout::deserializePosition(const char *data, size_t size) {
+
+    // 旧的 "group,offset,length" 文本格式，只有 migrate 之前的数据才会走到这里
+    if (isLegacyPosition(data, size)) {
+        vector<string> v = split(string(data, size), ",");
+        if (v.size() != 3) {
+            return false;
+        }
+        char *useless;
+        setPositionInfo(atoi(v[0].c_str()), strtoul(v[1].c_str(), &useless, 10),
+                        strtoul(v[2].c_str(), &useless, 10));
+        return true;
+    }
+
+    auto *ptr = (const uint8_t *) data + 1;
+
+    uint32_t groupId = 0;
+    for (int i = 0; i < 4; ++i) {
+        groupId |= (uint32_t) (*ptr++) << (8 * i);
+    }
+
+    uint64_t offset = 0;
+    for (int i = 0; i < 5; ++i) {
+        offset |= (uint64_t) (*ptr++) << (8 * i);
+    }
+
+    uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) {
+        length |= (uint32_t) (*ptr++) << (8 * i);
+    }
+
+    uint32_t generation = 0;
+    if (size >= POSITION_GEN_ENCODED_SIZE) {
+        for (int i = 0; i < 4; ++i) {
+            generation |= (uint32_t) (*ptr++) << (8 * i);
+        }
+    }
+
+    uint32_t blockLength = 0;
+    uint32_t inBlockOffset = 0;
+    if (size == POSITION_BLOCK_ENCODED_SIZE) {
+        for (int i = 0; i < 4; ++i) {
+            blockLength |= (uint32_t) (*ptr++) << (8 * i);
+        }
+        for (int i = 0; i < 4; ++i) {
+            inBlockOffset |= (uint32_t) (*ptr++) << (8 * i);
+        }
+    }
+
+    setPositionInfo((int32_t) groupId, offset, length, generation, blockLength, inBlockOffset);
+
     return true;
+
+}
+
+bool ValueLayout::deserializePosition(const string &str) {
+    return deserializePosition(str.data(), str.size());
 }
 
 const ValueInfo &ValueLayout::getValueInfo() const {
@@ -44,6 +151,8 @@ const PositionInfo &ValueLayout::getPositionInfo() const {
 }
 
 bool ValueLayout::layoutCompare(const ValueLayout &rhs) {
-    return positionInfo.groupId == rhs.positionInfo.groupId &&
-           positionInfo.offset == rhs.positionInfo.offset && positionInfo.length == rhs.positionInfo.length;
+    return positionInfo.groupId == rhs.positionInfo.groupId && positionInfo.generation == rhs.positionInfo.generation &&
+           positionInfo.offset == rhs.positionInfo.offset && positionInfo.length == rhs.positionInfo.length &&
+           positionInfo.blockLength == rhs.positionInfo.blockLength &&
+           positionInfo.inBlockOffset == rhs.positionInfo.inBlockOffset;
 }
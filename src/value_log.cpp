@@ -8,32 +8,52 @@
 #include "util.h"
 #include "thread_pool_manager.h"
 #include "statistics_manager.h"
-
-void ValueLog::groupBatchPut(unordered_map<string, string> &buffer, size_t bufferSize, int groupId,
-                             vector<ValueLayout> &valueLayouts) {
-    getGroup(groupId).batchPut(buffer, bufferSize, valueLayouts);
+#include "block_cache.h"
+#include <condition_variable>
+#include <boost/bind.hpp>
+#include <chrono>
+#include <map>
+#include <algorithm>
+
+void ValueLog::groupBatchPut(unordered_map<string, string> &buffer, int groupId, vector<ValueLayout> &valueLayouts) {
+    // 压缩时实际写到文件里的比 buffer 的大小小，按实际的算
+    size_t writtenSize = getGroup(groupId).batchPut(buffer, valueLayouts);
     if (groupId != INITIAL_GROUP_ID) {
         m.lock();
         increments[groupId] += buffer.size();
-        totalDbSize += bufferSize;
+        writtenBytes[groupId] += writtenSize;
+        totalDbSize += writtenSize;
         m.unlock();
     }
+    lastFlushTime = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-size_t ValueLog::groupRewrite(vector<std::string> &keys, vector<std::string> &values, int groupId,
-                              vector<ValueLayout> &valueLayouts) {
-    size_t oldSize = FileManager::getInstance()->getFileSize(groupId);
-    size_t rewriteSize = getGroup(groupId).rewrite(keys, values, valueLayouts);
-    if (groupId != INITIAL_GROUP_ID) {
-        m.lock();
-        totalDbSize -= oldSize;
-        totalDbSize += rewriteSize;
-        increments[groupId] = 0;
-        m.unlock();
-    }
+// 调用方持有 group 的 buffer 锁和文件的独占锁：切到新的一代，之后的 flush 和 gc 的搬运都追加到新的一代里
+uint32_t ValueLog::startGroupRewrite(int groupId) {
+    uint32_t generation = FileManager::getInstance()->addGeneration(groupId);
+    lock_guard<mutex> lockGuard(m);
+    // 新的一代里还没有垃圾，旧的各代里的垃圾等它们被删掉时一起回收
+    deadBytes[groupId] = 0;
+    lastGcTimes[groupId] =
+            chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    return generation;
+}
+
+size_t ValueLog::groupRewrite(vector<ValueLayout> &valueLayouts, int groupId) {
+    size_t rewriteSize = getGroup(groupId).rewrite(valueLayouts);
+    lock_guard<mutex> lockGuard(m);
+    totalDbSize += rewriteSize;
     return rewriteSize;
 }
 
+// 调用方持有文件的独占锁，lsm 里已经没有指向旧的各代的 position 了
+void ValueLog::finishGroupRewrite(int groupId, uint32_t generation) {
+    size_t freed = FileManager::getInstance()->retireGenerations(groupId, generation);
+    lock_guard<mutex> lockGuard(m);
+    totalDbSize -= min(totalDbSize, freed);
+    increments[groupId] = 0;
+}
+
 // fencekv 里似乎只有 initialBuffer 会使用，所以不涉及 totalDbSize
 void ValueLog::readGroupAndReset(int groupId, unordered_map<string, ValueLayout> &layouts) {
     getGroup(groupId).readAndReset(layouts);
@@ -50,138 +70,282 @@ bool ValueLog::assignValueInfo(const string &key, ValueLayout &valueLayout) {
 
     FileManager *fileManager = FileManager::getInstance();
 
-    FILE *fp = fileManager->openFile(positionInfo.groupId);
-
 //    printf("key = %s\n", key.c_str());
 //    printf("positionInfo.groupId = %d\n", positionInfo.groupId);
 //    printf("positionInfo.offset = %d\n", positionInfo.offset);
 //    printf("positionInfo.length = %d\n", positionInfo.length);
 
-    void *data = malloc(positionInfo.length);
+    bool verify = ConfigManager::getInstance().verifyChecksum();
+    BlockCache *blockCache = BlockCache::getInstance();
 
-    fileManager->operateFileMutex(positionInfo.groupId, LOCK);
-    fseek(fp, positionInfo.offset, SEEK_SET);
-    fread(data, 1, positionInfo.length, fp);
-    fileManager->operateFileMutex(positionInfo.groupId, UNLOCK);
-
-    uint32_t valueSize;
+    // 压缩块里的记录先找块缓存，命中的话不用读文件
     string value;
+    shared_ptr<const string> block;
+    if (positionInfo.blockLength > 0) {
+        block = blockCache->get(positionInfo.groupId, positionInfo.generation, positionInfo.offset);
+    }
 
-    auto *ptr = (uint8_t *) data;
-
-    memcpy(&valueSize, ptr, sizeof(uint32_t));
-    ptr += sizeof(uint32_t);
+    bool ok;
+    if (block != nullptr) {
+        ok = Group::decodeBlockRecord(*block, positionInfo, verify, nullptr, value);
+    } else {
+
+        // 压缩块要把整个块读出来
+        size_t length = positionInfo.blockLength > 0 ? positionInfo.blockLength : positionInfo.length;
+
+        // 调用方已经持有该 group 文件的锁；mmap 读模式下直接在映射上解析，否则 pread，多个读者可以并发
+        void *data = nullptr;
+        const uint8_t *mapped = fileManager->mappedData(positionInfo.groupId, positionInfo.generation,
+                                                        positionInfo.offset, length);
+        if (mapped == nullptr) {
+            data = malloc(length);
+            if (!fileManager->readAt(positionInfo.groupId, positionInfo.generation, data, length,
+                                     positionInfo.offset)) {
+                free(data);
+                return false;
+            }
+            mapped = (const uint8_t *) data;
+        }
 
-    ptr += KEY_LENGTH;
+        if (positionInfo.blockLength > 0) {
+            string raw;
+            ok = Group::decodeBlock(mapped, length, verify, raw);
+            if (ok) {
+                block = make_shared<const string>(move(raw));
+                blockCache->put(positionInfo.groupId, positionInfo.generation, positionInfo.offset, block);
+                ok = Group::decodeBlockRecord(*block, positionInfo, verify, nullptr, value);
+            }
+        } else {
+            size_t recordLength;
+            ok = Group::decodeRecord(mapped, length, verify, nullptr, value, recordLength) &&
+                 recordLength == length;
+        }
 
-    value.resize(valueSize);
+        free(data);
 
-//    printf("valueSize = %d\n", (int) valueSize);
-    memcpy((void *) value.c_str(), ptr, valueSize);
+    }
 
-    free(data);
+    if (!ok) {
+        printf("corrupted record in group %d generation %u offset %zu\n", positionInfo.groupId,
+               positionInfo.generation, positionInfo.offset);
+        return false;
+    }
 
-    valueLayout.setValueInfo(valueSize, key, value);
+    valueLayout.setValueInfo(value.size(), key, value);
 
     return true;
 
 }
 
+// 一次 range 查询里各个 group 的读任务的完成计数
+// 不能用 pool.wait()，那样会连别的查询放进池子里的任务一起等
+struct GroupReadCountdown {
+    mutex m;
+    condition_variable cond;
+    size_t remaining;
+    bool success = true;
+};
+
+static void groupReadTask(int groupId, uint32_t generation, vector<size_t> *offsets, vector<size_t> *lengths,
+                          vector<ValueLayout *> *layouts, bool verify, bool fillCache, GroupReadCountdown *countdown) {
+    bool success = Group(groupId, generation).read(*offsets, *lengths, *layouts, verify, fillCache);
+    lock_guard<mutex> lockGuard(countdown->m);
+    countdown->success = countdown->success && success;
+    if (--countdown->remaining == 0) {
+        countdown->cond.notify_one();
+    }
+}
+
 // 获取 group 的锁后使用
-void ValueLog::assignValueInfo(vector<string> &keys, vector<ValueLayout> &valueLayouts, bool isGc) {
+bool ValueLog::assignValueInfo(vector<string> &keys, vector<ValueLayout> &valueLayouts, bool isGc) {
 
 //    printf("assignValueInfo\n");
 
     if (keys.empty()) {
-        return;
+        return true;
     }
 
     StatisticsManager *statisticsManager = StatisticsManager::getInstance();
 
-    // 一个 group 中实际要进行 io 的那些 offset 和 length
-    vector<size_t> offsets;
-    vector<size_t> lengths;
-    vector<ValueLayout *> layouts;
+    // 每个 group 每一代文件的读计划：实际要进行 io 的那些 offset 和 length，以及读出来的 value 要填进哪些 layout
+    // gc 进行中时同一个 group 的 position 可能在新旧两代文件里交错出现，所以按 (group, generation) 归到同一个计划里
+    vector<int> planGroups;
+    vector<uint32_t> planGenerations;
+    vector<vector<size_t>> planOffsets;
+    vector<vector<size_t>> planLengths;
+    vector<vector<ValueLayout *>> planLayouts;
+    map<pair<int, uint32_t>, int> planIndexes;
+    // 每个 layout 落在哪个 extent 里，以及各个 extent 的末尾 -> extent 的下标
+    vector<vector<int>> planLayoutExtents;
+    vector<map<size_t, int>> planExtentEnds;
 
-    size_t preOffset = SIZE_MAX;
-    size_t preLength = SIZE_MAX;
+    size_t totalRandomReadCount = 0;
 
-    // 逐个 group 进行操作
-    int currentGroup = valueLayouts[0].getPositionInfo().groupId;
+    // gc 和 rebalance 搬运的数据总是校验，坏的记录不能被搬到新的文件里
+    bool verify = isGc || ConfigManager::getInstance().verifyChecksum();
 
-    size_t totalRandomReadCount = 0;
+    BlockCache *blockCache = BlockCache::getInstance();
 
     for (auto &layout: valueLayouts) {
 
-        int group = layout.getPositionInfo().groupId;
-        size_t offset = layout.getPositionInfo().offset;
-        size_t length = layout.getPositionInfo().length;
-
-        if (group != currentGroup) {
+        const PositionInfo &position = layout.getPositionInfo();
+        int group = position.groupId;
+        uint32_t generation = position.generation;
+        size_t offset = position.offset;
+        // 压缩块里的记录要读整个块
+        size_t length = position.blockLength > 0 ? position.blockLength : position.length;
+
+        // 块缓存里有的直接解出来，不进读计划
+        if (position.blockLength > 0) {
+            shared_ptr<const string> block = blockCache->get(group, generation, offset);
+            if (block != nullptr) {
+                string key;
+                string value;
+                if (Group::decodeBlockRecord(*block, position, verify, &key, value)) {
+                    layout.setValueInfo(value.size(), key, value);
+                } else {
+                    printf("corrupted record in group %d generation %u offset %zu\n", group, generation, offset);
+                }
+                continue;
+            }
+        }
 
-            offsets.emplace_back(preOffset);
-            lengths.emplace_back(preLength);
+        auto it = planIndexes.find({group, generation});
+        if (it == planIndexes.end()) {
+            it = planIndexes.emplace(make_pair(group, generation), (int) planGroups.size()).first;
+            planGroups.emplace_back(group);
+            planGenerations.emplace_back(generation);
+            planOffsets.emplace_back();
+            planLengths.emplace_back();
+            planLayouts.emplace_back();
+            planLayoutExtents.emplace_back();
+            planExtentEnds.emplace_back();
+        }
+        int plan = it->second;
+
+        vector<size_t> &offsets = planOffsets[plan];
+        vector<size_t> &lengths = planLengths[plan];
+        map<size_t, int> &extentEnds = planExtentEnds[plan];
+
+        // 文件里是按 key 排好序的一段段 run，按 key 的顺序读时相邻的 key 轮流落在各个 run 里
+        // 所以不只和上一个 extent 比，而是找末尾离 offset 最近的那个 extent：已经包含了它（比如同一个块里的记录）就直接用，
+        // 离末尾不超过 READ_MERGE_GAP 就接上去，每个 run 最后各自合成一个大的顺序读
+        int extent = -1;
+        auto endIt = extentEnds.upper_bound(offset);
+        if (endIt != extentEnds.end() && offsets[endIt->second] <= offset && offset + length <= endIt->first) {
+            extent = endIt->second;
+        } else if (endIt != extentEnds.begin() && offset - (--endIt)->first <= READ_MERGE_GAP) {
+            extent = endIt->second;
+            extentEnds.erase(endIt);
+            lengths[extent] = offset + length - offsets[extent];
+            extentEnds[offset + length] = extent;
+        } else {
+            extent = (int) offsets.size();
+            offsets.emplace_back(offset);
+            lengths.emplace_back(length);
+            extentEnds[offset + length] = extent;
+            totalRandomReadCount++;
+        }
 
-//            printf("group %d collect end,involving %d random reads, containing %d address\n", currentGroup,
-//                   offsets.size(), layouts.size());
-            totalRandomReadCount += offsets.size();
+        planLayouts[plan].emplace_back(&layout);
+        planLayoutExtents[plan].emplace_back(extent);
 
-            //这里考虑加一个并发操作
-            // 到 group 里去读 value
-            getGroup(currentGroup).read(offsets, lengths, layouts);
+    }
 
-            offsets.clear();
-            lengths.clear();
-            layouts.clear();
-            preOffset = SIZE_MAX;
-            preLength = SIZE_MAX;
-            currentGroup = group;
+    // Group::read 要求同一个 extent 的 layout 连在一起，extent 按 offset 从小到大排
+    for (int plan = 0; plan < planGroups.size(); ++plan) {
 
+        vector<int> order(planOffsets[plan].size());
+        for (int i = 0; i < order.size(); ++i) {
+            order[i] = i;
         }
+        vector<size_t> &offsets = planOffsets[plan];
+        sort(order.begin(), order.end(), [&offsets](int a, int b) { return offsets[a] < offsets[b]; });
+
+        vector<int> rank(order.size());
+        vector<size_t> sortedOffsets(order.size()), sortedLengths(order.size());
+        for (int i = 0; i < order.size(); ++i) {
+            rank[order[i]] = i;
+            sortedOffsets[i] = planOffsets[plan][order[i]];
+            sortedLengths[i] = planLengths[plan][order[i]];
+        }
+        planOffsets[plan].swap(sortedOffsets);
+        planLengths[plan].swap(sortedLengths);
 
-        layouts.emplace_back(&layout);
-
-        // 初始情况
-        if (preOffset == SIZE_MAX) {
-            preOffset = offset;
-            preLength = length;
-            continue;
+        vector<int> layoutOrder(planLayouts[plan].size());
+        for (int i = 0; i < layoutOrder.size(); ++i) {
+            layoutOrder[i] = i;
         }
+        vector<int> &extents = planLayoutExtents[plan];
+        stable_sort(layoutOrder.begin(), layoutOrder.end(),
+                    [&extents, &rank](int a, int b) { return rank[extents[a]] < rank[extents[b]]; });
 
-        // 如果当前的 address 和上一个 address 是连起来的，那么拼到一起
-        if (preOffset + preLength == offset) {
-            preLength += length;
-            continue;
+        vector<ValueLayout *> sortedLayouts(layoutOrder.size());
+        for (int i = 0; i < layoutOrder.size(); ++i) {
+            sortedLayouts[i] = planLayouts[plan][layoutOrder[i]];
         }
+        planLayouts[plan].swap(sortedLayouts);
 
-        // 否则，把上一个存起来
-        offsets.emplace_back(preOffset);
-        lengths.emplace_back(preLength);
+    }
 
-        preOffset = offset;
-        preLength = length;
+    // 只统计 range query 阶段的随机读次数
+    if (!isGc) statisticsManager->addCount(RANGE_QUERY_RANDOM_READ, totalRandomReadCount);
 
+    // 到 group 里去读 value，各个 group 的读计划互不相干，value 直接写进调用方的 layout 里
+    boost::threadpool::pool &pool = ThreadPoolManager::getInstance()->_rangeScanThreadPool;
+    if (planGroups.size() == 1 || pool.size() <= 1) {
+        bool success = true;
+        for (int i = 0; i < planGroups.size(); ++i) {
+            if (!Group(planGroups[i], planGenerations[i]).read(planOffsets[i], planLengths[i], planLayouts[i], verify,
+                                                               !isGc)) {
+                success = false;
+            }
+        }
+        return success;
     }
 
-    offsets.emplace_back(preOffset);
-    lengths.emplace_back(preLength);
+    GroupReadCountdown countdown;
+    countdown.remaining = planGroups.size();
+    for (int i = 0; i < planGroups.size(); ++i) {
+        pool.schedule(boost::bind(&groupReadTask, planGroups[i], planGenerations[i], &planOffsets[i],
+                                  &planLengths[i], &planLayouts[i], verify, !isGc, &countdown));
+    }
 
-//    printf("group %d collect end,involving %d random reads, containing %d address\n", currentGroup,
-//           offsets.size(), layouts.size());
-    totalRandomReadCount += offsets.size();
+    unique_lock<mutex> lock(countdown.m);
+    countdown.cond.wait(lock, [&countdown] { return countdown.remaining == 0; });
 
-    // 只统计 range query 阶段的随机读次数
-    if (!isGc) statisticsManager->addCount(RANGE_QUERY_RANDOM_READ, totalRandomReadCount);
+    return countdown.success;
 
-    // 到 group 里去读 value
-    getGroup(currentGroup).read(offsets, lengths, layouts);
+}
 
+void ValueLog::dropCorrupted(vector<string> &keys, vector<ValueLayout> &valueLayouts,
+                             vector<PositionInfo> &oldPositions, vector<string> &droppedKeys,
+                             vector<PositionInfo> &droppedPositions) {
+    size_t kept = 0;
+    for (size_t i = 0; i < valueLayouts.size(); ++i) {
+        if (!valueLayouts[i].getValueInfo().valid) {
+            printf("drop corrupted value of key %s\n", keys[i].c_str());
+            droppedKeys.push_back(move(keys[i]));
+            droppedPositions.push_back(oldPositions[i]);
+            continue;
+        }
+        if (kept != i) {
+            keys[kept] = move(keys[i]);
+            valueLayouts[kept] = move(valueLayouts[i]);
+            oldPositions[kept] = oldPositions[i];
+        }
+        kept++;
+    }
+    keys.resize(kept);
+    valueLayouts.resize(kept);
+    oldPositions.resize(kept);
 }
 
 int ValueLog::getGroupWithMaxIncr() {
+    lock_guard<mutex> lockGuard(m);
     int max = -1;
     int idx = -1;
-    for (int i = 0; i < GROUP_NUM; ++i) {
+    for (int i = 0; i < groupNum; ++i) {
         if (increments[i] > max) {
             max = increments[i];
             idx = i;
@@ -190,6 +354,106 @@ int ValueLog::getGroupWithMaxIncr() {
     return idx;
 }
 
+// 调用方持有 lsm 的锁，保证拿到的旧 position 和这次的覆盖/删除是一致的
+// 只统计当前代里的垃圾，旧的各代在 gc 结束时整个删掉
+void ValueLog::addDeadBytes(int groupId, uint32_t generation, size_t size) {
+    if (groupId == INITIAL_GROUP_ID || generation != FileManager::getInstance()->getGeneration(groupId)) {
+        return;
+    }
+    lock_guard<mutex> lockGuard(m);
+    deadBytes[groupId] += size;
+}
+
+string ValueLog::getGroupStats(int groupId) {
+    lock_guard<mutex> lockGuard(m);
+    return to_string(deadBytes[groupId]) + "," + to_string(lastGcTimes[groupId]);
+}
+
+void ValueLog::setGroupStats(int groupId, const string &stats) {
+    size_t pos = stats.find(',');
+    if (pos == string::npos) {
+        printf("invalid group stats of group %d: %s\n", groupId, stats.c_str());
+        return;
+    }
+    lock_guard<mutex> lockGuard(m);
+    deadBytes[groupId] = stoull(stats.substr(0, pos));
+    lastGcTimes[groupId] = stoll(stats.substr(pos + 1));
+}
+
+// LFS 的 cost-benefit：回收 group 得到的空间是 1 - u，代价是读一遍整个 group 再写回 u，u 为存活比例
+// 再乘上数据的年龄，越久没有 gc 的 group 里剩下的数据越冷，重写之后也不容易马上又变成垃圾
+// score = (1 - u) * age / (1 + u)，其中 1 - u 就是垃圾比例
+// 冷文件里的数据很少再被更新，垃圾比例至少要到 hotness.coldGarbageRatio 才 gc，空间不够（minRatio 为 0）时除外
+vector<int> ValueLog::pickVictims(double minRatio, size_t maxCount) {
+
+    FileManager *fileManager = FileManager::getInstance();
+    double coldMinRatio = minRatio > 0 ? max(minRatio, ConfigManager::getInstance().getColdGarbageRatio()) : 0;
+
+    // 拷贝一份再算，stat 文件大小时不持有锁
+    m.lock();
+    vector<size_t> dead = deadBytes;
+    vector<int64_t> gcTimes = lastGcTimes;
+    m.unlock();
+
+    int64_t now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+    // (score, group)
+    vector<pair<double, int>> candidates;
+    for (int i = 0; i < 2 * groupNum; ++i) {
+        if (dead[i] == 0) {
+            continue;
+        }
+        size_t fileSize = fileManager->getFileSize(i);
+        if (fileSize == 0) {
+            continue;
+        }
+        double r = min(1.0, (double) dead[i] / fileSize);
+        if (r < (fileManager->isColdGroup(i) ? coldMinRatio : minRatio)) {
+            continue;
+        }
+        double age = (double) max((int64_t) 1, now - gcTimes[i]);
+        double score = r * age / (2 - r);
+        if (score > 0) {
+            candidates.emplace_back(score, i);
+        }
+    }
+
+    size_t count = min(maxCount, candidates.size());
+    partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+                 [](const pair<double, int> &a, const pair<double, int> &b) { return a.first > b.first; });
+
+    vector<int> victims;
+    for (size_t i = 0; i < count; ++i) {
+        victims.push_back(candidates[i].second);
+    }
+
+    return victims;
+
+}
+
+int64_t ValueLog::getLastFlushTime() {
+    return lastFlushTime;
+}
+
+void ValueLog::getGroupUsage(vector<size_t> &liveBytes, vector<size_t> &written) {
+
+    FileManager *fileManager = FileManager::getInstance();
+
+    m.lock();
+    vector<size_t> dead = deadBytes;
+    written = writtenBytes;
+    m.unlock();
+
+    // 冷文件里的也算在它所属的 group 上
+    liveBytes.assign(groupNum, 0);
+    written.resize(groupNum);
+    for (int i = 0; i < 2 * groupNum; ++i) {
+        size_t fileSize = fileManager->getFileSize(i);
+        liveBytes[fileManager->getOwnerGroupId(i)] += fileSize - min(fileSize, dead[i]);
+    }
+
+}
+
 Group ValueLog::getGroup(int groupId) {
     return Group(groupId);
 }
@@ -198,19 +462,125 @@ ValueLog::ValueLog() {
 
     FileManager *fileManager = FileManager::getInstance();
 
-    increments.resize(GROUP_NUM);
+    groupNum = (int) ConfigManager::getInstance().getGroupNum();
+
+    // 冷文件和热文件分开统计，下标是文件的 groupId
+    increments.resize(2 * groupNum);
+    deadBytes.resize(2 * groupNum);
+    writtenBytes.resize(2 * groupNum);
+    // 没有持久化过的 group 按刚 gc 过算，lsm 打开后会用持久化的值覆盖
+    lastGcTimes.resize(2 * groupNum,
+                       chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count());
+    lastFlushTime = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
 
-    for (int i = 0; i < GROUP_NUM; ++i) {
-        size_t size = fileManager->getFileSize(i);
-        totalDbSize += size;
+    totalDbSize = 0;
+    lastCheckpointTime = 0;
+
+    // 文件和 checkpoint 有对不上的（比如上次 crash 之前 checkpoint 之后还写过），才逐个 stat 文件统计数据库的大小
+    if (!loadCheckpoint()) {
+        for (int i = 0; i < 2 * groupNum; ++i) {
+            totalDbSize += fileManager->getDiskSize(i);
+        }
     }
 
+    LevelDBKeyManager::getInstance()->loadGroupStats(this);
+
 }
 
 ValueLog::~ValueLog() {
+    // BufferManager 已经析构，buffer 都落盘了，这时的统计和文件是一致的
+    checkpoint(true);
 //    printf("destructor ValueLog\n");
 }
 
+// "版本,groupNum,totalDbSize|" 之后每个文件一段 "当前代,代数,当前代大小,increments,writtenBytes|"
+bool ValueLog::loadCheckpoint() {
+
+    string info;
+    if (!LevelDBKeyManager::getInstance()->getMeta(CHECKPOINT_KEY, info)) {
+        return false;
+    }
+
+    vector<string> v = split(info, "|");
+    int version, num;
+    size_t dbSize;
+    if (v.size() != 2 * groupNum + 1 || sscanf(v[0].c_str(), "%d,%d,%zu", &version, &num, &dbSize) != 3 ||
+        version != CHECKPOINT_VERSION || num != groupNum) {
+        printf("invalid checkpoint, rebuild stats from files\n");
+        return false;
+    }
+
+    FileManager *fileManager = FileManager::getInstance();
+
+    bool consistent = true;
+    for (int i = 0; i < 2 * groupNum; ++i) {
+
+        uint32_t generation;
+        size_t count, size, written;
+        int increment;
+        if (sscanf(v[i + 1].c_str(), "%u,%zu,%zu,%d,%zu", &generation, &count, &size, &increment, &written) != 5) {
+            printf("invalid checkpoint of group %d\n", i);
+            consistent = false;
+            continue;
+        }
+
+        // 累计写入的字节数只给 rebalance 估计速度，总是恢复；这之后 gc 过的话 increments 已经清零了
+        writtenBytes[i] = written;
+        if (generation == fileManager->getGeneration(i)) {
+            increments[i] = increment;
+        }
+
+        if (generation != fileManager->getGeneration(i) || count != fileManager->getGenerationCount(i) ||
+            size != fileManager->getFileSize(i)) {
+            consistent = false;
+        }
+
+    }
+
+    if (consistent) {
+        totalDbSize = dbSize;
+    }
+
+    return consistent;
+
+}
+
+void ValueLog::checkpoint(bool force) {
+
+    int64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    {
+        lock_guard<mutex> lockGuard(m);
+        if (!force && now - lastCheckpointTime < CHECKPOINT_INTERVAL) {
+            return;
+        }
+        lastCheckpointTime = now;
+    }
+
+    FileManager *fileManager = FileManager::getInstance();
+
+    // 先记文件的状态再拷统计，两者之间并发的 flush 和 gc 只会让统计稍微新一点，数据库的大小本来也不需要很精确
+    vector<uint32_t> generations(2 * groupNum);
+    vector<size_t> counts(2 * groupNum), sizes(2 * groupNum);
+    for (int i = 0; i < 2 * groupNum; ++i) {
+        generations[i] = fileManager->getGeneration(i);
+        counts[i] = fileManager->getGenerationCount(i);
+        sizes[i] = fileManager->getFileSize(i);
+    }
+
+    string info;
+    {
+        lock_guard<mutex> lockGuard(m);
+        info = to_string(CHECKPOINT_VERSION) + "," + to_string(groupNum) + "," + to_string(totalDbSize) + "|";
+        for (int i = 0; i < 2 * groupNum; ++i) {
+            info += to_string(generations[i]) + "," + to_string(counts[i]) + "," + to_string(sizes[i]) + "," +
+                    to_string(increments[i]) + "," + to_string(writtenBytes[i]) + "|";
+        }
+    }
+
+    LevelDBKeyManager::getInstance()->writeMeta(CHECKPOINT_KEY, info);
+
+}
+
 size_t ValueLog::getTotalDbSize() {
     lock_guard<mutex> lockGuard(m);
     return totalDbSize;
@@ -0,0 +1,387 @@
+#include "write_ahead_log.h"
+#include "buffer_manager.h"
+#include "configManager.h"
+#include "constant.h"
+#include "crc32c.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <boost/filesystem.hpp>
+
+// 记录格式：[记录体长度 u32][记录体的 crc32c u32][type u8][keyLen u32][key][valueLen u32][value]
+static const size_t WAL_RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+static void appendUInt32(string &out, uint32_t v) {
+    out.append((const char *) &v, sizeof(uint32_t));
+}
+
+static bool writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+WriteAheadLog::WriteAheadLog() : opened(false), nextLsn(0), writtenLsn(0), writing(false), dirty(false),
+                                 flushRequested(false), fd(-1), segmentSize(0), running(false) {
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    // 正常退出时 BufferManager 析构里已经 clear 过了，这里只处理没有走到那一步的情况，段文件留着重启时重放
+    {
+        lock_guard<mutex> lockGuard(m);
+        running = false;
+        syncCond.notify_all();
+    }
+    if (syncer.joinable()) {
+        syncer.join();
+    }
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+        fd = -1;
+    }
+}
+
+string WriteAheadLog::getFilename(uint64_t startLsn) {
+    return ConfigManager::getInstance().getVALDir() + "/wal@" + to_string(startLsn);
+}
+
+uint64_t WriteAheadLog::replaySegment(const string &filename) {
+
+    BufferManager *bufferManager = BufferManager::getInstance();
+
+    int segmentFd = open(filename.c_str(), O_RDONLY);
+    if (segmentFd < 0) {
+        printf("open wal segment %s fail\n", filename.c_str());
+        return 0;
+    }
+    string data;
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(segmentFd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    close(segmentFd);
+
+    uint64_t count = 0;
+    size_t offset = 0;
+
+    // 段尾可能是 crash 时写了一半的记录，遇到第一条不完整或者校验不过的记录就停下
+    while (offset + WAL_RECORD_HEADER_SIZE <= data.size()) {
+
+        uint32_t length, sum;
+        memcpy(&length, data.data() + offset, sizeof(uint32_t));
+        memcpy(&sum, data.data() + offset + sizeof(uint32_t), sizeof(uint32_t));
+        const char *body = data.data() + offset + WAL_RECORD_HEADER_SIZE;
+        if (length < 1 + 2 * sizeof(uint32_t) || length > data.size() - offset - WAL_RECORD_HEADER_SIZE ||
+            crc32c(body, length) != sum) {
+            break;
+        }
+
+        uint8_t type = body[0];
+        uint32_t keyLen, valueLen;
+        memcpy(&keyLen, body + 1, sizeof(uint32_t));
+        if (keyLen > length - 1 - 2 * sizeof(uint32_t)) {
+            break;
+        }
+        memcpy(&valueLen, body + 1 + sizeof(uint32_t) + keyLen, sizeof(uint32_t));
+        if (1 + 2 * sizeof(uint32_t) + keyLen + valueLen != length) {
+            break;
+        }
+        string key(body + 1 + sizeof(uint32_t), keyLen);
+
+        uint64_t lsn;
+        if (type == PUT_RECORD) {
+            string value(body + 1 + 2 * sizeof(uint32_t) + keyLen, valueLen);
+            int idx = bufferManager->put(key, value, lsn);
+            if (idx != -1) {
+                bufferManager->flush(idx);
+            }
+        } else if (type == DELETE_RECORD) {
+            bufferManager->del(key, lsn);
+        } else {
+            break;
+        }
+
+        offset += WAL_RECORD_HEADER_SIZE + length;
+        count++;
+
+    }
+
+    if (offset < data.size()) {
+        printf("wal segment %s: %zu bytes after offset %zu are ignored\n", filename.c_str(), data.size() - offset,
+               offset);
+    }
+
+    return count;
+
+}
+
+void WriteAheadLog::recover() {
+
+    ConfigManager &configManager = ConfigManager::getInstance();
+
+    // 找到已有的段，按起始 lsn 排好
+    vector<uint64_t> oldSegments;
+    boost::filesystem::path dirPath(configManager.getVALDir());
+    boost::filesystem::directory_iterator itEnd;
+    for (boost::filesystem::directory_iterator it(dirPath); it != itEnd; ++it) {
+        string name = it->path().filename().string();
+        unsigned long long startLsn;
+        char rest;
+        if (sscanf(name.c_str(), "wal@%llu%c", &startLsn, &rest) == 1) {
+            oldSegments.push_back(startLsn);
+        }
+    }
+    sort(oldSegments.begin(), oldSegments.end());
+
+    // opened 为 false，重放时的写入不会再记 wal
+    uint64_t lsn = oldSegments.empty() ? 0 : oldSegments[0];
+    uint64_t count = 0;
+    for (uint64_t startLsn: oldSegments) {
+        uint64_t n = replaySegment(getFilename(startLsn));
+        count += n;
+        lsn = max(lsn, startLsn + n);
+    }
+
+    if (count > 0) {
+        printf("replay %llu wal records\n", (unsigned long long) count);
+        // 重放的数据落盘并同步之后旧的段才能删
+        BufferManager::getInstance()->flushAll();
+        BufferManager::getInstance()->syncFlushed();
+    }
+
+    for (uint64_t startLsn: oldSegments) {
+        remove(getFilename(startLsn).c_str());
+    }
+
+    if (!configManager.enableCrashConsistency()) {
+        return;
+    }
+
+    string filename = getFilename(lsn);
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("open wal segment %s fail, wal disabled\n", filename.c_str());
+        return;
+    }
+
+    lock_guard<mutex> lockGuard(m);
+    nextLsn = writtenLsn = lsn;
+    segments.push_back(lsn);
+    segmentSize = 0;
+    opened = true;
+
+    if (!configManager.syncWal()) {
+        running = true;
+        syncer = std::thread(&WriteAheadLog::backgroundSync, this);
+    }
+
+}
+
+uint64_t WriteAheadLog::append(RecordType type, const string &key, const string &value) {
+
+    string record;
+    record.reserve(WAL_RECORD_HEADER_SIZE + 1 + 2 * sizeof(uint32_t) + key.size() + value.size());
+    record.append(WAL_RECORD_HEADER_SIZE, '\0');
+    record.push_back((char) type);
+    appendUInt32(record, key.size());
+    record.append(key);
+    appendUInt32(record, value.size());
+    record.append(value);
+
+    auto length = (uint32_t) (record.size() - WAL_RECORD_HEADER_SIZE);
+    uint32_t sum = crc32c(record.data() + WAL_RECORD_HEADER_SIZE, length);
+    memcpy(&record[0], &length, sizeof(uint32_t));
+    memcpy(&record[sizeof(uint32_t)], &sum, sizeof(uint32_t));
+
+    lock_guard<mutex> lockGuard(m);
+    if (!opened) {
+        return NO_LSN;
+    }
+    pending.append(record);
+    return nextLsn++;
+
+}
+
+void WriteAheadLog::commit(uint64_t lsn) {
+
+    if (lsn == NO_LSN) {
+        return;
+    }
+
+    unique_lock<mutex> lock(m);
+
+    while (writtenLsn <= lsn) {
+
+        if (writing) {
+            commitCond.wait(lock);
+            continue;
+        }
+
+        // 当 leader，把目前所有线程攒下的记录一次写下去
+        writing = true;
+        string batch;
+        batch.swap(pending);
+        uint64_t batchStart = writtenLsn;
+        uint64_t batchEnd = nextLsn;
+
+        lock.unlock();
+        writeBatch(batchStart, batch);
+        lock.lock();
+
+        writtenLsn = batchEnd;
+        writing = false;
+        commitCond.notify_all();
+
+    }
+
+}
+
+void WriteAheadLog::writeBatch(uint64_t startLsn, const string &batch) {
+
+    lock_guard<mutex> lockGuard(fileMutex);
+
+    // 当前段写满了，换一个新的段，旧段在关闭前 fsync，保证只有最后一个段的末尾可能是不完整的
+    if (segmentSize > 0 && segmentSize + batch.size() > WAL_SEGMENT_SIZE) {
+        string filename = getFilename(startLsn);
+        int newFd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (newFd < 0) {
+            printf("open wal segment %s fail\n", filename.c_str());
+        } else {
+            fsync(fd);
+            close(fd);
+            fd = newFd;
+            segmentSize = 0;
+            lock_guard<mutex> segmentLock(m);
+            segments.push_back(startLsn);
+            if (segments.size() > WAL_MAX_SEGMENTS) {
+                flushRequested.store(true);
+            }
+        }
+    }
+
+    if (!writeAll(fd, batch.data(), batch.size())) {
+        printf("write wal fail, errno = %d\n", errno);
+    }
+    segmentSize += batch.size();
+
+    if (ConfigManager::getInstance().syncWal()) {
+        fdatasync(fd);
+    } else {
+        lock_guard<mutex> dirtyLock(m);
+        dirty = true;
+    }
+
+}
+
+void WriteAheadLog::backgroundSync() {
+
+    auto interval = chrono::milliseconds(ConfigManager::getInstance().getWalSyncInterval());
+
+    unique_lock<mutex> lock(m);
+
+    while (running) {
+
+        syncCond.wait_for(lock, interval, [this]() { return !running; });
+        if (!running || !dirty) {
+            continue;
+        }
+        dirty = false;
+        lock.unlock();
+
+        // 换段时旧的 fd 会被关掉，拿一份自己的 fd 再 fsync，fsync 期间不挡住 leader 写
+        int syncFd;
+        {
+            lock_guard<mutex> fileLock(fileMutex);
+            syncFd = dup(fd);
+        }
+        if (syncFd >= 0) {
+            fdatasync(syncFd);
+            close(syncFd);
+        }
+
+        lock.lock();
+
+    }
+
+}
+
+uint64_t WriteAheadLog::getNextLsn() {
+    lock_guard<mutex> lockGuard(m);
+    return nextLsn;
+}
+
+bool WriteAheadLog::hasOldSegments() {
+    lock_guard<mutex> lockGuard(m);
+    return segments.size() > 1;
+}
+
+void WriteAheadLog::truncate(uint64_t minLiveLsn) {
+
+    vector<uint64_t> removed;
+    {
+        lock_guard<mutex> lockGuard(m);
+        // 段 i 里的 lsn 都小于段 i + 1 的起始 lsn
+        size_t n = 0;
+        while (n + 1 < segments.size() && segments[n + 1] <= minLiveLsn) {
+            n++;
+        }
+        removed.assign(segments.begin(), segments.begin() + n);
+        segments.erase(segments.begin(), segments.begin() + n);
+    }
+
+    for (uint64_t startLsn: removed) {
+        remove(getFilename(startLsn).c_str());
+    }
+
+}
+
+bool WriteAheadLog::takeFlushRequest(uint64_t &bound) {
+    if (!flushRequested.load() || !flushRequested.exchange(false)) {
+        return false;
+    }
+    lock_guard<mutex> lockGuard(m);
+    if (segments.size() <= WAL_MAX_SEGMENTS) {
+        return false;
+    }
+    bound = segments[1];
+    return true;
+}
+
+void WriteAheadLog::clear() {
+
+    vector<uint64_t> removed;
+    {
+        lock_guard<mutex> lockGuard(m);
+        opened = false;
+        running = false;
+        syncCond.notify_all();
+        removed.swap(segments);
+    }
+    if (syncer.joinable()) {
+        syncer.join();
+    }
+
+    lock_guard<mutex> fileLock(fileMutex);
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    for (uint64_t startLsn: removed) {
+        remove(getFilename(startLsn).c_str());
+    }
+
+}
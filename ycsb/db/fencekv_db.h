@@ -8,32 +8,29 @@
 #include "../core/db.h"
 #include <iostream>
 #include <string>
-#include <mutex>
 #include "../core/properties.h"
-#include "../../server.h"
+#include "server.h"
 
 using std::cout;
 using std::endl;
 
 namespace ycsbc {
 
+    // dfdb::Server 本身是线程安全的，这里不再加全局锁，否则 -threads n 测出来的只是单线程的性能
     class FenceKV : public DB {
 
     private:
-        std::mutex mutex_;
-        Server *server;
+        dfdb::Server *server;
 
     public:
 
         FenceKV() {
-            server = Server::getInstance();
+            server = dfdb::Server::getInstance();
         }
 
         int Read(const std::string &table, const std::string &key, const std::vector<std::string> *fields,
                  std::vector<KVPair> &result) {
 
-            std::lock_guard<std::mutex> lock(mutex_);
-
             string value;
             // 只操作，不管正确性
             server->get(key, value);
@@ -46,8 +43,6 @@ namespace ycsbc {
                  int len, const std::vector<std::string> *fields,
                  std::vector<std::vector<KVPair>> &result) {
 
-            std::lock_guard<std::mutex> lock(mutex_);
-
             vector<string> keys;
             vector<string> values;
             server->getRange(key, len, keys, values);
@@ -58,8 +53,6 @@ namespace ycsbc {
 
         int Insert(const std::string &table, const std::string &key, std::vector<KVPair> &values) {
 
-            std::lock_guard<std::mutex> lock(mutex_);
-
             // 具体插入的 value 随便选一个就行
             server->put(key, values[0].second);
 
@@ -70,8 +63,6 @@ namespace ycsbc {
         int Update(const std::string &table, const std::string &key,
                    std::vector<KVPair> &values) {
 
-            std::lock_guard<std::mutex> lock(mutex_);
-
             server->put(key, values[0].second);
 
             return 0;
@@ -80,8 +71,6 @@ namespace ycsbc {
 
         int Delete(const std::string &table, const std::string &key) {
 
-            std::lock_guard<std::mutex> lock(mutex_);
-
             server->del(key);
 
             return 0;
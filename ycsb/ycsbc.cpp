@@ -61,6 +61,8 @@ int DoYcsbTest(const int argc, const char *argv[]) {
     const bool print_stats = utils::StrToBool(props["dbstatistics"]);
     const bool wait_for_balance = utils::StrToBool(props["dbwaitforbalance"]);
 
+    const int scalability = stoi(props.GetProperty("scalability", "0"));
+
     string morerun = props["morerun"];
 
     vector<future<int>> actual_ops;
@@ -172,6 +174,9 @@ int DoYcsbTest(const int argc, const char *argv[]) {
         }
 
     }
+    if (scalability > 0) {
+        RunScalability(db, props, scalability);
+    }
     if (!morerun.empty()) {
         vector<string> runfilenames;
         size_t start = 0, index = morerun.find_first_of(':', 0);
@@ -287,6 +292,51 @@ int DoYcsbTest(const int argc, const char *argv[]) {
     return 0;
 }
 
+// 依次用 1..maxThreads 个线程跑同一个 run workload，打印各自的吞吐，用来观察从多少线程开始不再扩展
+void RunScalability(ycsbc::DB *db, utils::Properties &props, const int maxThreads) {
+
+    const int total_ops = stoi(props[ycsbc::CoreWorkload::OPERATION_COUNT_PROPERTY]);
+
+    vector<double> iops(maxThreads + 1, 0);
+
+    for (int num_threads = 1; num_threads <= maxThreads; ++num_threads) {
+
+        ycsbc::CoreWorkload wl;
+        wl.Init(props);
+
+        for (int j = 0; j < ycsbc::Operation::READMODIFYWRITE + 1; j++) {
+            ops_cnt[j].store(0);
+            ops_time[j].store(0);
+        }
+
+        vector<future<int>> actual_ops;
+        uint64_t run_start = get_now_micros();
+        for (int i = 0; i < num_threads; ++i) {
+            actual_ops.push_back(async(launch::async, DelegateClient, db, &wl, total_ops / num_threads, false));
+        }
+        int sum = 0;
+        for (auto &n: actual_ops) {
+            assert(n.valid());
+            sum += n.get();
+        }
+        uint64_t use_time = get_now_micros() - run_start;
+
+        iops[num_threads] = 1.0 * sum * 1e6 / use_time;
+        fprintf(stderr, "scalability: %d threads done%30s\n", num_threads, "");
+
+    }
+
+    printf("********** scalability result **********\n");
+    printf("threads  IOPS            speedup  efficiency\n");
+    for (int num_threads = 1; num_threads <= maxThreads; ++num_threads) {
+        double speedup = iops[num_threads] / iops[1];
+        printf("%7d  %12.2f    %6.2fx  %9.1f%%\n", num_threads, iops[num_threads], speedup,
+               100.0 * speedup / num_threads);
+    }
+    printf("****************************************\n");
+
+}
+
 /*
     -threads
     -db
@@ -300,6 +350,7 @@ int DoYcsbTest(const int argc, const char *argv[]) {
     -dbstatistics
     -dbwaitforbalance
     -morerun
+    -scalability
     -P
 */
 string ParseCommandLine(int argc, const char *argv[], utils::Properties &props) {
@@ -402,6 +453,14 @@ string ParseCommandLine(int argc, const char *argv[], utils::Properties &props)
             }
             props.SetProperty("morerun", argv[argindex]);
             argindex++;
+        } else if (strcmp(argv[argindex], "-scalability") == 0) {
+            argindex++;
+            if (argindex >= argc) {
+                UsageMessage(argv[0]);
+                exit(0);
+            }
+            props.SetProperty("scalability", argv[argindex]);
+            argindex++;
         } else if (strcmp(argv[argindex], "-P") == 0) {
             argindex++;
             if (argindex >= argc) {
@@ -437,6 +496,8 @@ void UsageMessage(const char *command) {
     cout << "Options:" << endl;
     cout << "  -threads n: execute using n threads (default: 1)" << endl;
     cout << "  -db dbname: specify the name of the DB to use (default: basic)" << endl;
+    cout << "  -scalability n: after loading, run the workload with 1..n threads and report" << endl;
+    cout << "                  the throughput of each thread count" << endl;
     cout << "  -P propertyfile: load properties from the given file. Multiple files can" << endl;
     cout << "                   be specified, and will be processed in the order specified" << endl;
 }
@@ -455,6 +516,7 @@ void Init(utils::Properties &props) {
     props.SetProperty("dbstatistics", "false");
     props.SetProperty("dbwaitforbalance", "false");
     props.SetProperty("morerun", "");
+    props.SetProperty("scalability", "0");
 }
 
 void PrintInfo(utils::Properties &props) {
@@ -33,6 +33,8 @@ void PrintInfo(utils::Properties &props);
 int DelegateClient(ycsbc::DB *db, ycsbc::CoreWorkload *wl, const int num_ops,
                    bool is_loading);
 
+void RunScalability(ycsbc::DB *db, utils::Properties &props, const int maxThreads);
+
 int DoYcsbTest(const int argc, const char *argv[]);
 
 #endif //TREEKV_YCSBC_H